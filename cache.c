@@ -0,0 +1,292 @@
+/*
+ * cache.c
+ * In-memory file cache for miniquark
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "missing/compat.h"
+
+#include "cache.h"
+#include "digest.h"
+#include "gzip.h"
+
+/* globals */
+static struct cache_entry *buckets[CACHE_BUCKETS];
+static struct cache_entry *lru_head; /* most recently used */
+static struct cache_entry *lru_tail;
+static struct cache_stats stats;
+
+static unsigned int
+hash_path(const char *s) {
+	unsigned int h = 2166136261u;
+
+	while (*s)
+		h = (h ^ (unsigned char) *s++) * 16777619u;
+	return h;
+}
+
+static struct cache_entry *
+lookup(const char *path) {
+	struct cache_entry *e;
+
+	for (e = buckets[hash_path(path) % CACHE_BUCKETS]; e; e = e->next) {
+		if (strcmp(e->path, path) == 0)
+			return e;
+	}
+	return NULL;
+}
+
+static void
+entry_free(struct cache_entry *e) {
+	free(e->path);
+	free(e->data);
+	free(e->gz);
+	free(e);
+}
+
+static void
+lru_unlink(struct cache_entry *e) {
+	if (e->lru_prev)
+		e->lru_prev->lru_next = e->lru_next;
+	else
+		lru_head = e->lru_next;
+	if (e->lru_next)
+		e->lru_next->lru_prev = e->lru_prev;
+	else
+		lru_tail = e->lru_prev;
+	e->lru_prev = e->lru_next = NULL;
+}
+
+static void
+lru_push(struct cache_entry *e) {
+	e->lru_next = lru_head;
+	if (lru_head)
+		lru_head->lru_prev = e;
+	lru_head = e;
+	if (!lru_tail)
+		lru_tail = e;
+}
+
+/*
+ * evict - remove an entry from the cache; memory is released once no
+ * response refers to it
+ */
+static void
+evict(struct cache_entry *e) {
+	struct cache_entry **pp;
+
+	for (pp = &buckets[hash_path(e->path) % CACHE_BUCKETS]; *pp != e; pp = &(*pp)->next)
+		;
+	*pp = e->next;
+	lru_unlink(e);
+	stats.entries--;
+	stats.size -= ENTRY_SIZE(e);
+	stats.evictions++;
+
+	if (e->refs > 0)
+		e->stale = 1;
+	else
+		entry_free(e);
+}
+
+static int
+file_changed(const struct stat *a, const struct stat *b) {
+	return a->st_size != b->st_size || a->st_ino != b->st_ino || a->st_dev != b->st_dev
+	       || a->st_mtim.tv_sec != b->st_mtim.tv_sec || a->st_mtim.tv_nsec != b->st_mtim.tv_nsec;
+}
+
+/*
+ * cache_stat - stat(2) for files that may be cached
+ * A cached file is checked for modification at most once per second
+ */
+int
+cache_stat(const char *path, struct stat *st) {
+	int saved_errno;
+	time_t now;
+	struct cache_entry *e;
+
+	if ((e = lookup(path)) == NULL)
+		return stat(path, st);
+
+	now = time(NULL);
+	if (e->checked == now) {
+		memcpy(st, &e->st, sizeof(struct stat));
+		return 0;
+	}
+	if (stat(path, st) < 0) {
+		saved_errno = errno;
+		evict(e);
+		errno = saved_errno;
+		return -1;
+	}
+	if (file_changed(st, &e->st))
+		evict(e);
+	else
+		e->checked = now;
+	return 0;
+}
+
+/*
+ * load_file - read the contents and compute the digest of a small file that
+ * matches a previous stat
+ * The digest of a larger file is computed by a child process, and is not
+ * available until digest_read() receives it
+ */
+static int
+load_file(struct cache_entry *e, const char *path, const struct stat *st) {
+	int fd;
+	ssize_t nr;
+	off_t len = 0;
+	const char *digest;
+	SHA256_CTX ctx;
+	struct stat fd_st;
+
+	if (st->st_size > CACHE_FILE_MAX) {
+		if ((digest = digest_lookup(st)))
+			memcpy(e->digest, digest, sizeof(e->digest));
+		else
+			digest_request(path, st);
+		return 0;
+	}
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return -1;
+	if (fstat(fd, &fd_st) < 0 || file_changed(&fd_st, st))
+		goto fail;
+	if ((e->data = malloc(st->st_size + 1)) == NULL)
+		goto fail;
+
+	while (len < st->st_size) {
+		if ((nr = read(fd, e->data + len, st->st_size - len)) <= 0) {
+			if (nr < 0 && errno == EINTR)
+				continue;
+			goto fail;
+		}
+		len += nr;
+	}
+	sha256_init(&ctx);
+	sha256_update(&ctx, e->data, st->st_size);
+	sha256_end(&ctx, e->digest);
+	e->text = memchr(e->data, '\0', st->st_size) == NULL;
+	digest_insert(st, e->digest);
+	close(fd);
+	return 0;
+fail:
+	close(fd);
+	return -1;
+}
+
+/*
+ * cache_get - acquire a reference to the digest and possibly the contents of
+ * a file
+ * Returns NULL if the file cannot be cached
+ */
+struct cache_entry *
+cache_get(const char *path, const struct stat *st) {
+	struct cache_entry *e;
+	unsigned int bucket;
+	off_t size;
+	const char *digest;
+
+	if ((e = lookup(path))) {
+		stats.hits++;
+		lru_unlink(e);
+		lru_push(e);
+		e->refs++;
+		if (!e->digest[0] && (digest = digest_lookup(&e->st)))
+			memcpy(e->digest, digest, sizeof(e->digest));
+		return e;
+	}
+
+	stats.misses++;
+	if (!S_ISREG(st->st_mode))
+		return NULL;
+
+	/* discard least recently used entries to make room */
+	size = (st->st_size <= CACHE_FILE_MAX) ? st->st_size : 0;
+	for (e = lru_tail; e; e = lru_tail) {
+		if (stats.size + size <= CACHE_MAX_SIZE && stats.entries < CACHE_MAX_ENTRIES)
+			break;
+		evict(e);
+	}
+
+	if ((e = calloc(1, sizeof(struct cache_entry))) == NULL)
+		return NULL;
+	if ((e->path = strdup(path)) == NULL || load_file(e, path, st) < 0) {
+		entry_free(e);
+		return NULL;
+	}
+	memcpy(&e->st, st, sizeof(struct stat));
+	e->checked = time(NULL);
+	e->refs = 1;
+
+	bucket = hash_path(path) % CACHE_BUCKETS;
+	e->next = buckets[bucket];
+	buckets[bucket] = e;
+	lru_push(e);
+	stats.entries++;
+	stats.size += ENTRY_SIZE(e);
+	return e;
+}
+
+/*
+ * cache_release - drop a reference acquired by cache_get()
+ */
+void
+cache_release(struct cache_entry *e) {
+	if (--e->refs == 0 && e->stale)
+		entry_free(e);
+}
+
+/*
+ * cache_gzip - compress the contents of a text file once
+ * Returns 0 if a compressed copy smaller than the original is available
+ */
+int
+cache_gzip(struct cache_entry *e) {
+	struct cache_entry *v;
+	size_t len;
+
+	if (e->gz)
+		return 0;
+	if (e->gz_tried || e->stale || !COMPRESSIBLE(e))
+		return -1;
+	e->gz_tried = 1;
+
+	if ((e->gz = gzip_compress(e->data, e->st.st_size, &len)) == NULL)
+		return -1;
+
+	/* keep the result only if it is worth sending */
+	if (len >= (size_t) e->st.st_size * 9 / 10)
+		goto discard;
+
+	/* discard least recently used entries to make room, as for the file */
+	for (v = lru_tail; v && v != e; v = lru_tail) {
+		if (stats.size + len <= CACHE_MAX_SIZE)
+			break;
+		evict(v);
+	}
+	if (stats.size + len > CACHE_MAX_SIZE)
+		goto discard;
+
+	e->gz_size = len;
+	stats.size += e->gz_size;
+	return 0;
+
+discard:
+	free(e->gz);
+	e->gz = NULL;
+	return -1;
+}
+
+const struct cache_stats *
+cache_stats(void) {
+	return &stats;
+}
@@ -0,0 +1,53 @@
+/*
+ * cache.h
+ * In-memory file cache for miniquark
+ */
+
+#include <sys/stat.h>
+
+#include <time.h>
+
+#include "sha256.h"
+
+#define CACHE_BUCKETS 256
+#define CACHE_MAX_SIZE 67108864 /* total size of cached file contents */
+#define CACHE_FILE_MAX 8388608  /* larger files are always read from disk */
+#define CACHE_MAX_ENTRIES 4096
+#define COMPRESS_MIN_SIZE 1024    /* smaller text files are not compressed */
+#define COMPRESS_MAX_SIZE 1048576 /* nor are larger ones, to bound the time spent */
+
+#define ENTRY_SIZE(e) (((e)->data ? (e)->st.st_size : 0) + (e)->gz_size)
+#define COMPRESSIBLE(e) \
+	((e)->text && (e)->st.st_size >= COMPRESS_MIN_SIZE && (e)->st.st_size <= COMPRESS_MAX_SIZE)
+
+struct cache_entry {
+	char *path;
+	struct stat st;
+	char *data;     /* NULL if the file is too large to hold in memory */
+	/* empty until a child has computed the digest of a large file */
+	char digest[SHA256_DIGEST_STRING_LENGTH];
+	int text;       /* contents do not contain NUL bytes */
+	char *gz;       /* contents in the gzip format */
+	off_t gz_size;
+	int gz_tried;
+	time_t checked; /* last time the file was found to be unchanged */
+	int refs;       /* responses currently sending this entry */
+	int stale;      /* removed from the cache, free when unreferenced */
+	struct cache_entry *next;
+	struct cache_entry *lru_prev;
+	struct cache_entry *lru_next;
+};
+
+struct cache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	unsigned long entries;
+	size_t size;
+};
+
+int cache_stat(const char *, struct stat *);
+struct cache_entry *cache_get(const char *, const struct stat *);
+void cache_release(struct cache_entry *);
+int cache_gzip(struct cache_entry *);
+const struct cache_stats *cache_stats(void);
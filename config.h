@@ -5,8 +5,10 @@
 /* templates */
 #define REMOTE_STAGE_DIR "/tmp/rset_%08" PRIx32
 #define LOCAL_CONTROL_SOCKET "/tmp/rset_control_%s"
+#define LOCAL_HTTP_SOCKET "/tmp/rset_httpd_%d.sock"
 #define LOG_TIMESTAMP_FORMAT "%F %T%z"
 #define WORKER_TIMESTAMP_FORMAT "%F_%H%M%S"
+#define ROUTES_SNAPSHOT ".%s.snapshot"
 
 /* defaults */
 #define INSTALL_PORT 6000
@@ -26,6 +28,9 @@
 /* limits */
 #define MAX_WORKERS 20
 #define MAX_LABELS 100
+#define MAX_HOSTS 65536
+#define MAX_PARSERS 64
+#define PARSER_MIN_FILES 8 /* pln files per parser process */
 
 /* colors */
 #define HL_REVERSE "\x1b[7m"
@@ -0,0 +1,352 @@
+/*
+ * digest.c
+ * Digests of served files, keyed by inode, size and modification time
+ * Large files are hashed by child processes, which send the result to the
+ * server over a pipe so that other connections are not held up
+ */
+
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "missing/compat.h"
+
+#include "digest.h"
+#include "sha256.h"
+
+/* identifies one version of a file */
+struct digest_key {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	long mtime_nsec;
+};
+
+/* written by a child in one write(2), which is atomic for a pipe */
+struct digest_record {
+	struct digest_key key;
+	char digest[SHA256_DIGEST_STRING_LENGTH]; /* empty if the file could not be read */
+};
+
+struct digest_entry {
+	struct digest_key key;
+	char digest[SHA256_DIGEST_STRING_LENGTH];
+	pid_t pending; /* the child computing the digest, or 0 */
+	struct digest_entry *next;
+};
+
+/* globals */
+static struct digest_entry *buckets[DIGEST_BUCKETS];
+static unsigned int n_entries;
+static unsigned int evict_bucket;
+static int record_fd[2] = { -1, -1 };
+static struct digest_record partial;
+static size_t partial_len;
+
+static void
+key_init(struct digest_key *key, const struct stat *st) {
+	/* keys are compared with memcmp, including padding */
+	memset(key, 0, sizeof(*key));
+	key->dev = st->st_dev;
+	key->ino = st->st_ino;
+	key->size = st->st_size;
+	key->mtime = st->st_mtim.tv_sec;
+	key->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+static unsigned int
+hash_key(const struct digest_key *key) {
+	unsigned int h = 2166136261u;
+	const unsigned char *p = (const unsigned char *) key;
+	size_t i;
+
+	for (i = 0; i < sizeof(*key); i++)
+		h = (h ^ p[i]) * 16777619u;
+	return h;
+}
+
+/*
+ * evict - free the oldest entry of the next bucket that has one
+ * Buckets are visited in turn, so that no part of the index is favored
+ */
+static void
+evict(void) {
+	struct digest_entry **pp;
+	unsigned int i;
+
+	for (i = 0; i < DIGEST_BUCKETS; i++) {
+		pp = &buckets[evict_bucket];
+		evict_bucket = (evict_bucket + 1) % DIGEST_BUCKETS;
+		if (*pp == NULL)
+			continue;
+		while ((*pp)->next)
+			pp = &(*pp)->next;
+		free(*pp);
+		*pp = NULL;
+		n_entries--;
+		return;
+	}
+}
+
+static struct digest_entry *
+lookup(const struct digest_key *key, int create) {
+	unsigned int bucket = hash_key(key) % DIGEST_BUCKETS;
+	struct digest_entry *e;
+
+	for (e = buckets[bucket]; e; e = e->next) {
+		if (memcmp(&e->key, key, sizeof(*key)) == 0)
+			return e;
+	}
+	if (!create)
+		return NULL;
+	if (n_entries >= DIGEST_MAX_ENTRIES)
+		evict();
+	if ((e = calloc(1, sizeof(struct digest_entry))) == NULL)
+		return NULL;
+	memcpy(&e->key, key, sizeof(*key));
+	e->next = buckets[bucket];
+	buckets[bucket] = e;
+	n_entries++;
+	return e;
+}
+
+/*
+ * digest_init - open the pipe that children send digests over
+ * Returns the descriptor to poll for digest_read(), or -1
+ */
+int
+digest_init(void) {
+	if (pipe(record_fd) < 0)
+		return -1;
+	fcntl(record_fd[0], F_SETFL, fcntl(record_fd[0], F_GETFL) | O_NONBLOCK);
+	fcntl(record_fd[0], F_SETFD, FD_CLOEXEC);
+	fcntl(record_fd[1], F_SETFD, FD_CLOEXEC);
+	return record_fd[0];
+}
+
+/*
+ * digest_lookup - the digest of a file if it is known
+ */
+const char *
+digest_lookup(const struct stat *st) {
+	struct digest_key key;
+	struct digest_entry *e;
+
+	key_init(&key, st);
+	if ((e = lookup(&key, 0)) == NULL || !e->digest[0])
+		return NULL;
+	return e->digest;
+}
+
+void
+digest_insert(const struct stat *st, const char *digest) {
+	struct digest_key key;
+	struct digest_entry *e;
+
+	key_init(&key, st);
+	if ((e = lookup(&key, 1)) == NULL)
+		return;
+	memcpy(e->digest, digest, sizeof(e->digest));
+	e->pending = 0;
+}
+
+/*
+ * digest_child_init - prepare a child of the server: the signal handlers of the
+ * server are reset, the pipe to the server is moved to STDERR_FILENO + 1,
+ * keep_fd, if not -1, to the descriptor after it, and the others are closed
+ * Returns -1 on error
+ */
+int
+digest_child_init(int keep_fd) {
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGHUP, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGQUIT, SIG_DFL);
+	signal(SIGUSR1, SIG_DFL);
+
+	if (keep_fd == STDERR_FILENO + 1) {
+		if ((keep_fd = dup(keep_fd)) == -1)
+			return -1;
+	}
+	if (record_fd[1] != STDERR_FILENO + 1 && dup2(record_fd[1], STDERR_FILENO + 1) == -1)
+		return -1;
+	record_fd[1] = STDERR_FILENO + 1;
+	if (keep_fd != -1 && keep_fd != STDERR_FILENO + 2
+	    && dup2(keep_fd, STDERR_FILENO + 2) == -1)
+		return -1;
+	closefrom(STDERR_FILENO + (keep_fd != -1 ? 3 : 2));
+	return 0;
+}
+
+/*
+ * digest_child - start a process that is not waited for and holds none of
+ * the connections of the server; see digest_child_init()
+ * Returns 0 in the child, the process ID of the child in the server or -1 on
+ * error
+ */
+pid_t
+digest_child(int keep_fd) {
+	int status;
+	int pid_fd[2];
+	pid_t pid, child_pid;
+
+	if (pipe(pid_fd) == -1)
+		return -1;
+	switch (pid = fork()) {
+	case -1:
+		close(pid_fd[0]);
+		close(pid_fd[1]);
+		return -1;
+	case 0:
+		/* the intermediate process exits so that the child is reparented */
+		close(pid_fd[0]);
+		switch (child_pid = fork()) {
+		case -1:
+			_exit(1);
+		case 0:
+			break;
+		default:
+			if (write(pid_fd[1], &child_pid, sizeof(child_pid)) != sizeof(child_pid))
+				_exit(1);
+			_exit(0);
+		}
+		close(pid_fd[1]);
+		if (digest_child_init(keep_fd) == -1)
+			_exit(1);
+		return 0;
+	}
+	close(pid_fd[1]);
+	while (waitpid(pid, &status, 0) == -1) {
+		if (errno != EINTR) {
+			close(pid_fd[0]);
+			return -1;
+		}
+	}
+	if (read(pid_fd[0], &child_pid, sizeof(child_pid)) != sizeof(child_pid))
+		child_pid = -1;
+	close(pid_fd[0]);
+	return (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? child_pid : -1;
+}
+
+/*
+ * digest_request - compute the digest of a file in a child process unless it
+ * is known or already being computed
+ */
+void
+digest_request(const char *path, const struct stat *st) {
+	char digest[SHA256_DIGEST_STRING_LENGTH];
+	struct digest_key key;
+	struct digest_entry *e;
+	pid_t pid;
+
+	key_init(&key, st);
+	if (record_fd[1] == -1 || (e = lookup(&key, 1)) == NULL || e->digest[0])
+		return;
+
+	/* a child that exited without sending a record is not waited for */
+	if (e->pending && (kill(e->pending, 0) == 0 || errno != ESRCH))
+		return;
+	e->pending = 0;
+
+	switch (pid = digest_child(-1)) {
+	case -1:
+		break;
+	case 0:
+		if (digest_file(path, st, digest) < 0)
+			digest[0] = '\0';
+		digest_send(st, digest);
+		_exit(0);
+	default:
+		e->pending = pid;
+		break;
+	}
+}
+
+/*
+ * digest_read - add the digests sent by children
+ */
+void
+digest_read(void) {
+	ssize_t nr;
+	struct digest_entry *e;
+
+	while (1) {
+		nr = read(record_fd[0], (char *) &partial + partial_len, sizeof(partial) - partial_len);
+		if (nr < 0 && errno == EINTR)
+			continue;
+		if (nr <= 0)
+			return;
+		if ((partial_len += nr) < sizeof(partial))
+			continue;
+		partial_len = 0;
+
+		if ((e = lookup(&partial.key, 1)) == NULL)
+			continue;
+		/* a file that could not be read may be tried again */
+		memcpy(e->digest, partial.digest, sizeof(e->digest));
+		e->digest[sizeof(e->digest) - 1] = '\0';
+		e->pending = 0;
+	}
+}
+
+/*
+ * digest_file - compute the digest of a file if it still matches a stat
+ */
+int
+digest_file(const char *path, const struct stat *st, char *digest) {
+	int fd;
+	ssize_t nr;
+	off_t len = 0;
+	char buf[65536];
+	struct stat fd_st;
+	struct digest_key a, b;
+	SHA256_CTX ctx;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return -1;
+	if (fstat(fd, &fd_st) < 0)
+		goto fail;
+	key_init(&a, st);
+	key_init(&b, &fd_st);
+	if (memcmp(&a, &b, sizeof(a)) != 0)
+		goto fail;
+
+	sha256_init(&ctx);
+	while (len < st->st_size) {
+		if ((nr = read(fd, buf, sizeof(buf))) <= 0) {
+			if (nr < 0 && errno == EINTR)
+				continue;
+			goto fail;
+		}
+		sha256_update(&ctx, buf, nr);
+		len += nr;
+	}
+	if (len != st->st_size)
+		goto fail;
+	sha256_end(&ctx, digest);
+	close(fd);
+	return 0;
+fail:
+	close(fd);
+	return -1;
+}
+
+/*
+ * digest_send - send a digest computed by a child to the server
+ */
+void
+digest_send(const struct stat *st, const char *digest) {
+	struct digest_record r;
+
+	memset(&r, 0, sizeof(r));
+	key_init(&r.key, st);
+	memcpy(r.digest, digest, strlen(digest) + 1);
+	while (write(record_fd[1], &r, sizeof(r)) == -1 && errno == EINTR)
+		;
+}
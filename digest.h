@@ -0,0 +1,19 @@
+/*
+ * digest.h
+ * Digests of served files, keyed by inode, size and modification time
+ */
+
+#include <sys/stat.h>
+
+#define DIGEST_BUCKETS 4096
+#define DIGEST_MAX_ENTRIES 65536 /* files in the index */
+
+int digest_init(void);
+const char *digest_lookup(const struct stat *);
+void digest_insert(const struct stat *, const char *);
+void digest_request(const char *, const struct stat *);
+void digest_read(void);
+int digest_file(const char *, const struct stat *, char *);
+void digest_send(const struct stat *, const char *);
+int digest_child_init(int);
+pid_t digest_child(int);
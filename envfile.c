@@ -0,0 +1,242 @@
+/*
+ * envfile.c
+ * Validate and normalize environment files as renv(1) does
+ */
+
+#include <sys/stat.h>
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "envfile.h"
+#include "sha256.h"
+#include "xlibc.h"
+
+/* a rendered environment and the digest of its input */
+typedef struct {
+	char key[SHA256_DIGEST_STRING_LENGTH];
+	char digest[SHA256_DIGEST_STRING_LENGTH];
+	char *text;
+	size_t len;
+} EnvEntry;
+
+static EnvEntry env_cache[ENV_CACHE_SIZE];
+static int env_next;
+
+/*
+ * env_error - report a line in the format used by renv(1), replacing control
+ * characters and a trailing blank
+ */
+static void
+env_error(const char *msg, const char *line, size_t len) {
+	char repr[1024];
+	size_t i;
+
+	if (len >= sizeof(repr))
+		len = sizeof(repr) - 1;
+	for (i = 0; i < len; i++)
+		repr[i] = iscntrl((unsigned char) line[i]) ? '_' : line[i];
+	if (len > 0 && (repr[len - 1] == ' ' || repr[len - 1] == '\t'))
+		repr[len - 1] = '_';
+	repr[len] = '\0';
+	fprintf(stderr, "renv: %s: %s\n", msg, repr);
+}
+
+/*
+ * env_line - copy a name="value" line with quotes erased, blanks collapsed and
+ * $$ expanded to \$
+ * Returns the length written, or -1 if the line is not in this format
+ */
+static int
+env_line(const char *line, size_t len, char *out) {
+	size_t i, name_len, n = 0;
+
+	for (name_len = 0; name_len < len; name_len++)
+		if (!isalnum((unsigned char) line[name_len]) && line[name_len] != '_')
+			break;
+	if (name_len == 0 || len < name_len + 3 || line[name_len] != '='
+	    || line[name_len + 1] != '"' || line[len - 1] != '"')
+		return -1;
+	if (out == NULL)
+		return 0;
+
+	memcpy(out, line, name_len + 1);
+	n = name_len + 1;
+	out[n++] = '"';
+	for (i = name_len + 1; i < len; i++) {
+		if (line[i] == '"')
+			continue;
+		if (line[i] == ' ' || line[i] == '\t') {
+			if (out[n - 1] != ' ')
+				out[n++] = ' ';
+		} else if (line[i] == '$' && i + 1 < len && line[i + 1] == '$') {
+			out[n++] = '\\';
+			out[n++] = '$';
+			i++;
+		} else {
+			out[n++] = line[i];
+		}
+	}
+	if (out[n - 1] == ' ')
+		n--;
+	out[n++] = '"';
+	out[n++] = '\n';
+	return n;
+}
+
+/*
+ * env_filter - validate lines of name="value" and write them in a normalized
+ * format to out, which must have room for len + 1 bytes; out may be NULL to
+ * only validate
+ * Returns 0, or -1 after reporting the first line that is not permitted
+ */
+int
+env_filter(const char *in, size_t len, char *out, size_t *out_len) {
+	const char *line, *end;
+	size_t line_len, n = 0;
+	int r;
+
+	for (line = in; line < in + len; line = end + 1) {
+		if ((end = memchr(line, '\n', in + len - line)) == NULL)
+			end = in + len;
+		line_len = end - line;
+
+		if (memchr(line, '\\', line_len) || memchr(line, '`', line_len)
+		    || memmem(line, line_len, "$(", 2)) {
+			env_error("subshells not permitted", line, line_len);
+			return -1;
+		}
+		/* empty line or comment */
+		if (line_len == 0 || line[0] == '#')
+			continue;
+		if ((r = env_line(line, line_len, out ? out + n : NULL)) == -1) {
+			env_error("unknown pattern", line, line_len);
+			return -1;
+		}
+		n += r;
+	}
+	if (out_len)
+		*out_len = n;
+	return 0;
+}
+
+/*
+ * env_read - append the contents of a file, ending with a newline
+ */
+static int
+env_read(const char *path, char **buf, size_t *len, size_t *size) {
+	int fd;
+	ssize_t nr;
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		warn("%s", path);
+		return -1;
+	}
+	while (1) {
+		if (*size - *len < 4096) {
+			*buf = xrealloc(*buf, *size * 2, "buf");
+			*size *= 2;
+		}
+		if ((nr = read(fd, *buf + *len, *size - *len - 1)) == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("%s", path);
+			close(fd);
+			return -1;
+		}
+		if (nr == 0)
+			break;
+		*len += nr;
+	}
+	close(fd);
+	if (*len > 0 && (*buf)[*len - 1] != '\n')
+		(*buf)[(*len)++] = '\n';
+	return 0;
+}
+
+/*
+ * env_render - normalize the space-separated list of environment files
+ * followed by the environment and override lines
+ * Results are cached by the digest of their input, so that the same
+ * environment is only rendered once. The digest of the rendered text is
+ * returned so that callers can tell whether a remote copy differs
+ * Returns NULL if a file cannot be read or a line is not permitted
+ */
+const char *
+env_render(const char *files, const char *environment, const char *env_override, size_t *len,
+    const char **digest) {
+	int i;
+	size_t in_len = 0, in_size = 8192, n;
+	char *in, *list, *path, *p;
+	char key[SHA256_DIGEST_STRING_LENGTH];
+	EnvEntry *e;
+	SHA256_CTX ctx;
+
+	in = xmalloc(in_size, "in");
+	list = xstrdup(files, "list");
+	for (p = list; (path = strsep(&p, " ")) != NULL;) {
+		if (*path && env_read(path, &in, &in_len, &in_size) == -1) {
+			free(list);
+			free(in);
+			return NULL;
+		}
+	}
+	free(list);
+
+	/* the key covers the contents of the files and both sets of lines */
+	sha256_init(&ctx);
+	sha256_update(&ctx, in, in_len);
+	sha256_update(&ctx, "", 1);
+	sha256_update(&ctx, environment, strlen(environment));
+	sha256_update(&ctx, "", 1);
+	if (env_override)
+		sha256_update(&ctx, env_override, strlen(env_override));
+	sha256_end(&ctx, key);
+
+	for (i = 0; i < ENV_CACHE_SIZE; i++) {
+		e = &env_cache[i];
+		if (e->text && strcmp(e->key, key) == 0) {
+			free(in);
+			*len = e->len;
+			*digest = e->digest;
+			return e->text;
+		}
+	}
+
+	n = strlen(environment) + (env_override ? strlen(env_override) : 0);
+	in = xrealloc(in, in_len + n + 1, "in");
+	memcpy(in + in_len, environment, strlen(environment));
+	in_len += strlen(environment);
+	if (env_override) {
+		memcpy(in + in_len, env_override, strlen(env_override));
+		in_len += strlen(env_override);
+	}
+
+	e = &env_cache[env_next];
+	env_next = (env_next + 1) % ENV_CACHE_SIZE;
+	free(e->text);
+	e->text = NULL;
+	p = xmalloc(in_len + 1, "text");
+	if (env_filter(in, in_len, p, &e->len) == -1) {
+		free(p);
+		free(in);
+		return NULL;
+	}
+	free(in);
+
+	e->text = p;
+	memcpy(e->key, key, sizeof(e->key));
+	sha256_init(&ctx);
+	sha256_update(&ctx, e->text, e->len);
+	sha256_end(&ctx, e->digest);
+
+	*len = e->len;
+	*digest = e->digest;
+	return e->text;
+}
@@ -0,0 +1,11 @@
+/*
+ * envfile.h
+ * Validate and normalize environment files as renv(1) does
+ */
+
+#include <stddef.h>
+
+#define ENV_CACHE_SIZE 16
+
+int env_filter(const char *, size_t, char *, size_t *);
+const char *env_render(const char *, const char *, const char *, size_t *, const char **);
@@ -12,9 +12,11 @@
 
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <netdb.h>
 #include <paths.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -23,12 +25,19 @@
 #include "missing/compat.h"
 
 #include "config.h"
+#include "envfile.h"
 #include "execute.h"
 #include "input.h"
 #include "rutils.h"
+#include "sha256.h"
 #include "xlibc.h"
 
-#define BLOCK_SIZE 512
+/* output of the web server, read while waiting on a child */
+static int log_fd = -1;
+static void (*log_reader)(int);
+
+static pid_t wait_child(pid_t, int *);
+static ssize_t write_child(int, const char *, size_t);
 
 /*
  * stagedir - return string containing temporary path
@@ -59,7 +68,7 @@ run(char *const argv[]) {
 		execvp(argv[0], argv);
 		err(1, "%s", argv[0]);
 	}
-	if (waitpid(pid, &status, 0) == -1)
+	if (wait_child(pid, &status) == -1)
 		err(1, "waitpid on %d", pid);
 
 	return WEXITSTATUS(status);
@@ -75,9 +84,7 @@ cmd_pipe_stdout(char *const argv[], int *error_code, int *output_size) {
 	int buffer_size;
 	int status;
 	int stdout_pipe[2];
-	char buf[BLOCK_SIZE];
 	char *output;
-	char *newp;
 	pid_t pid;
 
 	nbytes = 0;
@@ -103,15 +110,16 @@ cmd_pipe_stdout(char *const argv[], int *error_code, int *output_size) {
 	/* parent closes the output side */
 	close(stdout_pipe[1]);
 
-	while ((nr = read(stdout_pipe[0], buf, BLOCK_SIZE)) != -1 && nr != 0) {
-		/* ensure we have enough space to terminate string */
-		if (nbytes + nr + 1 > buffer_size) {
-			buffer_size += ALLOCATION_SIZE;
-			newp = xrealloc(output, buffer_size + 1, "newp");
-			output = newp;
-		}
-		memcpy(output + nbytes, buf, nr);
+	/* read directly into the buffer, doubling its size as it fills */
+	while ((nr = read(stdout_pipe[0], output + nbytes, buffer_size - nbytes)) > 0) {
 		nbytes += nr;
+		if (nbytes == buffer_size) {
+			if (buffer_size * 2 >= REALLOC_MAX_SIZE && buffer_size < REALLOC_MAX_SIZE - 1)
+				buffer_size = REALLOC_MAX_SIZE - 1;
+			else
+				buffer_size *= 2;
+			output = xrealloc(output, buffer_size + 1, "output");
+		}
 	}
 
 	*(output + nbytes) = '\0';
@@ -145,15 +153,156 @@ cmd_pipe_stdin(char *const argv[], char *input, size_t len) {
 		err(1, "could not exec %s", argv[0]);
 	}
 	close(stdin_pipe[0]);
-	if (write(stdin_pipe[1], input, len) == -1)
+	if (write_child(stdin_pipe[1], input, len) == -1)
 		err(1, "write to child");
 	close(stdin_pipe[1]);
-	if (waitpid(pid, &status, 0) == -1)
+	if (wait_child(pid, &status) == -1)
 		err(1, "wait on pid %d", pid);
 
 	return WEXITSTATUS(status);
 }
 
+/*
+ * cmd_pipe_local - attach the output of local execution followed by the content
+ * of a label to stdin and execute a utility
+ */
+int
+cmd_pipe_local(char *const argv[], Label *host_label) {
+	int status, local_status;
+	int stdin_pipe[2];
+	int tfd;
+	int local_argc;
+	char tmp_src[128];
+	char *local_argv[PLN_MAX_PATHS];
+	pid_t pid, local_pid;
+	Options op;
+
+	str_cpy(tmp_src, "/tmp/rset_local.XXXXXX", sizeof tmp_src);
+	if ((tfd = mkstemp(tmp_src)) == -1)
+		err(1, "open %s", tmp_src);
+	if (write(tfd, host_label->generator, strlen(host_label->generator)) == -1)
+		err(1, "write");
+	close(tfd);
+
+	apply_default(op.local_interpreter, host_label->options.local_interpreter, LOCAL_INTERPRETER);
+	local_argc = str_to_array(local_argv, op.local_interpreter, PLN_MAX_PATHS, " ");
+	array_append(local_argv, local_argc, tmp_src, NULL);
+
+	xpipe(stdin_pipe, "stdin");
+	pid = fork();
+	if (pid == -1)
+		err(1, "fork");
+
+	if (pid == 0) {
+		close(stdin_pipe[1]);
+		dup2(stdin_pipe[0], STDIN_FILENO);
+		execvp(argv[0], argv);
+		err(1, "could not exec %s", argv[0]);
+	}
+	close(stdin_pipe[0]);
+
+	/* output of the local interpreter is not read by this process */
+	local_pid = fork();
+	if (local_pid == -1)
+		err(1, "fork");
+
+	if (local_pid == 0) {
+		dup2(stdin_pipe[1], STDOUT_FILENO);
+		execvp(local_argv[0], local_argv);
+		err(1, "could not exec %s", local_argv[0]);
+	}
+	if (wait_child(local_pid, &local_status) == -1)
+		err(1, "wait on pid %d", local_pid);
+	unlink(tmp_src);
+
+	if (write_child(stdin_pipe[1], host_label->content, host_label->content_size) == -1)
+		err(1, "write to child");
+	close(stdin_pipe[1]);
+	if (wait_child(pid, &status) == -1)
+		err(1, "wait on pid %d", pid);
+
+	if (WEXITSTATUS(local_status) != 0) {
+		warnx("local execution for label '%s' exited with code %d", host_label->name,
+		    WEXITSTATUS(local_status));
+		return WEXITSTATUS(local_status);
+	}
+	return WEXITSTATUS(status);
+}
+
+/*
+ * set_log_reader - read the output of the web server while a child runs
+ * wait_child     - waitpid(2) that calls the log reader until the child exits
+ * write_child    - write(2) to a pipe that calls the log reader while it is full
+ *
+ * A label may make more requests than the pipe from the web server holds, so
+ * the records cannot wait until the label is finished
+ */
+void
+set_log_reader(int fd, void (*reader)(int)) {
+	log_fd = fd;
+	log_reader = reader;
+}
+
+static pid_t
+wait_child(pid_t pid, int *status) {
+	pid_t ret;
+	struct pollfd pfd;
+
+	if (log_fd == -1)
+		return waitpid(pid, status, 0);
+
+	pfd.fd = log_fd;
+	pfd.events = POLLIN;
+	while ((ret = waitpid(pid, status, WNOHANG)) == 0) {
+		if (poll(&pfd, 1, 100) < 1)
+			continue;
+		if (pfd.revents & POLLIN)
+			log_reader(log_fd);
+		else if (pfd.revents & (POLLHUP | POLLERR | POLLNVAL))
+			return waitpid(pid, status, 0);
+	}
+	return ret;
+}
+
+static ssize_t
+write_child(int fd, const char *buf, size_t len) {
+	int flags;
+	ssize_t nw;
+	size_t off;
+	struct pollfd pfd[2];
+
+	if (log_fd == -1)
+		return write(fd, buf, len);
+
+	flags = fcntl(fd, F_GETFL);
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+	pfd[0].fd = fd;
+	pfd[0].events = POLLOUT;
+	pfd[1].fd = log_fd;
+	pfd[1].events = POLLIN;
+	for (off = 0; off < len;) {
+		if (poll(pfd, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (pfd[1].revents & POLLIN)
+			log_reader(log_fd);
+		else if (pfd[1].revents & (POLLHUP | POLLERR | POLLNVAL))
+			pfd[1].fd = -1; /* web server exited */
+		if (pfd[0].revents & (POLLOUT | POLLERR | POLLHUP)) {
+			if ((nw = write(fd, buf + off, len - off)) == -1) {
+				if (errno == EAGAIN)
+					continue;
+				return -1;
+			}
+			off += nw;
+		}
+	}
+	fcntl(fd, F_SETFL, flags);
+	return off;
+}
+
 /*
  * get_socket - return an unused TCP port
  */
@@ -240,12 +389,12 @@ verify_ssh_agent() {
 }
 
 int
-start_connection(
-    char *socket_path, char *host_name, Label *route_label, int http_port, const char *ssh_config) {
+start_connection(char *socket_path, char *host_name, Label *route_label, int http_port,
+    const char *http_socket, const char *ssh_config) {
 	int argc;
 	int ret;
 	char cmd[PATH_MAX];
-	char port_forwarding[64];
+	char port_forwarding[PATH_MAX];
 	char path_repr[PLN_LABEL_SIZE];
 	char *argv[32];
 	char **path;
@@ -260,7 +409,14 @@ start_connection(
 	}
 
 	/* construct command to execute on remote host  */
-	snprintf(port_forwarding, 64, "%d:localhost:%d", INSTALL_PORT, http_port);
+	if (http_socket) {
+		if (snprintf(port_forwarding, sizeof(port_forwarding), "%s.sock:%s", stagedir(),
+		        http_socket)
+		    >= (int) sizeof(port_forwarding))
+			errx(1, "socket path too long: %s", http_socket);
+	} else
+		snprintf(port_forwarding, sizeof(port_forwarding), "%d:localhost:%d", INSTALL_PORT,
+		    http_port);
 
 	if (xstat(socket_path, &sb, -1) == 0) {
 		fprintf(stderr,
@@ -309,42 +465,34 @@ start_connection(
 int
 update_environment_file(
     char *host_name, char *socket_path, Label *host_label, const char *env_override) {
-	int fd;
 	int ret;
+	size_t len;
 	char cmd[PATH_MAX];
-	char tmp_src[128];
+	char *argv[32];
+	const char *env, *digest;
 	Options op;
 
 	static unsigned session_id_set = 0;
-	static char environment_set[PLN_OPTION_SIZE] = "";
-	static char environment_file_set[PLN_OPTION_SIZE] = "";
+	static char digest_set[SHA256_DIGEST_STRING_LENGTH] = "";
 
 	apply_default(op.environment, host_label->options.environment, ENVIRONMENT);
 	apply_default(op.environment_file, host_label->options.environment_file, ENVIRONMENT_FILE);
 
-	/* only update when value changes */
-	if (session_id_set == current_session_id() && (strcmp(environment_set, op.environment) == 0)
-	    && (strcmp(environment_file_set, op.environment_file) == 0))
-		return 0;
-
-	session_id_set = current_session_id();
-	str_cpy(environment_set, op.environment, PLN_OPTION_SIZE);
-	str_cpy(environment_file_set, op.environment_file, PLN_OPTION_SIZE);
+	if ((env = env_render(op.environment_file, op.environment, env_override, &len, &digest))
+	    == NULL)
+		return 1;
 
-	str_cpy(tmp_src, "/tmp/rset_env_XXXXXX", sizeof tmp_src);
-	if ((fd = mkstemp(tmp_src)) == -1)
-		err(1, "mkstemp");
-
-	write(fd, environment_set, strlen(environment_set));
-	if (env_override)
-		write(fd, env_override, strlen(env_override));
-	close(fd);
+	/* only update when the remote copy differs */
+	if (session_id_set == current_session_id() && strcmp(digest_set, digest) == 0)
+		return 0;
 
-	snprintf(cmd, PATH_MAX, "renv %s %s | ssh -q -S %s %s 'cat > %s/final.env; touch %s/local.env'",
-	    op.environment_file, tmp_src, socket_path, host_name, stagedir(), stagedir());
-	trace_shell(cmd);
-	ret = system(cmd);
-	unlink(tmp_src);
+	snprintf(cmd, PATH_MAX, "cat > %s/final.env; touch %s/local.env", stagedir(), stagedir());
+	array_append(argv, 0, "ssh", "-q", "-S", socket_path, host_name, cmd, NULL);
+	trace_exec(argv);
+	if ((ret = cmd_pipe_stdin(argv, (char *) env, len)) == 0) {
+		session_id_set = current_session_id();
+		str_cpy(digest_set, digest, sizeof(digest_set));
+	}
 
 	return ret;
 }
@@ -369,8 +517,8 @@ ssh_command_pipe(char *host_name, char *socket_path, Label *host_label, const ch
 	snprintf(cmd, sizeof(cmd),
 	    "%s sh -c \""
 	    "cd %s; set -a; . ./final.env; . ./local.env; "
-	    "SD='%s'; exec %s\"",
-	    op.execute_with, stagedir(), stagedir(), op.interpreter);
+	    "SD='%s'; RSET_SESSION=%08x; exec %s\"",
+	    op.execute_with, stagedir(), stagedir(), current_session_id(), op.interpreter);
 
 	/* construct ssh command */
 	argc = 0;
@@ -378,7 +526,10 @@ ssh_command_pipe(char *host_name, char *socket_path, Label *host_label, const ch
 
 	array_append(argv, argc, host_name, cmd, NULL);
 	trace_exec(argv);
-	ret = cmd_pipe_stdin(argv, host_label->content, host_label->content_size);
+	if (host_label->generator)
+		ret = cmd_pipe_local(argv, host_label);
+	else
+		ret = cmd_pipe_stdin(argv, host_label->content, host_label->content_size);
 	return ret;
 }
 
@@ -401,7 +552,11 @@ ssh_command_tty(char *host_name, char *socket_path, Label *host_label, const cha
 	argc = 0;
 	argc = array_append(argv, argc, "ssh", "-T", "-S", socket_path, NULL);
 	array_append(argv, argc, host_name, cmd, NULL);
-	cmd_pipe_stdin(argv, host_label->content, host_label->content_size);
+	if (host_label->generator) {
+		if ((ret = cmd_pipe_local(argv, host_label)) != 0)
+			return ret;
+	} else
+		cmd_pipe_stdin(argv, host_label->content, host_label->content_size);
 
 	/* construct command to execute on remote host  */
 	apply_default(op.interpreter, host_label->options.interpreter, INTERPRETER);
@@ -411,8 +566,9 @@ ssh_command_tty(char *host_name, char *socket_path, Label *host_label, const cha
 	snprintf(cmd, sizeof(cmd),
 	    "%s sh -c \""
 	    "cd %s; set -a; . ./final.env; . ./local.env; "
-	    "SD='%s'; exec %s %s/_script\"",
-	    op.execute_with, stagedir(), stagedir(), op.interpreter, stagedir());
+	    "SD='%s'; RSET_SESSION=%08x; exec %s %s/_script\"",
+	    op.execute_with, stagedir(), stagedir(), current_session_id(), op.interpreter,
+	    stagedir());
 
 	/* construct ssh command */
 	argc = 0;
@@ -464,12 +620,16 @@ scp_archive(char *host_name, char *socket_path, Label *host_label, bool upload)
 
 void
 end_connection(char *socket_path, char *host_name) {
+	char sock_path[PATH_MAX];
 	char *argv[32];
 
 	if (access(socket_path, F_OK) == -1)
 		return;
 
-	array_append(argv, 0, "ssh", "-S", socket_path, host_name, "rm", "-rf", stagedir(), NULL);
+	if (snprintf(sock_path, sizeof(sock_path), "%s.sock", stagedir()) >= (int) sizeof(sock_path))
+		errx(1, "socket path too long: %s.sock", stagedir());
+	array_append(
+	    argv, 0, "ssh", "-S", socket_path, host_name, "rm", "-rf", stagedir(), sock_path, NULL);
 	trace_exec(argv);
 	if (run(argv) != 0)
 		warn("remote tmp dir");
@@ -13,11 +13,13 @@ char *stagedir();
 int run(char *const[]);
 char *cmd_pipe_stdout(char *const[], int *, int *);
 int cmd_pipe_stdin(char *const[], char *, size_t);
+int cmd_pipe_local(char *const[], Label *);
+void set_log_reader(int, void (*)(int));
 int get_socket();
 char *findprog(char *);
 
 int verify_ssh_agent();
-int start_connection(char *, char *, Label *, int, const char *);
+int start_connection(char *, char *, Label *, int, const char *, const char *);
 int update_environment_file(char *, char *, Label *, const char *);
 int ssh_command_pipe(char *, char *, Label *, const char *);
 int ssh_command_tty(char *, char *, Label *, const char *);
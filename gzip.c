@@ -0,0 +1,413 @@
+/*
+ * gzip.c
+ * Compress a buffer in the gzip format (RFC 1951, RFC 1952)
+ * Matches are found using hash chains and each block is written with
+ * Huffman codes built for its symbols
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gzip.h"
+
+#define WSIZE 32768
+#define WMASK (WSIZE - 1)
+#define HASH_SIZE 32768
+#define MIN_MATCH 3
+#define MAX_MATCH 258
+#define MAX_CHAIN 64
+#define NICE_MATCH 128     /* stop searching once a match is this long */
+#define TOO_FAR 4096       /* a match of MIN_MATCH is not worth a longer distance */
+#define BLOCK_SYMBOLS 16384
+#define L_CODES 286
+#define D_CODES 30
+#define BL_CODES 19
+#define MAX_BITS 15
+#define MAX_BL_BITS 7
+
+struct bitbuf {
+	unsigned char *data;
+	size_t len;
+	size_t size;
+	uint32_t bits;
+	int n;
+	int failed;
+};
+
+/* a literal if dist is 0, otherwise a match */
+struct symbol {
+	uint16_t litlen;
+	uint16_t dist;
+};
+
+static const uint16_t len_base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t len_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+	4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t dist_base[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t dist_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8,
+	8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const uint8_t bl_order[BL_CODES] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2,
+	14, 1, 15 };
+
+static void
+put_byte(struct bitbuf *b, unsigned char c) {
+	unsigned char *p;
+
+	if (b->len == b->size) {
+		if (b->failed || (p = realloc(b->data, b->size * 2)) == NULL) {
+			b->failed = 1;
+			return;
+		}
+		b->data = p;
+		b->size *= 2;
+	}
+	b->data[b->len++] = c;
+}
+
+/* bits are packed starting with the least significant */
+static void
+put_bits(struct bitbuf *b, uint32_t value, int n) {
+	b->bits |= value << b->n;
+	b->n += n;
+	while (b->n >= 8) {
+		put_byte(b, b->bits & 0xff);
+		b->bits >>= 8;
+		b->n -= 8;
+	}
+}
+
+static void
+put_le32(struct bitbuf *b, uint32_t v) {
+	put_byte(b, v & 0xff);
+	put_byte(b, (v >> 8) & 0xff);
+	put_byte(b, (v >> 16) & 0xff);
+	put_byte(b, (v >> 24) & 0xff);
+}
+
+static uint32_t
+crc32(const unsigned char *p, size_t len) {
+	static uint32_t table[256];
+	uint32_t c, crc = 0xffffffff;
+	size_t i;
+	int k;
+
+	if (table[1] == 0) {
+		for (i = 0; i < 256; i++) {
+			for (c = i, k = 0; k < 8; k++)
+				c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+	}
+	for (i = 0; i < len; i++)
+		crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+	return crc ^ 0xffffffff;
+}
+
+/*
+ * huff_lengths - compute the code length of each symbol with a non-zero
+ * frequency; frequencies are scaled down until no code is longer than limit
+ */
+static void
+huff_lengths(const unsigned int *freq, int n, int limit, uint8_t *lens) {
+	int i, j, k, m, leaf, node, max, shift;
+	int sym[L_CODES], parent[2 * L_CODES], depth[2 * L_CODES];
+	unsigned int w[2 * L_CODES];
+
+	for (i = 0, m = 0; i < n; i++) {
+		lens[i] = 0;
+		if (freq[i] == 0)
+			continue;
+		/* insertion sort by frequency */
+		for (j = m++; j > 0 && freq[sym[j - 1]] > freq[i]; j--)
+			sym[j] = sym[j - 1];
+		sym[j] = i;
+	}
+	if (m == 1)
+		lens[sym[0]] = 1;
+	if (m < 2)
+		return;
+
+	for (shift = 0;; shift++) {
+		for (i = 0; i < m; i++)
+			w[i] = (freq[sym[i]] >> shift) | 1;
+
+		/* leaves and internal nodes are each taken in order of weight */
+		leaf = 0;
+		node = m;
+		for (k = m; k < 2 * m - 1; k++) {
+			w[k] = 0;
+			for (j = 0; j < 2; j++) {
+				i = (leaf < m && (node >= k || w[leaf] <= w[node])) ? leaf++ : node++;
+				parent[i] = k;
+				w[k] += w[i];
+			}
+		}
+		depth[2 * m - 2] = 0;
+		for (max = 0, k = 2 * m - 3; k >= 0; k--) {
+			depth[k] = depth[parent[k]] + 1;
+			if (depth[k] > max)
+				max = depth[k];
+		}
+		if (max <= limit)
+			break;
+	}
+	for (i = 0; i < m; i++)
+		lens[sym[i]] = depth[i];
+}
+
+/*
+ * huff_codes - assign canonical codes, bit-reversed for put_bits()
+ */
+static void
+huff_codes(const uint8_t *lens, int n, uint16_t *codes) {
+	int i, bits, count[MAX_BITS + 1] = { 0 };
+	unsigned int c, code = 0, next[MAX_BITS + 1];
+
+	for (i = 0; i < n; i++)
+		count[lens[i]]++;
+	count[0] = 0;
+	for (bits = 1; bits <= MAX_BITS; bits++) {
+		code = (code + count[bits - 1]) << 1;
+		next[bits] = code;
+	}
+	for (i = 0; i < n; i++) {
+		if (lens[i] == 0)
+			continue;
+		c = next[lens[i]]++;
+		for (codes[i] = 0, bits = 0; bits < lens[i]; bits++, c >>= 1)
+			codes[i] = (codes[i] << 1) | (c & 1);
+	}
+}
+
+static int
+code_index(const uint16_t *base, int n, unsigned int v) {
+	int i;
+
+	for (i = n - 1; base[i] > v; i--)
+		;
+	return i;
+}
+
+/*
+ * write_block - write symbols as a block compressed with dynamic Huffman codes
+ */
+static void
+write_block(struct bitbuf *b, const struct symbol *syms, int n, int final) {
+	int i, r, lc, dc, hlit, hdist, hclen, n_rle;
+	unsigned int lfreq[L_CODES] = { 0 }, dfreq[D_CODES] = { 0 }, bfreq[BL_CODES] = { 0 };
+	uint8_t llen[L_CODES], dlen[D_CODES], blen[BL_CODES], all[L_CODES + D_CODES];
+	uint8_t rle[L_CODES + D_CODES], rle_extra[L_CODES + D_CODES];
+	uint16_t lcode[L_CODES], dcode[D_CODES], bcode[BL_CODES];
+
+	for (i = 0; i < n; i++) {
+		if (syms[i].dist == 0) {
+			lfreq[syms[i].litlen]++;
+		} else {
+			lfreq[257 + code_index(len_base, 29, syms[i].litlen)]++;
+			dfreq[code_index(dist_base, 30, syms[i].dist)]++;
+		}
+	}
+	lfreq[256] = 1;
+	huff_lengths(lfreq, L_CODES, MAX_BITS, llen);
+	huff_lengths(dfreq, D_CODES, MAX_BITS, dlen);
+	/* at least one distance code is sent */
+	for (i = 0; i < D_CODES && dlen[i] == 0; i++)
+		;
+	if (i == D_CODES)
+		dlen[0] = 1;
+	huff_codes(llen, L_CODES, lcode);
+	huff_codes(dlen, D_CODES, dcode);
+
+	for (hlit = L_CODES; hlit > 257 && llen[hlit - 1] == 0; hlit--)
+		;
+	for (hdist = D_CODES; hdist > 1 && dlen[hdist - 1] == 0; hdist--)
+		;
+	memcpy(all, llen, hlit);
+	memcpy(all + hlit, dlen, hdist);
+
+	/* run-length encode the code lengths */
+	for (i = 0, n_rle = 0; i < hlit + hdist;) {
+		for (r = 1; i + r < hlit + hdist && all[i + r] == all[i]; r++)
+			;
+		if (all[i] == 0 && r >= 3) {
+			r = (r > 138) ? 138 : r;
+			rle[n_rle] = (r >= 11) ? 18 : 17;
+			rle_extra[n_rle++] = (r >= 11) ? r - 11 : r - 3;
+			i += r;
+		} else if (r >= 4) {
+			rle_extra[n_rle] = 0;
+			rle[n_rle++] = all[i];
+			r = (r - 1 > 6) ? 6 : r - 1;
+			rle[n_rle] = 16;
+			rle_extra[n_rle++] = r - 3;
+			i += r + 1;
+		} else {
+			rle_extra[n_rle] = 0;
+			rle[n_rle++] = all[i++];
+		}
+	}
+	for (i = 0; i < n_rle; i++)
+		bfreq[rle[i]]++;
+	huff_lengths(bfreq, BL_CODES, MAX_BL_BITS, blen);
+	huff_codes(blen, BL_CODES, bcode);
+	for (hclen = BL_CODES; hclen > 4 && blen[bl_order[hclen - 1]] == 0; hclen--)
+		;
+
+	/* header */
+	put_bits(b, final, 1);
+	put_bits(b, 2, 2);
+	put_bits(b, hlit - 257, 5);
+	put_bits(b, hdist - 1, 5);
+	put_bits(b, hclen - 4, 4);
+	for (i = 0; i < hclen; i++)
+		put_bits(b, blen[bl_order[i]], 3);
+	for (i = 0; i < n_rle; i++) {
+		put_bits(b, bcode[rle[i]], blen[rle[i]]);
+		if (rle[i] >= 16)
+			put_bits(b, rle_extra[i], (rle[i] == 16) ? 2 : (rle[i] == 17) ? 3 : 7);
+	}
+
+	/* data */
+	for (i = 0; i < n; i++) {
+		if (syms[i].dist == 0) {
+			put_bits(b, lcode[syms[i].litlen], llen[syms[i].litlen]);
+			continue;
+		}
+		lc = code_index(len_base, 29, syms[i].litlen);
+		put_bits(b, lcode[257 + lc], llen[257 + lc]);
+		put_bits(b, syms[i].litlen - len_base[lc], len_extra[lc]);
+		dc = code_index(dist_base, 30, syms[i].dist);
+		put_bits(b, dcode[dc], dlen[dc]);
+		put_bits(b, syms[i].dist - dist_base[dc], dist_extra[dc]);
+	}
+	put_bits(b, lcode[256], llen[256]);
+}
+
+static unsigned int
+hash3(const unsigned char *p) {
+	return ((p[0] << 10) ^ (p[1] << 5) ^ p[2]) & (HASH_SIZE - 1);
+}
+
+/*
+ * longest_match - find the longest earlier occurrence of the bytes at pos
+ * head and prev hold positions + 1, so that 0 ends a chain
+ */
+static int
+longest_match(const unsigned char *in, size_t len, size_t pos, const uint32_t *head,
+    const uint32_t *prev, unsigned int *dist) {
+	int chain = MAX_CHAIN, best = 0, l, max;
+	size_t cand, next;
+
+	if (pos + MIN_MATCH > len)
+		return 0;
+	max = (len - pos < MAX_MATCH) ? len - pos : MAX_MATCH;
+	for (next = head[hash3(in + pos)]; next && chain-- > 0; next = prev[cand & WMASK]) {
+		cand = next - 1;
+		if (pos - cand > WSIZE)
+			break;
+		if (in[cand + best] == in[pos + best]) {
+			for (l = 0; l < max && in[cand + l] == in[pos + l]; l++)
+				;
+			if (l > best) {
+				best = l;
+				*dist = pos - cand;
+				if (l >= NICE_MATCH || l == max)
+					break;
+			}
+		}
+		/* a slot that was reused does not continue the chain */
+		if (prev[cand & WMASK] >= next)
+			break;
+	}
+	if (best < MIN_MATCH || (best == MIN_MATCH && *dist > TOO_FAR))
+		return 0;
+	return best;
+}
+
+static void
+insert(const unsigned char *in, size_t len, size_t pos, uint32_t *head, uint32_t *prev) {
+	unsigned int h;
+
+	if (pos + MIN_MATCH > len)
+		return;
+	h = hash3(in + pos);
+	prev[pos & WMASK] = head[h];
+	head[h] = pos + 1;
+}
+
+/*
+ * gzip_compress - compress a buffer, omitting the name and timestamp so that
+ * the output is reproducible
+ * Returns an allocated buffer or NULL on error
+ */
+char *
+gzip_compress(const char *data, size_t len, size_t *out_len) {
+	const unsigned char *in = (const unsigned char *) data;
+	static const unsigned char header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+	int n = 0, match, next_match;
+	unsigned int dist, next_dist;
+	size_t i, pos = 0;
+	uint32_t *head, *prev;
+	struct symbol *syms;
+	struct bitbuf b;
+
+	memset(&b, 0, sizeof(b));
+	b.size = len / 2 + 64;
+	head = calloc(HASH_SIZE, sizeof(uint32_t));
+	prev = calloc(WSIZE, sizeof(uint32_t));
+	syms = calloc(BLOCK_SYMBOLS, sizeof(struct symbol));
+	if (head == NULL || prev == NULL || syms == NULL || (b.data = malloc(b.size)) == NULL)
+		goto fail;
+	for (i = 0; i < sizeof(header); i++)
+		put_byte(&b, header[i]);
+
+	while (pos < len) {
+		match = longest_match(in, len, pos, head, prev, &dist);
+		insert(in, len, pos, head, prev);
+
+		/* a literal is sent instead if the next position has a longer match */
+		if (match > 0 && match < NICE_MATCH) {
+			next_match = longest_match(in, len, pos + 1, head, prev, &next_dist);
+			if (next_match > match)
+				match = 0;
+		}
+		if (match == 0) {
+			syms[n].litlen = in[pos++];
+			syms[n++].dist = 0;
+		} else {
+			syms[n].litlen = match;
+			syms[n++].dist = dist;
+			for (i = 1; i < (size_t) match; i++)
+				insert(in, len, pos + i, head, prev);
+			pos += match;
+		}
+		if (n == BLOCK_SYMBOLS) {
+			write_block(&b, syms, n, pos == len);
+			n = 0;
+		}
+	}
+	if (n > 0 || len == 0)
+		write_block(&b, syms, n, 1);
+
+	/* flush the last byte and add the trailer */
+	put_bits(&b, 0, 7);
+	put_le32(&b, crc32(in, len));
+	put_le32(&b, len);
+	if (b.failed)
+		goto fail;
+
+	free(head);
+	free(prev);
+	free(syms);
+	*out_len = b.len;
+	return (char *) b.data;
+fail:
+	free(head);
+	free(prev);
+	free(syms);
+	free(b.data);
+	return NULL;
+}
@@ -0,0 +1,8 @@
+/*
+ * gzip.h
+ * Compress a buffer in the gzip format (RFC 1951, RFC 1952)
+ */
+
+#include <stddef.h>
+
+char *gzip_compress(const char *, size_t, size_t *);
@@ -3,21 +3,40 @@
  * HTTP request handling for miniquark
  */
 
+#if defined(_LINUX_PORT)
+#include <sys/sendfile.h>
+#endif
+
+#include <sys/wait.h>
+
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "missing/compat.h"
 
+#include "cache.h"
+#include "digest.h"
 #include "http.h"
+#include "manifest.h"
+#include "stats.h"
+#include "tar.h"
 
 const char *req_field_str[] = {
 	[REQ_RANGE] = "Range",
 	[REQ_IF_MODIFIED_SINCE] = "If-Modified-Since",
+	[REQ_IF_NONE_MATCH] = "If-None-Match",
 	[REQ_AGENT] = "User-Agent",
+	[REQ_CONNECTION] = "Connection",
+	[REQ_ACCEPT_ENCODING] = "Accept-Encoding",
+	[REQ_SESSION] = "X-Rset-Session",
 };
 
 const char *req_method_str[] = {
@@ -48,11 +67,60 @@ timestamp(time_t t, char buf[TIMESTAMP_LEN]) {
 	return buf;
 }
 
+/* append to the response header */
+static int
+head_printf(struct response *res, const char *fmt, ...) {
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(res->head + res->head_len, sizeof(res->head) - res->head_len, fmt, ap);
+	va_end(ap);
+	if (len < 0 || (size_t) len >= sizeof(res->head) - res->head_len)
+		return -1;
+	res->head_len += len;
+	return 0;
+}
+
+void
+http_response_init(struct response *res) {
+	memset(res, 0, sizeof(*res));
+	res->fd = -1;
+}
+
+void
+http_response_free(struct response *res) {
+	if (res->fd != -1)
+		close(res->fd);
+	res->fd = -1;
+	if (res->pid > 0) {
+		kill(res->pid, SIGTERM);
+		while (waitpid(res->pid, NULL, 0) == -1 && errno == EINTR)
+			;
+	}
+	res->pid = 0;
+	free(res->stream_buf);
+	res->stream_buf = NULL;
+	free(res->body_buf);
+	res->body_buf = NULL;
+	if (res->entry)
+		cache_release(res->entry);
+	res->entry = NULL;
+	res->body = NULL;
+	res->encoding = NULL;
+}
+
 enum status
-http_send_status(int fd, enum status s) {
+http_send_status(struct response *res, enum status s) {
 	char t[TIMESTAMP_LEN];
 
-	if (dprintf(fd,
+	http_response_free(res);
+	res->head_len = 0;
+	res->remaining = 0;
+
+	/* the end of the message is indicated by closing the connection */
+	res->keep_alive = 0;
+	if (head_printf(res,
 	        "HTTP/1.1 %d %s\r\n"
 	        "Date: %s\r\n"
 	        "Connection: close\r\n"
@@ -63,7 +131,7 @@ http_send_status(int fd, enum status s) {
 	        s, status_str[s], timestamp(time(NULL), t),
 	        (s == S_METHOD_NOT_ALLOWED) ? "Allow: HEAD, GET\r\n" : "", s, status_str[s])
 	    < 0) {
-		return S_REQUEST_TIMEOUT;
+		return S_INTERNAL_SERVER_ERROR;
 	}
 
 	return s;
@@ -86,36 +154,38 @@ decode(const char src[PATH_MAX], char dest[PATH_MAX]) {
 	dest[i] = '\0';
 }
 
+/*
+ * http_header_length - length of the first complete request header in a buffer
+ * Returns 0 if the header is not complete
+ */
+size_t
+http_header_length(const char *h, size_t hlen) {
+	size_t i;
+
+	for (i = 3; i < hlen; i++) {
+		if (h[i] == '\n' && !memcmp(h + i - 3, "\r\n\r\n", 4))
+			return i + 1;
+	}
+	return 0;
+}
+
 int
-http_get_request(int fd, struct request *req) {
-	size_t hlen, i, mlen;
-	ssize_t off;
-	char h[HEADER_MAX], *p, *q;
+http_get_request(char *h, size_t hlen, struct request *req, struct response *res) {
+	size_t i, mlen;
+	int version_minor;
+	char *p, *q, *query;
 
 	/* empty all fields */
 	memset(req, 0, sizeof(*req));
 
-	/*
-	 * receive header
-	 */
-	for (hlen = 0;;) {
-		if ((off = read(fd, h + hlen, sizeof(h) - hlen)) < 0) {
-			return http_send_status(fd, S_REQUEST_TIMEOUT);
-		} else if (off == 0) {
-			break;
-		}
-		hlen += off;
-		if (hlen >= 4 && !memcmp(h + hlen - 4, "\r\n\r\n", 4)) {
-			break;
-		}
-		if (hlen == sizeof(h)) {
-			return http_send_status(fd, S_REQUEST_TOO_LARGE);
-		}
+	/* a full buffer without a terminating empty line */
+	if (hlen == HEADER_MAX && !http_header_length(h, hlen)) {
+		return http_send_status(res, S_REQUEST_TOO_LARGE);
 	}
 
 	/* remove terminating empty line */
 	if (hlen < 2) {
-		return http_send_status(fd, S_BAD_REQUEST);
+		return http_send_status(res, S_BAD_REQUEST);
 	}
 	hlen -= 2;
 
@@ -135,12 +205,12 @@ http_get_request(int fd, struct request *req) {
 		}
 	}
 	if (i == NUM_REQ_METHODS) {
-		return http_send_status(fd, S_METHOD_NOT_ALLOWED);
+		return http_send_status(res, S_METHOD_NOT_ALLOWED);
 	}
 
 	/* a single space must follow the method */
 	if (h[mlen] != ' ') {
-		return http_send_status(fd, S_BAD_REQUEST);
+		return http_send_status(res, S_BAD_REQUEST);
 	}
 
 	/* basis for next step */
@@ -148,13 +218,22 @@ http_get_request(int fd, struct request *req) {
 
 	/* TARGET */
 	if (!(q = strchr(p, ' '))) {
-		return http_send_status(fd, S_BAD_REQUEST);
+		return http_send_status(res, S_BAD_REQUEST);
 	}
 	*q = '\0';
 	if (q - p + 1 > PATH_MAX) {
-		return http_send_status(fd, S_REQUEST_TOO_LARGE);
+		return http_send_status(res, S_REQUEST_TOO_LARGE);
 	}
 	memcpy(req->target, p, q - p + 1);
+
+	/* query string */
+	if ((query = strchr(req->target, '?'))) {
+		*query++ = '\0';
+		if (strlen(query) >= FIELD_MAX) {
+			return http_send_status(res, S_REQUEST_TOO_LARGE);
+		}
+		strcpy(req->query, query);
+	}
 	decode(req->target, req->target);
 
 	/* basis for next step */
@@ -162,17 +241,18 @@ http_get_request(int fd, struct request *req) {
 
 	/* HTTP-VERSION */
 	if (strncmp(p, "HTTP/", sizeof("HTTP/") - 1)) {
-		return http_send_status(fd, S_BAD_REQUEST);
+		return http_send_status(res, S_BAD_REQUEST);
 	}
 	p += sizeof("HTTP/") - 1;
 	if (strncmp(p, "1.0", sizeof("1.0") - 1) && strncmp(p, "1.1", sizeof("1.1") - 1)) {
-		return http_send_status(fd, S_VERSION_NOT_SUPPORTED);
+		return http_send_status(res, S_VERSION_NOT_SUPPORTED);
 	}
+	version_minor = p[2] - '0';
 	p += sizeof("1.*") - 1;
 
 	/* check terminator */
 	if (strncmp(p, "\r\n", sizeof("\r\n") - 1)) {
-		return http_send_status(fd, S_BAD_REQUEST);
+		return http_send_status(res, S_BAD_REQUEST);
 	}
 
 	/* basis for next step */
@@ -192,7 +272,7 @@ http_get_request(int fd, struct request *req) {
 		if (i == NUM_REQ_FIELDS) {
 			/* unmatched field, skip this line */
 			if (!(q = strstr(p, "\r\n"))) {
-				return http_send_status(fd, S_BAD_REQUEST);
+				return http_send_status(res, S_BAD_REQUEST);
 			}
 			p = q + (sizeof("\r\n") - 1);
 			continue;
@@ -202,7 +282,7 @@ http_get_request(int fd, struct request *req) {
 
 		/* a single colon must follow the field name */
 		if (*p != ':') {
-			return http_send_status(fd, S_BAD_REQUEST);
+			return http_send_status(res, S_BAD_REQUEST);
 		}
 
 		/* skip whitespace */
@@ -211,11 +291,11 @@ http_get_request(int fd, struct request *req) {
 
 		/* extract field content */
 		if (!(q = strstr(p, "\r\n"))) {
-			return http_send_status(fd, S_BAD_REQUEST);
+			return http_send_status(res, S_BAD_REQUEST);
 		}
 		*q = '\0';
 		if (q - p + 1 > FIELD_MAX) {
-			return http_send_status(fd, S_REQUEST_TOO_LARGE);
+			return http_send_status(res, S_REQUEST_TOO_LARGE);
 		}
 		memcpy(req->field[i], p, q - p + 1);
 
@@ -223,6 +303,12 @@ http_get_request(int fd, struct request *req) {
 		p = q + (sizeof("\r\n") - 1);
 	}
 
+	/* persistent connections are the default for HTTP/1.1 */
+	if (version_minor == 1)
+		res->keep_alive = strcasecmp(req->field[REQ_CONNECTION], "close") != 0;
+	else
+		res->keep_alive = strcasecmp(req->field[REQ_CONNECTION], "keep-alive") == 0;
+
 	return 0;
 }
 
@@ -279,39 +365,319 @@ normabspath(char *path) {
 	return 0;
 }
 
+/*
+ * etag_match - 1 if a list of entity tags contains the digest of a file
+ * Weak tags are compared in the same way as strong tags, and the tag of any
+ * content coding of the file matches
+ */
+static int
+etag_match(const char *list, const char *digest) {
+	size_t len = strlen(digest);
+	const char *p = list, *q;
+
+	while (*p) {
+		for (; *p == ' ' || *p == '\t' || *p == ','; p++)
+			;
+		if (*p == '*')
+			return 1;
+		if (!strncmp(p, "W/", 2))
+			p += 2;
+		if (*p != '"' || !(q = strchr(p + 1, '"')))
+			return 0;
+		if (len > 0 && (size_t) (q - p - 1) >= len && !strncmp(p + 1, digest, len)
+		    && (p[len + 1] == '"' || p[len + 1] == '-'))
+			return 1;
+		p = q + 1;
+	}
+	return 0;
+}
+
+/*
+ * head_validators - add the entity tag of the selected representation, once
+ * the digest of the file is known
+ */
+static int
+head_validators(struct response *res) {
+	if (!res->entry)
+		return 0;
+	if (res->encoding || COMPRESSIBLE(res->entry)) {
+		if (head_printf(res, "Vary: Accept-Encoding\r\n") < 0)
+			return -1;
+	}
+	if (!res->entry->digest[0])
+		return 0;
+	return head_printf(res, "ETag: \"%s%s%s\"\r\n", res->entry->digest,
+	    res->encoding ? "-" : "", res->encoding ? res->encoding : "");
+}
+
+static enum status
+resp_not_modified(struct response *res) {
+	char t[TIMESTAMP_LEN];
+
+	if (head_printf(res,
+	        "HTTP/1.1 %d %s\r\n"
+	        "Date: %s\r\n"
+	        "Connection: %s\r\n",
+	        S_NOT_MODIFIED, status_str[S_NOT_MODIFIED], timestamp(time(NULL), t),
+	        CONNECTION_STR(res))
+	        < 0
+	    || head_validators(res) < 0 || head_printf(res, "\r\n") < 0) {
+		return S_INTERNAL_SERVER_ERROR;
+	}
+	return S_NOT_MODIFIED;
+}
+
+/*
+ * accepts_encoding - 1 if Accept-Encoding lists a content coding without q=0
+ */
+static int
+accepts_encoding(const char *field, const char *coding) {
+	size_t len = strlen(coding);
+	const char *p = field;
+
+	while (*p) {
+		for (; *p == ' ' || *p == '\t' || *p == ','; p++)
+			;
+		if (!strncasecmp(p, coding, len) && strchr(" \t,;", p[len])) {
+			for (p += len; *p == ' ' || *p == '\t'; p++)
+				;
+			if (*p != ';')
+				return 1;
+			for (p++; *p == ' ' || *p == '\t'; p++)
+				;
+			return strncmp(p, "q=", 2) || strtod(p + 2, NULL) > 0;
+		}
+		p += strcspn(p, ",");
+	}
+	return 0;
+}
+
+static const struct {
+	const char *coding;
+	const char *suffix;
+} encodings[] = {
+	{ "zstd", ".zst" },
+	{ "gzip", ".gz" },
+};
+
+/*
+ * select_encoding - choose a precompressed file or, if compress is set, compress
+ * a text file
+ * Returns 1 if encname is set to the name of a precompressed file
+ */
+static int
+select_encoding(const char *accept, const char *name, struct response *res, char *encname,
+    struct stat *enc_st, int compress) {
+	size_t i;
+
+	for (i = 0; i < LEN(encodings); i++) {
+		if (!accepts_encoding(accept, encodings[i].coding))
+			continue;
+		if (snprintf(encname, PATH_MAX, "%s%s", name, encodings[i].suffix) >= PATH_MAX)
+			continue;
+
+		/* a stale sibling is ignored */
+		if (cache_stat(encname, enc_st) == 0 && S_ISREG(enc_st->st_mode)
+		    && enc_st->st_mtim.tv_sec >= res->entry->st.st_mtim.tv_sec) {
+			res->encoding = encodings[i].coding;
+			res->body = NULL;
+			return 1;
+		}
+	}
+	if (accepts_encoding(accept, "gzip")
+	    && (compress ? cache_gzip(res->entry) == 0 : res->entry->gz != NULL)) {
+		res->encoding = "gzip";
+		res->body = res->entry->gz;
+	}
+	return 0;
+}
+
+/*
+ * parse_range - parse one byte range of a Range header
+ * Returns 0 if the range is satisfiable, 1 if it is not or -1 if malformed
+ */
+static int
+parse_range(char *p, long size, struct byterange *r) {
+	const char *err = NULL;
+	char *q;
+
+	/* whitespace may surround each range */
+	for (; *p == ' ' || *p == '\t'; p++)
+		;
+	for (q = p + strlen(p); q > p && (q[-1] == ' ' || q[-1] == '\t'); q--)
+		;
+	*q = '\0';
+
+	if (!(q = strchr(p, '-')))
+		return -1;
+	*(q++) = '\0';
+	if (p[0] != '\0') {
+		/*
+		 * Range has format "first-last" or "first-",
+		 * i.e. return bytes 'first' to 'last' (or the
+		 * last byte if 'last' is not given),
+		 * inclusively, and byte-numbering beginning at 0
+		 */
+		r->lower = strtonum(p, 0, LLONG_MAX, &err);
+		if (!err)
+			r->upper = (q[0] != '\0') ? strtonum(q, 0, LLONG_MAX, &err) : size - 1;
+		if (err)
+			return -1;
+
+		/* check ranges */
+		if (r->lower > r->upper || r->lower >= size)
+			return 1;
+
+		/* adjust upper limit to be at most the last byte */
+		r->upper = MIN(r->upper, size - 1);
+	} else {
+		/* Range has format "-num", i.e. return the 'num' last bytes */
+		r->upper = strtonum(q, 0, LLONG_MAX, &err);
+		if (err)
+			return -1;
+		r->lower = (r->upper > size) ? 0 : size - r->upper;
+		r->upper = size - 1;
+	}
+	return 0;
+}
+
+/*
+ * part_head - format the header of a part of a multipart/byteranges body,
+ * or the final boundary if i is the number of ranges
+ */
+static int
+part_head(const struct response *res, int i, long size, char *buf, size_t len) {
+	if (i == res->n_ranges)
+		return snprintf(buf, len, "\r\n--%s--\r\n", res->boundary);
+	return snprintf(buf, len,
+	    "\r\n--%s\r\n"
+	    "Content-Type: application/octet-stream\r\n"
+	    "Content-Range: bytes %ld-%ld/%ld\r\n"
+	    "\r\n",
+	    res->boundary, res->ranges[i].lower, res->ranges[i].upper, size);
+}
+
+/*
+ * resp_stream - stream a body of the given type produced by a child process
+ * with write_body(fd, name)
+ */
+static enum status
+resp_stream(const char *name, const char *type, int (*write_body)(int, const char *),
+    struct request *req, struct response *res) {
+	int pfd[2];
+	char t[TIMESTAMP_LEN];
+
+	req->bytes_sent = 0;
+
+	/* the end of the body is indicated by closing the connection */
+	res->keep_alive = 0;
+	if (head_printf(res,
+	        "HTTP/1.1 %d %s\r\n"
+	        "Date: %s\r\n"
+	        "Connection: close\r\n"
+	        "Content-Type: %s\r\n"
+	        "\r\n",
+	        S_OK, status_str[S_OK], timestamp(time(NULL), t), type)
+	    < 0) {
+		return S_INTERNAL_SERVER_ERROR;
+	}
+	if (req->method != M_GET)
+		return S_OK;
+
+	if ((res->stream_buf = malloc(STREAM_BUF_SIZE)) == NULL || pipe(pfd) < 0)
+		return http_send_status(res, S_INTERNAL_SERVER_ERROR);
+	switch (res->pid = fork()) {
+	case -1:
+		close(pfd[0]);
+		close(pfd[1]);
+		return http_send_status(res, S_INTERNAL_SERVER_ERROR);
+	case 0:
+		/* other connections must not be held open by this process */
+		if (digest_child_init(pfd[1]) == -1)
+			_exit(1);
+		_exit(write_body(STDERR_FILENO + 2, name) ? 1 : 0);
+	}
+	close(pfd[1]);
+	res->fd = pfd[0];
+	if (fcntl(res->fd, F_SETFL, fcntl(res->fd, F_GETFL) | O_NONBLOCK) < 0)
+		return http_send_status(res, S_INTERNAL_SERVER_ERROR);
+
+	return S_OK;
+}
+
+/*
+ * resp_text - send a plain text body held in res->body_buf
+ */
+static enum status
+resp_text(struct request *req, struct response *res, size_t len) {
+	char t[TIMESTAMP_LEN];
+
+	res->body = res->body_buf;
+
+	if (head_printf(res,
+	        "HTTP/1.1 %d %s\r\n"
+	        "Date: %s\r\n"
+	        "Connection: %s\r\n"
+	        "Content-Type: text/plain\r\n"
+	        "Content-Length: %zu\r\n"
+	        "\r\n",
+	        S_OK, status_str[S_OK], timestamp(time(NULL), t), CONNECTION_STR(res), len)
+	    < 0) {
+		return http_send_status(res, S_INTERNAL_SERVER_ERROR);
+	}
+	if (req->method == M_GET) {
+		res->offset = 0;
+		res->remaining = len;
+	}
+	return S_OK;
+}
+
+/*
+ * http_send_stats - report the counters and histograms of the server
+ */
 enum status
-http_send_response(int fd, struct request *req) {
+http_send_stats(struct request *req, struct response *res) {
+	size_t len;
+
+	if ((res->body_buf = stats_format("", &len)) == NULL)
+		return http_send_status(res, S_INTERNAL_SERVER_ERROR);
+	return resp_text(req, res, len);
+}
+
+enum status
+http_send_response(struct request *req, struct response *res) {
 	struct stat st;
 	struct tm tm;
+	struct stat enc_st;
 	size_t len;
 	long lower, upper;
-	char realtarget[PATH_MAX], t[TIMESTAMP_LEN];
+	int n, encode, not_modified = 0, precompressed = 0;
+	char realtarget[PATH_MAX], encname[PATH_MAX], t[TIMESTAMP_LEN];
 	char *p, *q;
-	const char *err;
 
 	/* make a working copy of the target */
 	memcpy(realtarget, req->target, sizeof(realtarget));
 
 	/* normalize target */
 	if (normabspath(realtarget)) {
-		return http_send_status(fd, S_BAD_REQUEST);
+		return http_send_status(res, S_BAD_REQUEST);
 	}
 
 	/* reject hidden target */
 	if (realtarget[0] == '.' || strstr(realtarget, "/.")) {
-		return http_send_status(fd, S_FORBIDDEN);
+		return http_send_status(res, S_FORBIDDEN);
 	}
 
 	/* stat the target */
-	if (stat(RELPATH(realtarget), &st) < 0) {
-		return http_send_status(fd, (errno == EACCES) ? S_FORBIDDEN : S_NOT_FOUND);
+	if (cache_stat(RELPATH(realtarget), &st) < 0) {
+		return http_send_status(res, (errno == EACCES) ? S_FORBIDDEN : S_NOT_FOUND);
 	}
 
 	if (S_ISDIR(st.st_mode)) {
 		/* add / to target if not present */
 		len = strlen(realtarget);
 		if (len >= PATH_MAX - 2) {
-			return http_send_status(fd, S_REQUEST_TOO_LARGE);
+			return http_send_status(res, S_REQUEST_TOO_LARGE);
 		}
 		if (len && realtarget[len - 1] != '/') {
 			realtarget[len] = '/';
@@ -319,204 +685,300 @@ http_send_response(int fd, struct request *req) {
 		}
 	}
 
-	if (S_ISDIR(st.st_mode))
-		return http_send_status(fd, S_FORBIDDEN);
+	if (S_ISDIR(st.st_mode)) {
+		if (!strcmp(req->query, "tar"))
+			return resp_stream(RELPATH(realtarget), "application/x-tar", tar_write,
+			    req, res);
+		/* digests not yet known are computed by the child */
+		if (!strcmp(req->query, "manifest"))
+			return resp_stream(RELPATH(realtarget), "text/plain", manifest_write,
+			    req, res);
+		return http_send_status(res, S_FORBIDDEN);
+	}
+
+	/* digest and possibly the contents of the file */
+	if ((res->entry = cache_get(RELPATH(realtarget), &st)))
+		res->body = res->entry->data;
 
-	/* modified since */
-	if (req->field[REQ_IF_MODIFIED_SINCE][0]) {
+	/* content codings apply to the whole file, not to ranges */
+	encode = res->entry && req->field[REQ_ACCEPT_ENCODING][0] && !req->field[REQ_RANGE][0];
+
+	/*
+	 * entity tags take precedence over the modification date; both are
+	 * checked before a file is compressed
+	 */
+	if (req->field[REQ_IF_NONE_MATCH][0]) {
+		not_modified = res->entry
+		    && etag_match(req->field[REQ_IF_NONE_MATCH], res->entry->digest);
+	} else if (req->field[REQ_IF_MODIFIED_SINCE][0]) {
 		/* parse field */
 		if (!strptime(req->field[REQ_IF_MODIFIED_SINCE], "%a, %d %b %Y %T GMT", &tm)) {
-			return http_send_status(fd, S_BAD_REQUEST);
+			return http_send_status(res, S_BAD_REQUEST);
 		}
 
 		/* compare with last modification date of the file */
-		if (difftime(st.st_mtim.tv_sec, timegm(&tm)) <= 0) {
-			if (dprintf(fd,
-			        "HTTP/1.1 %d %s\r\n"
-			        "Date: %s\r\n"
-			        "Connection: close\r\n"
-			        "\r\n",
-			        S_NOT_MODIFIED, status_str[S_NOT_MODIFIED], timestamp(time(NULL), t))
-			    < 0) {
-				return S_REQUEST_TIMEOUT;
-			}
-			return S_NOT_MODIFIED;
-		}
+		not_modified = difftime(st.st_mtim.tv_sec, timegm(&tm)) <= 0;
 	}
+	if (encode) {
+		precompressed = select_encoding(req->field[REQ_ACCEPT_ENCODING],
+		    RELPATH(realtarget), res, encname, &enc_st, !not_modified);
+	}
+	if (not_modified)
+		return resp_not_modified(res);
 
-	/* range */
+	/* range; a request for too many ranges is answered with the whole file */
 	lower = 0;
 	upper = st.st_size - 1;
-	if (req->field[REQ_RANGE][0]) {
-		/* parse field */
-		p = req->field[REQ_RANGE];
-		err = NULL;
-
+	p = req->field[REQ_RANGE];
+	for (n = 0, q = p; (q = strchr(q, ',')); q++, n++)
+		;
+	if (p[0] && n < RANGES_MAX) {
 		if (strncmp(p, "bytes=", sizeof("bytes=") - 1)) {
-			return http_send_status(fd, S_BAD_REQUEST);
+			return http_send_status(res, S_BAD_REQUEST);
 		}
 		p += sizeof("bytes=") - 1;
 
-		if (!(q = strchr(p, '-'))) {
-			return http_send_status(fd, S_BAD_REQUEST);
-		}
-		*(q++) = '\0';
-		if (p[0] != '\0') {
-			/*
-			 * Range has format "first-last" or "first-",
-			 * i.e. return bytes 'first' to 'last' (or the
-			 * last byte if 'last' is not given),
-			 * inclusively, and byte-numbering beginning at 0
-			 */
-			lower = strtonum(p, 0, LLONG_MAX, &err);
-			if (!err) {
-				if (q[0] != '\0') {
-					upper = strtonum(q, 0, LLONG_MAX, &err);
-				} else {
-					upper = st.st_size - 1;
-				}
+		n = 0;
+		while ((q = strsep(&p, ","))) {
+			switch (parse_range(q, st.st_size, &res->ranges[n])) {
+			case -1:
+				return http_send_status(res, S_BAD_REQUEST);
+			case 0:
+				n++;
+				break;
 			}
-			if (err) {
-				/* one of the strtonum()'s failed */
-				return http_send_status(fd, S_BAD_REQUEST);
+		}
+		if (n == 0) {
+			res->keep_alive = 0;
+			if (head_printf(res,
+			        "HTTP/1.1 %d %s\r\n"
+			        "Date: %s\r\n"
+			        "Content-Range: bytes */%ld\r\n"
+			        "Connection: close\r\n"
+			        "\r\n",
+			        S_RANGE_NOT_SATISFIABLE, status_str[S_RANGE_NOT_SATISFIABLE],
+			        timestamp(time(NULL), t), (long) st.st_size)
+			    < 0) {
+				return S_INTERNAL_SERVER_ERROR;
 			}
+			return S_RANGE_NOT_SATISFIABLE;
+		}
+		res->n_ranges = n;
+		lower = res->ranges[0].lower;
+		upper = res->ranges[0].upper;
+	}
 
-			/* check ranges */
-			if (lower > upper || lower >= st.st_size) {
-				goto not_satisfiable;
-			}
+	if (precompressed)
+		return resp_file(encname, req, res, &enc_st, 0, enc_st.st_size - 1);
+	if (res->encoding)
+		return resp_file(RELPATH(realtarget), req, res, &st, 0, res->entry->gz_size - 1);
+	return resp_file(RELPATH(realtarget), req, res, &st, lower, upper);
+}
 
-			/* adjust upper limit to be at most the last byte */
-			upper = MIN(upper, st.st_size - 1);
-		} else {
-			/*
-			 * Range has format "-num", i.e. return the 'num'
-			 * last bytes
-			 */
-
-			/*
-			 * use upper as a temporary storage for 'num',
-			 * as we know 'upper' is st.st_size - 1
-			 */
-			upper = strtonum(q, 0, LLONG_MAX, &err);
-			if (err) {
-				return http_send_status(fd, S_BAD_REQUEST);
-			}
+enum status
+resp_file(const char *name, struct request *req, struct response *res, const struct stat *st,
+    long lower, long upper) {
+	enum status s;
+	int i;
+	long len;
+	char t1[TIMESTAMP_LEN], t2[TIMESTAMP_LEN];
 
-			/* determine lower */
-			if (upper > st.st_size) {
-				/* more bytes requested than we have */
-				lower = 0;
-			} else {
-				lower = st.st_size - upper;
-			}
+	req->bytes_sent = 0;
+
+	/* use the cached contents or open file */
+	if (!res->body && (res->fd = open(name, O_RDONLY)) == -1) {
+		return http_send_status(res, S_FORBIDDEN);
+	}
 
-			/* set upper to the correct value */
-			upper = st.st_size - 1;
+	/* prepare header; the body is written by http_send() */
+	s = res->n_ranges ? S_PARTIAL_CONTENT : S_OK;
+
+	if (res->n_ranges > 1) {
+		/* parts are separated by a random boundary */
+		snprintf(res->boundary, sizeof(res->boundary), "%08x%08x", arc4random(),
+		    arc4random());
+		len = 0;
+		for (i = 0; i <= res->n_ranges; i++) {
+			len += part_head(res, i, st->st_size, NULL, 0);
+			if (i < res->n_ranges)
+				len += res->ranges[i].upper - res->ranges[i].lower + 1;
 		}
-		goto satisfiable;
-	not_satisfiable:
-		if (dprintf(fd,
+		if (head_printf(res,
 		        "HTTP/1.1 %d %s\r\n"
 		        "Date: %s\r\n"
-		        "Content-Range: bytes */%ld\r\n"
-		        "Connection: close\r\n"
-		        "\r\n",
-		        S_RANGE_NOT_SATISFIABLE, status_str[S_RANGE_NOT_SATISFIABLE],
-		        timestamp(time(NULL), t), (long) st.st_size)
+		        "Connection: %s\r\n"
+		        "Last-Modified: %s\r\n"
+		        "Content-Type: multipart/byteranges; boundary=%s\r\n"
+		        "Content-Length: %ld\r\n",
+		        s, status_str[s], timestamp(time(NULL), t1), CONNECTION_STR(res),
+		        timestamp(st->st_mtim.tv_sec, t2), res->boundary, len)
 		    < 0) {
-			return S_REQUEST_TIMEOUT;
+			return http_send_status(res, S_INTERNAL_SERVER_ERROR);
 		}
-		return S_RANGE_NOT_SATISFIABLE;
-	satisfiable:;
+	} else if (head_printf(res,
+	               "HTTP/1.1 %d %s\r\n"
+	               "Date: %s\r\n"
+	               "Connection: %s\r\n"
+	               "Last-Modified: %s\r\n"
+	               "Content-Type: application/octet-stream\r\n"
+	               "Content-Length: %ld\r\n",
+	               s, status_str[s], timestamp(time(NULL), t1), CONNECTION_STR(res),
+	               timestamp(st->st_mtim.tv_sec, t2), upper - lower + 1)
+	    < 0) {
+		return http_send_status(res, S_INTERNAL_SERVER_ERROR);
+	}
+	if (res->n_ranges == 1) {
+		if (head_printf(res, "Content-Range: bytes %ld-%ld/%ld\r\n", lower, upper + (upper < 0),
+		        (long) st->st_size)
+		    < 0) {
+			return http_send_status(res, S_INTERNAL_SERVER_ERROR);
+		}
+	}
+	if (res->encoding) {
+		if (head_printf(res, "Content-Encoding: %s\r\n", res->encoding) < 0)
+			return http_send_status(res, S_INTERNAL_SERVER_ERROR);
+	}
+	if (head_validators(res) < 0 || head_printf(res, "\r\n") < 0) {
+		return http_send_status(res, S_INTERNAL_SERVER_ERROR);
+	}
+
+	if (req->method != M_GET) {
+		res->n_ranges = 0;
+	} else if (res->n_ranges > 1) {
+		/* parts are started by http_send() */
+		res->file_size = st->st_size;
+		res->cur_range = -1;
+	} else {
+		res->offset = lower;
+		res->remaining = upper - lower + 1;
 	}
 
-	return resp_file(fd, RELPATH(realtarget), req, &st, lower, upper);
+	return s;
 }
 
-enum status
-resp_file(
-    int fd, const char *name, struct request *req, const struct stat *st, long lower, long upper) {
-	FILE *fp;
-	enum status s;
-	ssize_t bread, bwritten;
-	long remaining;
-	int range;
+/*
+ * send_file - copy a portion of the response body to a socket
+ */
+static ssize_t
+send_file(int fd, struct response *res, size_t len) {
+	ssize_t nr;
 	char read_buf[16384];
-	char *p, t1[TIMESTAMP_LEN], t2[TIMESTAMP_LEN];
-
-	req->bytes_sent = 0;
 
-	/* open file */
-	if (!(fp = fopen(name, "r"))) {
-		s = http_send_status(fd, S_FORBIDDEN);
-		goto cleanup;
+	if (res->body) {
+		if ((nr = write(fd, res->body + res->offset, len)) > 0)
+			res->offset += nr;
+		return nr;
 	}
 
-	/* seek to lower bound */
-	if (fseek(fp, lower, SEEK_SET)) {
-		s = http_send_status(fd, S_INTERNAL_SERVER_ERROR);
-		goto cleanup;
+#if defined(_LINUX_PORT)
+	/* copy from the page cache; read the file if sendfile is not supported */
+	if (!res->no_sendfile) {
+		nr = sendfile(fd, res->fd, &res->offset, MIN(len, SENDFILE_MAX));
+		if (nr != -1 || (errno != EINVAL && errno != ENOSYS))
+			return nr;
+		res->no_sendfile = 1;
 	}
+#endif
 
-	/* send header as late as possible */
-	range = req->field[REQ_RANGE][0];
-	s = range ? S_PARTIAL_CONTENT : S_OK;
-
-	if (dprintf(fd,
-	        "HTTP/1.1 %d %s\r\n"
-	        "Date: %s\r\n"
-	        "Connection: close\r\n"
-	        "Last-Modified: %s\r\n"
-	        "Content-Type: application/octet-stream\r\n"
-	        "Content-Length: %ld\r\n",
-	        s, status_str[s], timestamp(time(NULL), t1), timestamp(st->st_mtim.tv_sec, t2),
-	        upper - lower + 1)
-	    < 0) {
-		s = S_REQUEST_TIMEOUT;
-		goto cleanup;
+	if ((nr = pread(res->fd, read_buf, MIN(sizeof(read_buf), len), res->offset)) <= 0) {
+		/* file was truncated */
+		if (nr == 0)
+			errno = EIO;
+		return -1;
 	}
-	if (range) {
-		if (dprintf(fd, "Content-Range: bytes %ld-%ld/%ld\r\n", lower, upper + (upper < 0),
-		        (long) st->st_size)
-		    < 0) {
-			s = S_REQUEST_TIMEOUT;
-			goto cleanup;
+	if ((nr = write(fd, read_buf, nr)) > 0)
+		res->offset += nr;
+	return nr;
+}
+
+/*
+ * send_stream - copy the output of a child process to a socket
+ */
+static int
+send_stream(int fd, struct request *req, struct response *res, size_t quantum) {
+	ssize_t nr;
+
+	while (quantum > 0) {
+		if (res->stream_off == res->stream_len) {
+			if ((nr = read(res->fd, res->stream_buf, STREAM_BUF_SIZE)) == 0)
+				return 0;
+			if (nr < 0) {
+				if (errno == EINTR)
+					continue;
+				if (errno != EAGAIN)
+					return -1;
+				res->wait_input = 1;
+				return 1;
+			}
+			res->stream_len = nr;
+			res->stream_off = 0;
 		}
+		res->wait_input = 0;
+
+		nr = write(fd, res->stream_buf + res->stream_off, res->stream_len - res->stream_off);
+		if (nr < 0)
+			return (errno == EAGAIN || errno == EINTR) ? 1 : -1;
+		res->stream_off += nr;
+		req->bytes_sent += nr;
+		quantum -= MIN(quantum, (size_t) nr);
 	}
-	if (dprintf(fd, "\r\n") < 0) {
-		s = S_REQUEST_TIMEOUT;
-		goto cleanup;
+	return 1;
+}
+
+/*
+ * http_send - write a response to a non-blocking socket, and at most quantum
+ * bytes of the body
+ * Returns 0 when complete, 1 if the socket is not ready for more or -1 on error
+ */
+int
+http_send(int fd, struct request *req, struct response *res, size_t quantum) {
+	ssize_t nr;
+
+	while (res->head_sent < res->head_len) {
+		nr = write(fd, res->head + res->head_sent, res->head_len - res->head_sent);
+		if (nr < 0)
+			return (errno == EAGAIN || errno == EINTR) ? 1 : -1;
+		res->head_sent += nr;
 	}
 
-	if (req->method == M_GET) {
-		/* write data until upper bound is hit */
-		remaining = upper - lower + 1;
+	if (res->pid > 0)
+		return send_stream(fd, req, res, quantum);
 
-		while ((bread = fread(read_buf, 1, MIN(sizeof(read_buf), (size_t) remaining), fp))) {
-			if (bread < 0) {
-				s = S_INTERNAL_SERVER_ERROR;
-				goto cleanup;
-			}
-			remaining -= bread;
-			p = read_buf;
-			while (bread > 0) {
-				bwritten = write(fd, p, bread);
-				if (bwritten <= 0) {
-					s = S_REQUEST_TIMEOUT;
-					goto cleanup;
-				}
-				bread -= bwritten;
-				req->bytes_sent += bwritten;
-				p += bwritten;
-			}
+	while (1) {
+		/* write data until upper bound is hit */
+		while (res->remaining > 0) {
+			if (quantum == 0)
+				return 1;
+			nr = send_file(fd, res, MIN(quantum, (size_t) res->remaining));
+			if (nr < 0)
+				return (errno == EAGAIN || errno == EINTR) ? 1 : -1;
+			if (nr == 0)
+				return -1;
+			res->remaining -= nr;
+			req->bytes_sent += nr;
+			quantum -= nr;
 		}
-	}
 
-cleanup:
-	if (fp) {
-		fclose(fp);
+		/* start the next part of a multipart/byteranges body */
+		if (res->n_ranges < 2 || res->cur_range == res->n_ranges)
+			return 0;
+		if (res->part_head_sent == res->part_head_len) {
+			res->cur_range++;
+			res->part_head_len = part_head(res, res->cur_range, res->file_size,
+			    res->part_head, sizeof(res->part_head));
+			res->part_head_sent = 0;
+		}
+		while (res->part_head_sent < res->part_head_len) {
+			nr = write(fd, res->part_head + res->part_head_sent,
+			    res->part_head_len - res->part_head_sent);
+			if (nr < 0)
+				return (errno == EAGAIN || errno == EINTR) ? 1 : -1;
+			res->part_head_sent += nr;
+			req->bytes_sent += nr;
+		}
+		if (res->cur_range < res->n_ranges) {
+			res->offset = res->ranges[res->cur_range].lower;
+			res->remaining = res->ranges[res->cur_range].upper - res->offset + 1;
+		}
 	}
-
-	return s;
 }
@@ -3,6 +3,7 @@
  * HTTP request handling for miniquark
  */
 
+#include <sys/types.h>
 #include <sys/stat.h>
 
 #include <limits.h>
@@ -10,15 +11,24 @@
 #define HEADER_MAX 4096
 #define FIELD_MAX 200
 #define TIMESTAMP_LEN 30
+#define SENDFILE_MAX 1073741824
+#define STREAM_BUF_SIZE 65536
+#define RANGES_MAX 16
+#define SEND_QUANTUM 262144 /* bytes written to one connection at a time */
 
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
 #define LEN(x) (sizeof(x) / sizeof *(x))
+#define CONNECTION_STR(res) ((res)->keep_alive ? "keep-alive" : "close")
 #define RELPATH(x) ((!*(x) || !strcmp(x, "/")) ? "." : ((x) + 1))
 
 enum req_field {
 	REQ_RANGE,
 	REQ_IF_MODIFIED_SINCE,
+	REQ_IF_NONE_MATCH,
 	REQ_AGENT,
+	REQ_CONNECTION,
+	REQ_ACCEPT_ENCODING,
+	REQ_SESSION,
 	NUM_REQ_FIELDS,
 };
 
@@ -35,10 +45,44 @@ extern const char *req_method_str[];
 struct request {
 	enum req_method method;
 	char target[PATH_MAX];
+	char query[FIELD_MAX];
 	char field[NUM_REQ_FIELDS][FIELD_MAX];
 	unsigned long bytes_sent;
 };
 
+struct byterange {
+	long lower;
+	long upper;
+};
+
+struct response {
+	char head[HEADER_MAX];
+	size_t head_len;
+	size_t head_sent;
+	int fd;
+	struct cache_entry *entry; /* digest and contents of the file */
+	const char *body;          /* response body held in memory */
+	char *body_buf;            /* body allocated for this response */
+	const char *encoding;      /* content coding of the body */
+	int keep_alive;
+	int no_sendfile;
+	off_t offset;
+	off_t remaining;
+	pid_t pid;        /* process writing the body to fd */
+	int wait_input;   /* fd has no data available yet */
+	char *stream_buf; /* data read from fd that is not yet sent */
+	size_t stream_len;
+	size_t stream_off;
+	struct byterange ranges[RANGES_MAX];
+	int n_ranges;   /* more than one for a multipart/byteranges body */
+	int cur_range;  /* part being sent */
+	long file_size;
+	char boundary[17];
+	char part_head[256];
+	size_t part_head_len;
+	size_t part_head_sent;
+};
+
 enum status {
 	S_OK = 200,
 	S_PARTIAL_CONTENT = 206,
@@ -57,7 +101,13 @@ enum status {
 
 extern const char *status_str[];
 
-enum status http_send_status(int, enum status);
-int http_get_request(int, struct request *);
-enum status http_send_response(int, struct request *);
-enum status resp_file(int, const char *, struct request *, const struct stat *, long, long);
+void http_response_init(struct response *);
+void http_response_free(struct response *);
+enum status http_send_status(struct response *, enum status);
+size_t http_header_length(const char *, size_t);
+int http_get_request(char *, size_t, struct request *, struct response *);
+enum status http_send_response(struct request *, struct response *);
+enum status http_send_stats(struct request *, struct response *);
+enum status resp_file(
+    const char *, struct request *, struct response *, const struct stat *, long, long);
+int http_send(int, struct request *, struct response *, size_t);
@@ -3,6 +3,8 @@
  * Parse progressive label notation
  */
 
+#include <sys/wait.h>
+
 #include <err.h>
 #include <fcntl.h>
 #include <regex.h>
@@ -15,9 +17,11 @@
 #include "missing/compat.h"
 
 #include "config.h"
+#include "envfile.h"
 #include "execute.h"
 #include "input.h"
 #include "rutils.h"
+#include "snapshot.h"
 #include "xlibc.h"
 
 #define BUFSIZE 4096
@@ -25,22 +29,14 @@
 /* globals from input.h */
 extern Label **route_labels;
 
-/* globals */
-FILE *yyin;
-Label *lp;
-Options current_options;
-const char *yyfn;
-int n_labels;
-enum { HostLabel, RouteLabel } pln_mode;
-
 /*
  * Emit an error current PLN
  */
 void
-erry(const char *fmt, ...) {
+erry(const Parser *pp, const char *fmt, ...) {
 	va_list ap;
 
-	fprintf(stderr, "%s: ", yyfn);
+	fprintf(stderr, "%s: ", pp->fn);
 	va_start(ap, fmt);
 	vfprintf(stderr, fmt, ap);
 	write(STDERR_FILENO, "\n", 1);
@@ -48,12 +44,13 @@ erry(const char *fmt, ...) {
 }
 
 void
-parse_pln(Label **labels) {
+parse_pln(Parser *pp, Label **labels) {
 	int content_allocation = 0;
 	int error_code;
 	int j;
 	int tfd = 0;
 	int local_argc;
+	off_t len;
 	enum { Unset, Local, Remote } context;
 	unsigned n = 0;
 	char tmp_src[128];
@@ -63,9 +60,10 @@ parse_pln(Label **labels) {
 	size_t linesize = 0;
 	ssize_t linelen;
 	Options op;
+	Label *lp;
 
 	context = Unset;
-	while ((linelen = getline(&line, &linesize, yyin)) != -1) {
+	while ((linelen = getline(&line, &linesize, pp->in)) != -1) {
 		n++;
 
 		/* empty lines and comments */
@@ -74,13 +72,13 @@ parse_pln(Label **labels) {
 
 		/* leading whitespace */
 		else if (line[0] == ' ')
-			erry("invalid leading character on line %d: '%c'", n, line[0]);
+			erry(pp, "invalid leading character on line %d: '%c'", n, line[0]);
 
 		/* { ... } local execution */
 		else if (line[0] == '{') {
 			context = Local;
 			if (strlen(line) > 2)
-				erry("invalid trailing characters on line %d: '%s'", n, line);
+				erry(pp, "invalid trailing characters on line %d: '%s'", n, line);
 
 			str_cpy(tmp_src, "/tmp/rset_local.XXXXXX", sizeof tmp_src);
 			if ((tfd = mkstemp(tmp_src)) == -1)
@@ -90,11 +88,30 @@ parse_pln(Label **labels) {
 		else if (line[0] == '}') {
 			context = Remote;
 			if (strlen(line) > 2)
-				erry("invalid trailing characters on line %d: '%s'", n, line);
+				erry(pp, "invalid trailing characters on line %d: '%s'", n, line);
+
+			if (tfd > 0 && strcmp(labels[pp->n_labels - 1]->options.local_output, "stream") == 0) {
+				/* local execution is deferred until the label is executed */
+				lp = labels[pp->n_labels - 1];
+				if (pp->mode == RouteLabel)
+					erry(pp, "local_output=stream is not permitted for the route label '%s'",
+					    lp->name);
+				len = lseek(tfd, 0, SEEK_END);
+				free(lp->generator);
+				lp->generator = xmalloc(len + 1, "generator");
+				if (pread(tfd, lp->generator, len, 0) != len)
+					err(1, "read %s", tmp_src);
+				lp->generator[len] = '\0';
+				lp->content[0] = '\0';
+				lp->content_size = 0;
 
-			if (tfd > 0) {
 				close(tfd);
-				lp = labels[n_labels - 1];
+				unlink(tmp_src);
+				tfd = 0;
+			} else if (tfd > 0) {
+				close(tfd);
+				snapshot_mark_volatile();
+				lp = labels[pp->n_labels - 1];
 				apply_default(
 				    op.local_interpreter, lp->options.local_interpreter, LOCAL_INTERPRETER);
 
@@ -106,12 +123,12 @@ parse_pln(Label **labels) {
 
 				unlink(tmp_src);
 				if (error_code != 0)
-					errx(1, "local execution for %s label '%s' exited with code %d", yyfn, lp->name,
+					errx(1, "local execution for %s label '%s' exited with code %d", pp->fn, lp->name,
 					    error_code);
 				tfd = 0;
 
 				if ((lp->content_size > 0) && (lp->content[lp->content_size - 1] != '\n'))
-					erry("output of local execution for the label '%s' must end with a newline",
+					erry(pp, "output of local execution for the label '%s' must end with a newline",
 					    lp->name);
 			}
 		}
@@ -120,13 +137,13 @@ parse_pln(Label **labels) {
 		else if (line[0] == '\t') {
 			switch (context) {
 			case Unset:
-				erry("indented text in unexpected context on line %d", n);
+				erry(pp, "indented text in unexpected context on line %d", n);
 			case Local:
 				if ((write(tfd, line + 1, linelen - 1)) == -1)
 					err(1, "write");
 				break;
 			case Remote:
-				lp = labels[n_labels - 1];
+				lp = labels[pp->n_labels - 1];
 				while ((linelen + lp->content_size) >= content_allocation) {
 					content_allocation += BUFSIZE;
 					lp->content = xrealloc(lp->content, content_allocation, "lp->content");
@@ -142,38 +159,38 @@ parse_pln(Label **labels) {
 		else if (strchr(line, '=')) {
 			context = Unset;
 			line[linelen - 1] = '\0';
-			read_option(line, &current_options);
+			read_option(pp, line, &pp->options);
 		}
 
 		/* label */
 		else if (strchr(line, ':')) {
 			context = Remote;
 
-			labels[n_labels] = xmalloc(sizeof(Label), "labels[]");
-			labels[n_labels]->content = xmalloc(BUFSIZE, "labels[].content");
+			labels[pp->n_labels] = xmalloc(sizeof(Label), "labels[]");
+			labels[pp->n_labels]->content = xmalloc(BUFSIZE, "labels[].content");
 
 			content_allocation = BUFSIZE;
-			read_label(line, labels[n_labels]);
-			for (j = 0; j < labels[n_labels]->n_aliases; j++) {
-				aliases = labels[n_labels]->aliases[j];
+			read_label(pp, line, labels[pp->n_labels]);
+			for (j = 0; j < labels[pp->n_labels]->n_aliases; j++) {
+				aliases = labels[pp->n_labels]->aliases[j];
 				if (aliases && aliases[0] == ' ')
-					erry("invalid leading character for label alias on line %d: '%c'", n,
+					erry(pp, "invalid leading character for label alias on line %d: '%c'", n,
 					    aliases[0]);
 			}
-			n_labels++;
-			if (n_labels == MAX_LABELS)
-				erry("maximum number of labels (%d) exceeded", n_labels);
+			pp->n_labels++;
+			if (pp->n_labels == MAX_LABELS)
+				erry(pp, "maximum number of labels (%d) exceeded", pp->n_labels);
 		}
 
 		/* unknown */
 		else {
 			line[linelen - 1] = '\0';
-			erry("unknown symbol at line %d: '%s'", n, line);
+			erry(pp, "unknown symbol at line %d: '%s'", n, line);
 		}
 	}
 
 	free(line);
-	if (ferror(yyin))
+	if (ferror(pp->in))
 		err(1, "getline");
 }
 
@@ -195,14 +212,18 @@ alloc_labels() {
  */
 void
 read_route_labels(const char *fn) {
-	yyfn = fn;
-	yyin = fopen(fn, "r");
-	if (!yyin)
+	Parser p;
+
+	bzero(&p, sizeof(p));
+	p.fn = fn;
+	p.in = fopen(fn, "r");
+	if (!p.in)
 		err(1, "%s", fn);
+	snapshot_add_dependency(fn);
 
-	pln_mode = RouteLabel;
-	parse_pln(route_labels);
-	fclose(yyin);
+	p.mode = RouteLabel;
+	parse_pln(&p, route_labels);
+	fclose(p.in);
 }
 
 /*
@@ -212,65 +233,284 @@ void
 read_host_labels(Label *route_label) {
 	char *line, *next_line;
 	char *content;
+	Parser p;
 
-	pln_mode = HostLabel;
+	bzero(&p, sizeof(p));
+	p.mode = HostLabel;
 	route_label->labels = alloc_labels();
 	content = xstrdup(route_label->content, "content");
 	line = content;
-	n_labels = 0;
 	while (*line) {
 		next_line = strchr(line, '\n');
 		*next_line = '\0';
-
-		/* inherit option state from the routes file */
-		memcpy(&current_options, &route_label->options, sizeof(current_options));
-		yyfn = line; /* for error message */
-		yyin = fopen(line, "r");
-		if (!yyin)
-			err(1, "%s", line);
-		parse_pln(route_label->labels);
-		fclose(yyin);
+		read_host_file(&p, route_label, line, route_label->labels);
 		line = next_line + 1;
 	}
 	free(content);
 }
 
 /*
- * expand_route_labels - transform host ranges
+ * read_all_host_labels - parse pln files for every route using forked parsers
+ *
+ * Each pln file is parsed independently by one of n_jobs processes. Results
+ * are merged in the order of a sequential parse; output is replayed for each
+ * file and the first error halts the parse.
  */
+
+typedef struct {
+	Label *route_label;
+	char *fn;
+} ParseUnit;
+
+typedef struct {
+	pid_t pid;
+	int status;
+	FILE *result;
+	FILE *out;
+	FILE *err;
+} ParseJob;
+
+static void
+copy_output(int fd, FILE *to) {
+	char buf[BUFSIZE];
+	long long len;
+	ssize_t nr;
+
+	len = lseek(fd, 0, SEEK_END);
+	fwrite(&len, sizeof(len), 1, to);
+	lseek(fd, 0, SEEK_SET);
+	while ((nr = read(fd, buf, sizeof(buf))) > 0)
+		fwrite(buf, 1, nr, to);
+	if (ftruncate(fd, 0) == -1)
+		err(1, "ftruncate");
+	lseek(fd, 0, SEEK_SET);
+}
+
+static int
+replay_output(FILE *from, int fd) {
+	char buf[BUFSIZE];
+	long long len;
+	size_t nr;
+
+	if (fread(&len, sizeof(len), 1, from) != 1)
+		return -1;
+	while (len > 0) {
+		nr = fread(buf, 1, (len < (long long) sizeof(buf)) ? (size_t) len : sizeof(buf), from);
+		if (nr == 0)
+			return -1;
+		write(fd, buf, nr);
+		len -= nr;
+	}
+	return 0;
+}
+
+static void
+replay_file(FILE *from, int fd) {
+	char buf[BUFSIZE];
+	size_t nr;
+
+	rewind(from);
+	while ((nr = fread(buf, 1, sizeof(buf), from)) > 0)
+		write(fd, buf, nr);
+}
+
+static void
+free_contents(char **contents, int n_routes) {
+	int i;
+
+	for (i = 0; i < n_routes; i++)
+		free(contents[i]);
+	free(contents);
+}
+
+static void
+parse_units(ParseUnit *units, int n_units, int job, int n_jobs, ParseJob *pj) {
+	int u;
+	Label **labels;
+	Parser p;
+
+	if (dup2(fileno(pj->out), STDOUT_FILENO) == -1 || dup2(fileno(pj->err), STDERR_FILENO) == -1)
+		err(1, "dup2");
+
+	for (u = job; u < n_units; u += n_jobs) {
+		bzero(&p, sizeof(p));
+		p.mode = HostLabel;
+		labels = alloc_labels();
+		read_host_file(&p, units[u].route_label, units[u].fn, labels);
+
+		fflush(stdout);
+		snapshot_put_labels(pj->result, labels);
+		copy_output(STDOUT_FILENO, pj->result);
+		copy_output(STDERR_FILENO, pj->result);
+		if (fflush(pj->result) != 0)
+			err(1, "write");
+	}
+}
+
 void
-expand_route_labels() {
-	int i, j;
-	int n_exp;
-	int n_routes, n_routes_ext;
-	char *host_range[MAX_LABELS];
+read_all_host_labels(int max_jobs, int min_units) {
+	int i, u;
+	int n_jobs;
+	int n_routes;
+	int offset = 0;
+	int n_units = 0;
+	int unit_allocation = 0;
+	char *line, *next_line;
+	char **contents; /* copies of route content that unit filenames point into */
+	ParseUnit *units = NULL;
+	ParseJob *pj, *jobs;
 
 	for (n_routes = 0; route_labels[n_routes]; n_routes++)
 		;
+	contents = xcalloc(n_routes + 1, sizeof(char *), "contents");
+	for (i = 0; route_labels[i]; i++) {
+		route_labels[i]->labels = alloc_labels();
+		line = contents[i] = xstrdup(route_labels[i]->content, "content");
+		while (*line) {
+			next_line = strchr(line, '\n');
+			*next_line = '\0';
+			if (n_units == unit_allocation) {
+				unit_allocation = unit_allocation ? unit_allocation * 2 : 64;
+				units = xrealloc(units, unit_allocation * sizeof(ParseUnit), "units");
+			}
+			units[n_units].route_label = route_labels[i];
+			units[n_units].fn = line;
+			n_units++;
+			line = next_line + 1;
+		}
+	}
 
-	n_routes_ext = n_routes;
-	for (i = 0; i < n_routes; i++) {
-		n_exp = expand_numeric_range(host_range, route_labels[i]->name);
-		if ((n_exp > 0) && (route_labels[i]->n_aliases > 1))
-			errx(1, "'%s' cannot be expanded with aliases defined", route_labels[i]->aliases[0]);
+	n_jobs = n_units / min_units;
+	if (n_jobs > max_jobs)
+		n_jobs = max_jobs;
+	if (n_jobs < 2) {
+		for (i = 0; route_labels[i]; i++)
+			read_host_labels(route_labels[i]);
+		free_contents(contents, n_routes);
+		free(units);
+		return;
+	}
 
-		for (j = 0; j < n_exp; j++) {
-			/* rename first entry */
-			if (j == 0)
-				route_labels[i]->aliases[0] = host_range[j];
-			/* replicate the source label, including pointers to content and options */
-			else {
-				route_labels[n_routes_ext] = xmalloc(sizeof(Label), "labels[]");
-				memcpy(route_labels[n_routes_ext], route_labels[i], sizeof(Label));
-				route_labels[n_routes_ext]->aliases[0] = host_range[j];
-				n_routes_ext++;
-
-				if (n_routes_ext == MAX_LABELS)
-					errx(1, "maximum number of labels (%d) exceeded while expanding '%s'",
-					    n_routes_ext, route_labels[i]->name);
-			}
+	/* do not duplicate buffered output in child processes */
+	fflush(stdout);
+	fflush(stderr);
+
+	jobs = xcalloc(n_jobs, sizeof(ParseJob), "jobs");
+	for (i = 0; i < n_jobs; i++) {
+		pj = &jobs[i];
+		if (!(pj->result = tmpfile()) || !(pj->out = tmpfile()) || !(pj->err = tmpfile()))
+			err(1, "tmpfile");
+		switch (pj->pid = fork()) {
+		case -1:
+			err(1, "fork");
+		case 0:
+			parse_units(units, n_units, i, n_jobs, pj);
+			exit(0);
 		}
 	}
+	for (i = 0; i < n_jobs; i++) {
+		if (waitpid(jobs[i].pid, &jobs[i].status, 0) == -1)
+			err(1, "waitpid");
+		rewind(jobs[i].result);
+	}
+
+	for (u = 0; u < n_units; u++) {
+		if (u > 0 && units[u].route_label != units[u - 1].route_label)
+			offset = 0;
+		pj = &jobs[u % n_jobs];
+
+		/* a parser exits on the first error */
+		if ((i = snapshot_get_labels(pj->result, units[u].route_label->labels, offset)) == -1) {
+			fflush(stdout);
+			replay_file(pj->out, STDOUT_FILENO);
+			replay_file(pj->err, STDERR_FILENO);
+			if (WIFEXITED(pj->status) && WEXITSTATUS(pj->status) != 0)
+				exit(WEXITSTATUS(pj->status));
+			errx(1, "parser for %s terminated", units[u].fn);
+		}
+		offset += i;
+		if (offset >= MAX_LABELS) {
+			fprintf(stderr, "%s: maximum number of labels (%d) exceeded\n", units[u].fn,
+			    MAX_LABELS);
+			exit(1);
+		}
+
+		fflush(stdout);
+		if (replay_output(pj->result, STDOUT_FILENO) == -1
+		    || replay_output(pj->result, STDERR_FILENO) == -1)
+			errx(1, "parser for %s terminated", units[u].fn);
+	}
+
+	for (i = 0; i < n_jobs; i++) {
+		fclose(jobs[i].result);
+		fclose(jobs[i].out);
+		fclose(jobs[i].err);
+	}
+	free(jobs);
+	free_contents(contents, n_routes);
+	free(units);
+}
+
+/*
+ * read_host_file - parse one pln file referenced by a route label
+ */
+void
+read_host_file(Parser *pp, const Label *route_label, const char *fn, Label **labels) {
+	/* inherit option state from the routes file */
+	memcpy(&pp->options, &route_label->options, sizeof(pp->options));
+	pp->fn = fn; /* for error message */
+	pp->in = fopen(fn, "r");
+	if (!pp->in)
+		err(1, "%s", fn);
+	snapshot_add_dependency(fn);
+	parse_pln(pp, labels);
+	fclose(pp->in);
+}
+
+/*
+ * expand_route_labels - attach a generator to routes that specify host ranges
+ */
+void
+expand_route_labels() {
+	int i;
+	HostRange range;
+
+	for (i = 0; route_labels[i]; i++) {
+		if (parse_numeric_range(&range, route_labels[i]->name) == 0)
+			continue;
+		if (route_labels[i]->n_aliases > 1)
+			errx(1, "'%s' cannot be expanded with aliases defined", route_labels[i]->aliases[0]);
+
+		route_labels[i]->range = xmalloc(sizeof(HostRange), "range");
+		memcpy(route_labels[i]->range, &range, sizeof(HostRange));
+	}
+}
+
+/*
+ * route_host_count - number of hostnames a route label responds to
+ * route_alias - return hostname if it is one of the names of a route label
+ */
+int
+route_host_count(const Label *route_label) {
+	if (route_label->range)
+		return range_count(route_label->range);
+	return route_label->n_aliases;
+}
+
+const char *
+route_alias(const Label *route_label, const char *hostname) {
+	int i;
+
+	if (route_label->range) {
+		if (range_contains(route_label->range, hostname))
+			return hostname;
+		return NULL;
+	}
+	for (i = 0; i < route_label->n_aliases; i++) {
+		if (route_label->aliases[i] && strcmp(hostname, route_label->aliases[i]) == 0)
+			return route_label->aliases[i];
+	}
+	return NULL;
 }
 
 /*
@@ -290,12 +530,14 @@ ltrim(char *s, int c) {
  * read_label - populate label name, alias, export_paths and options
  */
 void
-read_label(char *line, Label *label) {
+read_label(Parser *pp, char *line, Label *label) {
 	int len;
 	char *export;
-	regex_t label_reg;
 	regmatch_t regmatch;
 
+	static regex_t label_reg;
+	static bool label_reg_compiled;
+
 	/* remove trailing newline and split on last ':' */
 	line[strlen(line) - 1] = '\0';
 	export = strrchr(line, ':');
@@ -307,24 +549,29 @@ read_label(char *line, Label *label) {
 		errx(1, "> %d aliases specified for label '%s'", PLN_MAX_ALIASES, label->name);
 
 	len = str_to_array(label->export_paths, ltrim(export, ' '), PLN_MAX_PATHS, " ");
-	if ((label->export_paths[0] != NULL) && (pln_mode == HostLabel)) {
-		xregcomp(&label_reg, DEFAULT_LABEL_PATTERN, REG_EXTENDED);
+	if ((label->export_paths[0] != NULL) && (pp->mode == HostLabel)) {
+		if (!label_reg_compiled) {
+			xregcomp(&label_reg, DEFAULT_LABEL_PATTERN, REG_EXTENDED);
+			label_reg_compiled = true;
+		}
 		if (xregexec(&label_reg, label->name, 1, &regmatch) == 0)
-			erry("export path on label '%s' implies archive/restore and must not match "
+			erry(pp, "export path on label '%s' implies archive/restore and must not match "
 			     "default label pattern '" DEFAULT_LABEL_PATTERN "'",
 			    label->name);
 	}
 
 	if (len == PLN_MAX_PATHS)
-		erry("> %d export paths specified for label '%s'", PLN_MAX_PATHS - 1, label->name);
+		erry(pp, "> %d export paths specified for label '%s'", PLN_MAX_PATHS - 1, label->name);
 
-	memcpy(&label->options, &current_options, sizeof(current_options));
+	memcpy(&label->options, &pp->options, sizeof(pp->options));
 
 	/* options not inherited */
-	current_options.begin = 0;
-	current_options.end = 0;
+	pp->options.begin = 0;
+	pp->options.end = 0;
 
 	label->content_size = 0;
+	label->generator = NULL;
+	label->range = NULL;
 	label->labels = 0;
 }
 
@@ -332,7 +579,7 @@ read_label(char *line, Label *label) {
  * read_option - set one of the available options
  */
 void
-read_option(char *text, Options *op) {
+read_option(Parser *pp, char *text, Options *op) {
 	char *k, *v;
 
 	int len = 0;
@@ -347,72 +594,65 @@ read_option(char *text, Options *op) {
 		len = str_cpy(op->interpreter, v, PLN_OPTION_SIZE);
 	else if (strcmp(k, "local_interpreter") == 0)
 		len = str_cpy(op->local_interpreter, v, PLN_OPTION_SIZE);
-	else if (strcmp(k, "environment") == 0) {
+	else if (strcmp(k, "local_output") == 0) {
+		if (v[0] != '\0' && strcmp(v, "buffer") != 0 && strcmp(v, "stream") != 0)
+			erry(pp, "invalid value for option '%s': '%s'", k, v);
+		len = str_cpy(op->local_output, v, PLN_OPTION_SIZE);
+	}	else if (strcmp(k, "environment") == 0) {
 		len = str_cpy(op->environment, v, PLN_OPTION_SIZE);
-		env_split_lines(op->environment);
+		env_split_lines(pp, op->environment);
 	} else if (strcmp(k, "environment_file") == 0) {
-		env_file_check(v);
+		env_file_check(pp, v);
 		len = str_cpy(op->environment_file, v, PLN_OPTION_SIZE);
 	} else if (strcmp(k, "begin") == 0) {
 		op->begin = xstrdup(v, "op.begin");
 	} else if (strcmp(k, "end") == 0) {
 		op->end = xstrdup(v, "op.end");
 	} else
-		erry("unknown option '%s=%s'", k, v);
+		erry(pp, "unknown option '%s=%s'", k, v);
 
 	if (len > PLN_OPTION_SIZE)
-		erry("option '%s' too long: %d > %d", k, len, PLN_OPTION_SIZE);
+		erry(pp, "option '%s' too long: %d > %d", k, len, PLN_OPTION_SIZE);
 }
 
 /*
- * expand_numeric_range - bash-style numeric ranges {n..m}
+ * parse_numeric_range - bash-style numeric ranges {n..m}
+ * range_count - number of hostnames produced by a range
+ * range_format - generate the nth hostname in a range
+ * range_contains - test if a hostname is produced by a range
  */
 
 #define RANGE_SIZE 2
-#define MAX_DIGITS 6
+#define MAX_DIGITS 7
 
 int
-expand_numeric_range(char **range, char *input) {
+parse_numeric_range(HostRange *range, const char *input) {
 	int ch;
 	int group;
 	int n;
-	int i;
-	int seq;
 	int pos, out_pos;
-	int hostcount;
+	int len[RANGE_SIZE];
+	long long hostcount;
 	const char *errstr;
 
 	int in_range = 0;
-	int parts_index = 0;
-	char parts[RANGE_SIZE][PLN_LABEL_SIZE];
-
-	int range_index[RANGE_SIZE];
-	int range_numeric[RANGE_SIZE];
 	char range_string[RANGE_SIZE][MAX_DIGITS];
 
-	bzero(parts, sizeof(parts));
-	bzero(range_string, sizeof(range_string));
-	for (n = 0; n < RANGE_SIZE; n++)
-		range_index[n] = 0;
-	hostcount = 0;
+	bzero(range, sizeof(HostRange));
+	n = 0;
 
 	for (group = 0, pos = 0, out_pos = 0; input[pos]; pos++) {
 		ch = input[pos];
 
-		if (group > RANGE_SIZE)
-			errx(1, "maximum of %d groups", RANGE_SIZE / 2);
-
 		switch (ch) {
 		case '.':
 			if (in_range) {
-				switch (input[pos + 1]) {
-				case '.':
-					group++;
+				if ((n == 0) && (input[pos + 1] == '.')) {
+					n++; /* [low, high] */
 					pos++;
 					continue;
-				default:
-					errx(1, "unexpected %c at position %d", ch, pos);
 				}
+				errx(1, "unexpected %c at position %d", ch, pos);
 			}
 			break;
 		case '0':
@@ -426,54 +666,127 @@ expand_numeric_range(char **range, char *input) {
 		case '8':
 		case '9':
 			if (in_range) {
-				n = group - 1; /* [low, high] */
-				if (range_index[n] > MAX_DIGITS - 2)
+				if (len[n] > MAX_DIGITS - 2)
 					errx(1, "range %s too large at position %d", range_string[n], pos);
-				range_string[n][range_index[n]++] = ch;
+				range_string[n][len[n]++] = ch;
+				range_string[n][len[n]] = '\0';
 				continue;
 			}
 			break;
 		case '{':
+			if (in_range)
+				errx(1, "unexpected %c at position %d", ch, pos);
+			if (group == PLN_MAX_RANGES)
+				errx(1, "maximum of %d groups", PLN_MAX_RANGES);
 			in_range = 1;
-			group++;
-			n = group - 1; /* [low, high] */
-			range_index[n] = 0;
+			n = 0;
+			len[0] = len[1] = 0;
 			continue;
 		case '}':
-			if (!in_range)
+			if (!in_range || n != 1 || len[0] == 0 || len[1] == 0)
 				errx(1, "unexpected: %c at position %d", ch, pos);
 			in_range = 0;
-			parts_index++;
+
+			range->low[group] = strtonum(range_string[0], 0, 999999, &errstr);
+			if (errstr == NULL)
+				range->high[group] = strtonum(range_string[1], 0, 999999, &errstr);
+			if (errstr != NULL)
+				errx(1, "number out of bounds %s: '%s'", errstr, input);
+			if ((range->high[group] - range->low[group]) < 1)
+				errx(1, "non-ascending range: %d..%d", range->low[group], range->high[group]);
+
+			/* zero-padded if either bound has a leading zero */
+			if ((len[0] > 1 && range_string[0][0] == '0')
+			    || (len[1] > 1 && range_string[1][0] == '0'))
+				range->width[group] = (len[0] > len[1]) ? len[0] : len[1];
+
+			group++;
 			out_pos = 0;
 			continue;
+		default:
+			if (in_range)
+				errx(1, "unexpected %c at position %d", ch, pos);
 		}
 
-		parts[parts_index][out_pos++] = ch;
+		if (out_pos == PLN_LABEL_SIZE - 1)
+			errx(1, "label too long: '%s'", input);
+		range->parts[group][out_pos++] = ch;
 	}
+	if (in_range)
+		errx(1, "unterminated range: '%s'", input);
 
-	if (parts_index > 0) {
-		/* multiple groups may be captures, but only the first is formatted */
-		range_numeric[0] = range_numeric[1] = 0;
+	range->n_groups = group;
+	if (group == 0)
+		return 0;
 
-		for (i = 0; i < group; i++) {
-			range_numeric[i] = strtonum(range_string[i], 0, 9999, &errstr);
-			if (errstr != NULL)
-				errx(1, "number out of bounds %s: '%s'", errstr, range_string[i]);
-		}
+	for (hostcount = 1, n = 0; n < group; n++) {
+		hostcount *= range->high[n] - range->low[n] + 1;
+		if (hostcount > MAX_HOSTS)
+			errx(1, "maximum range exceeds %d", MAX_HOSTS);
+	}
+	return hostcount;
+}
 
-		if ((range_numeric[1] - range_numeric[0]) < 1)
-			errx(1, "non-ascending range: %d..%d", range_numeric[0], range_numeric[1]);
+int
+range_count(const HostRange *range) {
+	int n;
+	int hostcount = 1;
 
-		if ((range_numeric[1] - range_numeric[0]) > MAX_LABELS)
-			errx(1, "maximum range exceeds %d", MAX_LABELS);
+	for (n = 0; n < range->n_groups; n++)
+		hostcount *= range->high[n] - range->low[n] + 1;
+	return hostcount;
+}
 
-		for (seq = range_numeric[0]; seq <= range_numeric[1]; seq++) {
-			asprintf(&range[hostcount], "%s%d%s", parts[0], seq, parts[1]);
-			hostcount++;
-		}
+char *
+range_format(const HostRange *range, int index, char *buf, size_t size) {
+	int n;
+	int seq[PLN_MAX_RANGES];
+	size_t len;
+
+	/* the last group varies fastest */
+	for (n = range->n_groups - 1; n >= 0; n--) {
+		seq[n] = range->low[n] + index % (range->high[n] - range->low[n] + 1);
+		index /= range->high[n] - range->low[n] + 1;
 	}
-	range[hostcount] = NULL;
-	return hostcount;
+
+	len = str_cpy(buf, range->parts[0], size);
+	for (n = 0; n < range->n_groups; n++) {
+		len += snprintf(buf + len, size - len, "%0*d", range->width[n], seq[n]);
+		if (len >= size)
+			errx(1, "hostname too long: '%s'", buf);
+		len += str_cpy(buf + len, range->parts[n + 1], size - len);
+	}
+	return buf;
+}
+
+static bool
+range_match(const HostRange *range, int group, const char *s) {
+	int i;
+	int seq;
+	size_t len;
+
+	len = strlen(range->parts[group]);
+	if (strncmp(s, range->parts[group], len) != 0)
+		return false;
+	s += len;
+	if (group == range->n_groups)
+		return s[0] == '\0';
+
+	/* a literal part may begin with a digit, so try each length */
+	for (i = 0, seq = 0; i < MAX_DIGITS - 1 && s[i] >= '0' && s[i] <= '9'; i++) {
+		seq = seq * 10 + (s[i] - '0');
+		if (range->width[group] ? (i + 1 != range->width[group]) : (i > 0 && s[0] == '0'))
+			continue;
+		if (seq >= range->low[group] && seq <= range->high[group]
+		    && range_match(range, group + 1, s + i + 1))
+			return true;
+	}
+	return false;
+}
+
+bool
+range_contains(const HostRange *range, const char *hostname) {
+	return range_match(range, 0, hostname);
 }
 
 /*
@@ -481,8 +794,7 @@ expand_numeric_range(char **range, char *input) {
  */
 
 void
-env_split_lines(char *str) {
-	char *argv[8];
+env_split_lines(const Parser *pp, char *str) {
 	char *env_str, *p;
 	size_t len;
 	int count = 0;
@@ -504,14 +816,11 @@ env_split_lines(char *str) {
 	}
 
 	if (count % 2 == 1)
-		erry("no closing quote: %s", env_str);
+		erry(pp, "no closing quote: %s", env_str);
 	free(env_str);
 
-	if (len > 0) {
-		array_append(argv, 0, "renv", "-", "-q", NULL);
-		if (cmd_pipe_stdin(argv, str, len) != 0)
-			exit(1);
-	}
+	if (env_filter(str, len, NULL, NULL) != 0)
+		exit(1);
 }
 
 /*
@@ -519,20 +828,24 @@ env_split_lines(char *str) {
  */
 
 void
-env_file_check(const char *str) {
+env_file_check(const Parser *pp, const char *str) {
 	int i;
-	char cmd[PATH_MAX];
-	const char *s;
+	size_t len;
+	char *files[PLN_MAX_PATHS + 1];
+	const char *s, *digest;
 
 	/* prevent special shell characters */
 	for (s = str; *s; ++s) {
 		for (i = 0; i < sizeof(SHELL_SPECIAL_CHARS); i++) {
 			if (s[0] == SHELL_SPECIAL_CHARS[i])
-				erry("invalid filename %s", str);
+				erry(pp, "invalid filename %s", str);
 		}
 	}
 
-	snprintf(cmd, PATH_MAX, "renv %s -q", str);
-	if (system(cmd) != 0)
+	if (env_render(str, "", NULL, &len, &digest) == NULL)
 		exit(1);
+
+	str_to_array(files, str, PLN_MAX_PATHS, " ");
+	for (i = 0; files[i]; i++)
+		snapshot_add_dependency(files[i]);
 }
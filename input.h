@@ -5,6 +5,7 @@
 
 #include <limits.h>
 #include <stdbool.h>
+#include <stdio.h>
 
 /* data */
 
@@ -15,6 +16,7 @@
 #define PLN_OPTION_SIZE 90
 #define PLN_MAX_PATHS 32
 #define PLN_MAX_ALIASES 4
+#define PLN_MAX_RANGES 4
 
 #define SHELL_SPECIAL_CHARS "*?[#'`;&<>()|]\\$!^~"
 
@@ -22,6 +24,7 @@ typedef struct {
 	char execute_with[PLN_OPTION_SIZE];
 	char interpreter[PLN_OPTION_SIZE];
 	char local_interpreter[PLN_OPTION_SIZE];
+	char local_output[PLN_OPTION_SIZE];
 	char environment[PLN_OPTION_SIZE];
 	char environment_file[PLN_OPTION_SIZE];
 	/* not inherited */
@@ -29,6 +32,15 @@ typedef struct {
 	char *end;
 } Options;
 
+/* host names generated from a sequence expression such as db{1..4}.local */
+typedef struct {
+	int n_groups;
+	int low[PLN_MAX_RANGES];
+	int high[PLN_MAX_RANGES];
+	int width[PLN_MAX_RANGES];
+	char parts[PLN_MAX_RANGES + 1][PLN_LABEL_SIZE];
+} HostRange;
+
 typedef struct Label {
 	char name[PLN_LABEL_SIZE];
 	char *aliases[PLN_MAX_ALIASES];
@@ -36,26 +48,45 @@ typedef struct Label {
 	char *export_paths[PLN_MAX_PATHS];
 	char *content;
 	int content_size;
+	char *generator; /* local execution streamed before content */
 	Options options;
+	HostRange *range;
+	int name_id;
 	struct Label **labels;
 } Label;
 
 extern Label **route_labels;
 
+/* parser state for one pln file */
+typedef struct {
+	FILE *in;
+	const char *fn;
+	int n_labels;
+	Options options;
+	enum { HostLabel, RouteLabel } mode;
+} Parser;
+
 /* forwards */
 
-void erry(const char *fmt, ...);
-void parse_pln(Label **host_labels);
+void erry(const Parser *pp, const char *fmt, ...);
+void parse_pln(Parser *pp, Label **host_labels);
 void read_route_labels(const char *fn);
 void read_host_labels(Label *route_label);
+void read_all_host_labels(int max_jobs, int min_units);
+void read_host_file(Parser *pp, const Label *route_label, const char *fn, Label **labels);
 void expand_route_labels();
 Label **alloc_labels();
+int route_host_count(const Label *);
+const char *route_alias(const Label *, const char *);
 
 char *ltrim(char *, int);
-void read_label(char *, Label *);
-void read_option(char *, Options *);
-int expand_numeric_range(char **, char *);
-void env_split_lines(char *);
-void env_file_check(const char *);
+void read_label(Parser *, char *, Label *);
+void read_option(Parser *, char *, Options *);
+int parse_numeric_range(HostRange *, const char *);
+int range_count(const HostRange *);
+char *range_format(const HostRange *, int, char *, size_t);
+bool range_contains(const HostRange *, const char *);
+void env_split_lines(const Parser *, char *);
+void env_file_check(const Parser *, const char *);
 
 #endif /* _RSET_INPUT_H_ */
@@ -0,0 +1,574 @@
+/*
+ * labelgrep.c
+ * A pattern searcher for the pln(5) format used by rset(1)
+ * Displays the source file, label name, and contents that match
+ */
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <regex.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "missing/compat.h"
+
+#define HL_LABEL "\033[36m" /* cyan */
+#define HL_LN "\033[33m"    /* yellow */
+#define HL_MATCH "\033[4m"  /* underline */
+#define HL_RESET "\033[0m"
+
+#define MAX_JOBS 64
+#define MIN_FILES_PER_JOB 32
+#define INDEX_MAGIC "labelgrep index 2\n"
+#define INDEX_MIN_BITS 512
+#define INDEX_MAX_BITS (1 << 20)
+
+/*
+ * trigrams of a file, keyed by its real path and valid while its size and
+ * modification time are unchanged
+ */
+struct index_entry {
+	char *path;
+	int64_t mtime;
+	int64_t mtime_nsec;
+	int64_t size;
+	uint32_t nbits;
+	uint8_t *bits;
+	int seen;
+};
+
+/* globals */
+regex_t reg;
+char literal[256]; /* a string that every match contains, or empty */
+size_t literal_len;
+struct index_entry *index_entries;
+size_t n_index, n_sorted, index_size;
+int index_dirty;
+
+static void
+usage(void) {
+	fprintf(stderr, "release: %s\n", RELEASE);
+	fprintf(stderr, "usage: labelgrep [-j jobs] [-x index] pattern file [file ...]\n");
+	exit(1);
+}
+
+/*
+ * bracket_end - find the ] that closes a bracket expression, which may begin
+ * with ] and may contain [:class:], [=equivalence=] or [.collating.] elements
+ */
+static const char *
+bracket_end(const char *p) {
+	p += (p[1] == '^') ? 2 : 1;
+	if (*p == ']')
+		p++;
+	for (; *p && *p != ']'; p++) {
+		if (*p == '[' && (p[1] == ':' || p[1] == '=' || p[1] == '.')) {
+			char close[3] = { p[1], ']', '\0' };
+
+			if ((p = strstr(p + 2, close)) == NULL)
+				return NULL;
+			p++;
+		}
+	}
+	return *p ? p : NULL;
+}
+
+/*
+ * required_literal - find the longest run of ordinary characters that any
+ * match of an extended regular expression must contain
+ * Patterns with alternation or subexpressions are not analyzed
+ */
+static size_t
+required_literal(const char *pattern, char *out, size_t size) {
+	const char *p;
+	char run[sizeof(literal)];
+	size_t len = 0, best = 0;
+
+	if (strpbrk(pattern, "|("))
+		return 0;
+
+	for (p = pattern;; p++) {
+		/* an escaped punctuation character is an ordinary character */
+		if (*p == '\\' && p[1] && strchr(".[]^$*+?{}()|\\/", p[1]) && p[2] != '?'
+		    && p[2] != '*' && p[2] != '{') {
+			if (len < sizeof(run))
+				run[len++] = *++p;
+			continue;
+		}
+		switch (*p) {
+		case '?':
+		case '*':
+		case '{':
+			/* the preceding character is optional */
+			if (len > 0)
+				len--;
+			/* FALLTHROUGH */
+		case '\0':
+		case '.':
+		case '[':
+		case '^':
+		case '$':
+		case '+':
+		case '\\':
+			if (len > best && len < size) {
+				memcpy(out, run, len);
+				out[len] = '\0';
+				best = len;
+			}
+			len = 0;
+			if (*p == '\0')
+				return best;
+			if (*p == '{' && (p = strchr(p, '}')) == NULL)
+				return best;
+			if (*p == '[' && (p = bracket_end(p)) == NULL)
+				return best;
+			if (*p == '\\' && p[1])
+				p++;
+			break;
+		default:
+			if (len < sizeof(run))
+				run[len++] = *p;
+		}
+	}
+}
+
+/* index */
+
+static uint32_t
+trigram_bit(const unsigned char *s, uint32_t nbits) {
+	uint32_t h = ((uint32_t) s[0] << 16) | ((uint32_t) s[1] << 8) | s[2];
+
+	return (h * 2654435761u) & (nbits - 1);
+}
+
+/*
+ * index_bits - set a bit for each trigram in a buffer, using a bitmap large
+ * enough that few trigrams share a bit
+ */
+static void
+index_bits(struct index_entry *e, const char *buf, size_t len) {
+	size_t i;
+	uint32_t bit;
+
+	for (e->nbits = INDEX_MIN_BITS; e->nbits < len * 8 && e->nbits < INDEX_MAX_BITS;)
+		e->nbits *= 2;
+	free(e->bits);
+	if ((e->bits = calloc(e->nbits / 8, 1)) == NULL)
+		err(1, "calloc");
+	for (i = 0; i + 2 < len; i++) {
+		bit = trigram_bit((const unsigned char *) buf + i, e->nbits);
+		e->bits[bit / 8] |= 1 << (bit % 8);
+	}
+}
+
+/*
+ * index_may_match - false only if a trigram of the literal is not in the file
+ */
+static int
+index_may_match(const struct index_entry *e) {
+	size_t i;
+	uint32_t bit;
+
+	for (i = 0; i + 2 < literal_len; i++) {
+		bit = trigram_bit((const unsigned char *) literal + i, e->nbits);
+		if (!(e->bits[bit / 8] & (1 << (bit % 8))))
+			return 0;
+	}
+	return 1;
+}
+
+static int
+index_cmp(const void *a, const void *b) {
+	return strcmp(((const struct index_entry *) a)->path, ((const struct index_entry *) b)->path);
+}
+
+static struct index_entry *
+index_add(void) {
+	if (n_index == index_size) {
+		index_size = index_size ? index_size * 2 : 256;
+		if ((index_entries = reallocarray(index_entries, index_size, sizeof(*index_entries)))
+		    == NULL)
+			err(1, "reallocarray");
+	}
+	memset(&index_entries[n_index], 0, sizeof(*index_entries));
+	return &index_entries[n_index++];
+}
+
+/*
+ * index_load - read entries written by index_save; an index that cannot be
+ * read is rebuilt
+ */
+static void
+index_load(const char *path) {
+	FILE *fp;
+	char magic[sizeof(INDEX_MAGIC)];
+	uint32_t path_len;
+	struct index_entry *e;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		return;
+	if (fread(magic, 1, sizeof(magic) - 1, fp) != sizeof(magic) - 1
+	    || memcmp(magic, INDEX_MAGIC, sizeof(magic) - 1) != 0) {
+		fclose(fp);
+		return;
+	}
+	while (fread(&path_len, sizeof(path_len), 1, fp) == 1) {
+		e = index_add();
+		if (path_len >= PATH_MAX || (e->path = calloc(path_len + 1, 1)) == NULL
+		    || fread(e->path, 1, path_len, fp) != path_len
+		    || fread(&e->mtime, sizeof(e->mtime), 1, fp) != 1
+		    || fread(&e->mtime_nsec, sizeof(e->mtime_nsec), 1, fp) != 1
+		    || fread(&e->size, sizeof(e->size), 1, fp) != 1
+		    || fread(&e->nbits, sizeof(e->nbits), 1, fp) != 1 || e->nbits < INDEX_MIN_BITS
+		    || e->nbits > INDEX_MAX_BITS || (e->nbits & (e->nbits - 1))
+		    || (e->bits = malloc(e->nbits / 8)) == NULL
+		    || fread(e->bits, 1, e->nbits / 8, fp) != e->nbits / 8) {
+			free(e->path);
+			free(e->bits);
+			n_index--;
+			break;
+		}
+	}
+	fclose(fp);
+	qsort(index_entries, n_index, sizeof(*index_entries), index_cmp);
+	n_sorted = n_index;
+}
+
+/*
+ * index_save - write the entries of files that still exist to a temporary
+ * file that replaces the index
+ */
+static void
+index_save(const char *path) {
+	size_t i;
+	uint32_t path_len;
+	char tmp[PATH_MAX];
+	struct index_entry *e;
+	struct stat st;
+	FILE *fp;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.%d", path, (int) getpid()) >= (int) sizeof(tmp))
+		errx(1, "index path is too long");
+	if ((fp = fopen(tmp, "w")) == NULL) {
+		warn("%s", tmp);
+		return;
+	}
+	fwrite(INDEX_MAGIC, 1, sizeof(INDEX_MAGIC) - 1, fp);
+	qsort(index_entries, n_index, sizeof(*index_entries), index_cmp);
+	for (i = 0; i < n_index; i++) {
+		e = &index_entries[i];
+		/* a file named more than once is indexed more than once */
+		if (i > 0 && strcmp(e->path, index_entries[i - 1].path) == 0)
+			continue;
+		if (!e->seen && stat(e->path, &st) == -1)
+			continue;
+		path_len = strlen(e->path);
+		fwrite(&path_len, sizeof(path_len), 1, fp);
+		fwrite(e->path, 1, path_len, fp);
+		fwrite(&e->mtime, sizeof(e->mtime), 1, fp);
+		fwrite(&e->mtime_nsec, sizeof(e->mtime_nsec), 1, fp);
+		fwrite(&e->size, sizeof(e->size), 1, fp);
+		fwrite(&e->nbits, sizeof(e->nbits), 1, fp);
+		fwrite(e->bits, 1, e->nbits / 8, fp);
+	}
+	if (fclose(fp) == EOF || rename(tmp, path) == -1) {
+		warn("%s", path);
+		unlink(tmp);
+	}
+}
+
+/* search */
+
+/*
+ * read_file - read a file into a buffer terminated by a newline and a NUL
+ */
+static char *
+read_file(const char *path, size_t *len) {
+	int fd;
+	ssize_t nr;
+	size_t size = 8192;
+	char *buf, *p;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return NULL;
+	if ((buf = malloc(size)) == NULL)
+		err(1, "malloc");
+	*len = 0;
+	while (1) {
+		if (size - *len < 2) {
+			if ((p = realloc(buf, size * 2)) == NULL)
+				err(1, "realloc");
+			buf = p;
+			size *= 2;
+		}
+		if ((nr = read(fd, buf + *len, size - *len - 2)) == -1) {
+			if (errno == EINTR)
+				continue;
+			close(fd);
+			free(buf);
+			return NULL;
+		}
+		if (nr == 0)
+			break;
+		*len += nr;
+	}
+	close(fd);
+	if (*len == 0 || buf[*len - 1] != '\n')
+		buf[(*len)++] = '\n';
+	buf[*len] = '\0';
+	return buf;
+}
+
+static int
+is_option(const char *line) {
+	const char *p;
+
+	for (p = line; (*p >= 'a' && *p <= 'z') || *p == '_'; p++)
+		;
+	return p > line && *p == '=';
+}
+
+/*
+ * grep_file - print each line that matches under the name of its label
+ * Comments and options are skipped, and lines that do not begin with a tab
+ * and contain a colon are labels
+ */
+static int
+grep_file(const char *path) {
+	int ln = 0;
+	size_t len;
+	char *buf, *line, *end;
+	const char *label = "";
+	const char *prev_label = NULL;
+	regmatch_t m;
+
+	if ((buf = read_file(path, &len)) == NULL) {
+		warn("%s", path);
+		return 1;
+	}
+	if (literal_len && memmem(buf, len, literal, literal_len) == NULL) {
+		free(buf);
+		return 0;
+	}
+
+	for (line = buf; (end = memchr(line, '\n', buf + len - line)) != NULL; line = end + 1) {
+		*end = '\0';
+		ln++;
+		if (line[0] == '#' || is_option(line))
+			continue;
+		if (line[0] != '\t' && line[0] != '\0' && strchr(line + 1, ':')) {
+			*strchr(line, ':') = '\0';
+			label = line;
+			continue;
+		}
+		if (literal_len && strstr(line, literal) == NULL)
+			continue;
+		if (regexec(&reg, line, 1, &m, 0) != 0)
+			continue;
+		if (prev_label == NULL || strcmp(label, prev_label) != 0) {
+			printf("%s (" HL_LABEL "%s" HL_RESET ")\n", path, label);
+			prev_label = label;
+		}
+		printf(HL_LN "%d" HL_RESET "%.*s" HL_MATCH "%.*s" HL_RESET "%s\n", ln, (int) m.rm_so,
+		    line, (int) (m.rm_eo - m.rm_so), line + m.rm_so, line + m.rm_eo);
+	}
+	free(buf);
+	return 0;
+}
+
+static int
+grep_files(char **files, int n) {
+	int i, ret = 0;
+
+	for (i = 0; i < n; i++)
+		ret |= grep_file(files[i]);
+	return ret;
+}
+
+/*
+ * grep_parallel - search consecutive slices of the list in child processes
+ * and print their output in the order of the files
+ */
+static int
+grep_parallel(char **files, int n, int jobs) {
+	int i, n_open, status, ret = 0;
+	int fds[2];
+	ssize_t nr;
+	pid_t pids[MAX_JOBS];
+	struct pollfd pfd[MAX_JOBS];
+	struct {
+		char *data;
+		size_t len, size;
+	} out[MAX_JOBS];
+
+	fflush(stdout);
+	for (i = 0; i < jobs; i++) {
+		if (pipe(fds) == -1)
+			err(1, "pipe");
+		if ((pids[i] = fork()) == -1)
+			err(1, "fork");
+		if (pids[i] == 0) {
+			close(fds[0]);
+			if (dup2(fds[1], STDOUT_FILENO) == -1)
+				err(1, "dup2");
+			ret = grep_files(files + n * i / jobs, n * (i + 1) / jobs - n * i / jobs);
+			fflush(stdout);
+			_exit(ret);
+		}
+		close(fds[1]);
+		pfd[i].fd = fds[0];
+		pfd[i].events = POLLIN;
+		out[i].data = NULL;
+		out[i].len = out[i].size = 0;
+	}
+
+	for (n_open = jobs; n_open > 0;) {
+		if (poll(pfd, jobs, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		}
+		for (i = 0; i < jobs; i++) {
+			if (pfd[i].fd == -1 || !pfd[i].revents)
+				continue;
+			if (out[i].size - out[i].len < 65536) {
+				out[i].size = out[i].size * 2 + 65536;
+				if ((out[i].data = realloc(out[i].data, out[i].size)) == NULL)
+					err(1, "realloc");
+			}
+			nr = read(pfd[i].fd, out[i].data + out[i].len, out[i].size - out[i].len);
+			if (nr < 0 && errno == EINTR)
+				continue;
+			if (nr <= 0) {
+				close(pfd[i].fd);
+				pfd[i].fd = -1;
+				n_open--;
+				continue;
+			}
+			out[i].len += nr;
+		}
+	}
+
+	for (i = 0; i < jobs; i++) {
+		fwrite(out[i].data, 1, out[i].len, stdout);
+		free(out[i].data);
+		if (waitpid(pids[i], &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status))
+			ret = 1;
+	}
+	return ret;
+}
+
+/*
+ * filter_indexed - remove the files whose trigrams do not include those of
+ * the literal, updating the entries of files that changed
+ * Entries for new files are appended after the sorted entries that were loaded
+ */
+static int
+filter_indexed(char **files, int n) {
+	int i, kept = 0;
+	size_t len;
+	char *buf;
+	char path[PATH_MAX];
+	struct index_entry key, *e;
+	struct stat st;
+
+	for (i = 0; i < n; i++) {
+		/* a file named by different paths shares one entry */
+		if (stat(files[i], &st) == -1 || realpath(files[i], path) == NULL) {
+			/* reported when the file is searched */
+			files[kept++] = files[i];
+			continue;
+		}
+		key.path = path;
+		e = bsearch(&key, index_entries, n_sorted, sizeof(*index_entries), index_cmp);
+		if (e == NULL || e->mtime != (int64_t) st.st_mtim.tv_sec
+		    || e->mtime_nsec != (int64_t) st.st_mtim.tv_nsec
+		    || e->size != (int64_t) st.st_size) {
+			if ((buf = read_file(files[i], &len)) == NULL) {
+				files[kept++] = files[i];
+				continue;
+			}
+			if (e == NULL) {
+				e = index_add();
+				if ((e->path = strdup(path)) == NULL)
+					err(1, "strdup");
+			}
+			e->mtime = st.st_mtim.tv_sec;
+			e->mtime_nsec = st.st_mtim.tv_nsec;
+			e->size = st.st_size;
+			index_bits(e, buf, len);
+			free(buf);
+			index_dirty = 1;
+		}
+		e->seen = 1;
+		if (index_may_match(e))
+			files[kept++] = files[i];
+	}
+	return kept;
+}
+
+int
+main(int argc, char *argv[]) {
+	int ch, n, jobs, ret;
+	char *index_path = NULL;
+	const char *errstr;
+
+	if ((jobs = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		jobs = 1;
+	if (jobs > MAX_JOBS)
+		jobs = MAX_JOBS;
+	while ((ch = getopt(argc, argv, "j:x:")) != -1) {
+		switch (ch) {
+		case 'j':
+			jobs = strtonum(optarg, 1, MAX_JOBS, &errstr);
+			if (errstr)
+				errx(1, "jobs is %s", errstr);
+			break;
+		case 'x':
+			index_path = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc < 2)
+		usage();
+
+	if (pledge(index_path ? "stdio rpath wpath cpath proc" : "stdio rpath proc", NULL) == -1)
+		err(1, "pledge");
+
+	if ((ret = regcomp(&reg, argv[0], REG_EXTENDED)) != 0) {
+		char msg[256];
+
+		regerror(ret, &reg, msg, sizeof(msg));
+		errx(1, "%s: %s", argv[0], msg);
+	}
+	literal_len = required_literal(argv[0], literal, sizeof(literal));
+
+	n = argc - 1;
+	if (index_path && literal_len >= 3) {
+		index_load(index_path);
+		n = filter_indexed(argv + 1, n);
+		if (index_dirty)
+			index_save(index_path);
+	}
+
+	if (jobs > n / MIN_FILES_PER_JOB)
+		jobs = n / MIN_FILES_PER_JOB;
+	if (jobs > 1)
+		ret = grep_parallel(argv + 1, n, jobs);
+	else
+		ret = grep_files(argv + 1, n);
+	return ret;
+}
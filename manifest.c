@@ -0,0 +1,93 @@
+/*
+ * manifest.c
+ * List the size, mtime and digest of each file below a directory
+ */
+
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "digest.h"
+#include "manifest.h"
+#include "sha256.h"
+
+/*
+ * manifest_dir - add the files of a directory in lexical order
+ * Digests are taken from the index of the server, so only new or modified
+ * files are read; those digests are sent back to the server
+ */
+static int
+manifest_dir(FILE *fp, const char *path, const char *prefix, int depth) {
+	int i, n, ret = 0;
+	char sub_path[PATH_MAX], name[PATH_MAX];
+	char buf[SHA256_DIGEST_STRING_LENGTH];
+	const char *digest;
+	struct dirent **ents;
+	struct stat st;
+
+	if (depth > MANIFEST_MAX_DEPTH || (n = scandir(path, &ents, NULL, alphasort)) < 0)
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		/* hidden files are not served; tabs and newlines would break the format */
+		if (ret || ents[i]->d_name[0] == '.' || strpbrk(ents[i]->d_name, "\t\n"))
+			goto next;
+		if (snprintf(sub_path, sizeof(sub_path), "%s%s%s", strcmp(path, ".") ? path : "",
+		        strcmp(path, ".") ? "/" : "", ents[i]->d_name)
+		        >= (int) sizeof(sub_path)
+		    || snprintf(name, sizeof(name), "%s%s", prefix, ents[i]->d_name)
+		           >= (int) sizeof(name) - 1)
+			goto next;
+		if (stat(sub_path, &st) < 0)
+			goto next;
+
+		if (S_ISDIR(st.st_mode)) {
+			strcat(name, "/");
+			ret = manifest_dir(fp, sub_path, name, depth + 1);
+		} else if (S_ISREG(st.st_mode)) {
+			if ((digest = digest_lookup(&st)) == NULL) {
+				if (digest_file(sub_path, &st, buf) < 0)
+					goto next;
+				digest_send(&st, buf);
+				digest = buf;
+			}
+			if (fp && fprintf(fp, "%s\t%lld\t%lld\t%s\n", digest, (long long) st.st_size,
+			              (long long) st.st_mtime, name) < 0)
+				ret = -1;
+		}
+	next:
+		free(ents[i]);
+	}
+	free(ents);
+	return ret;
+}
+
+/*
+ * manifest_write - write "digest<TAB>size<TAB>mtime<TAB>path" for each regular
+ * file below a directory to fd, or if fd is -1 only compute the digests that
+ * are not known
+ * Runs in a child started by digest_child() or digest_child_init()
+ * Returns -1 on error
+ */
+int
+manifest_write(int fd, const char *dir) {
+	int ret;
+	size_t len;
+	char path[PATH_MAX];
+	FILE *fp = NULL;
+
+	snprintf(path, sizeof(path), "%s", dir);
+	if ((len = strlen(path)) > 1 && path[len - 1] == '/')
+		path[len - 1] = '\0';
+
+	if (fd != -1 && (fp = fdopen(fd, "w")) == NULL)
+		return -1;
+	ret = manifest_dir(fp, path, "", 0);
+	if (fp && fclose(fp) != 0)
+		ret = -1;
+	return ret;
+}
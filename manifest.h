@@ -0,0 +1,8 @@
+/*
+ * manifest.h
+ * List the size, mtime and digest of each file below a directory
+ */
+
+#define MANIFEST_MAX_DEPTH 32
+
+int manifest_write(int, const char *);
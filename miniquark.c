@@ -4,24 +4,80 @@
  */
 
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 
 #include <netinet/in.h>
 
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <poll.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "cache.h"
+#include "digest.h"
 #include "http.h"
+#include "manifest.h"
 #include "sock.h"
+#include "stats.h"
+
+#define MAX_CONNECTIONS 512
+#define CONNECTION_TIMEOUT 30
+#define KEEPALIVE_TIMEOUT 5
+#define MAX_REQUESTS 100
+#define RATE_INTERVAL 10 /* milliseconds between checks of an exhausted bandwidth limit */
+#define LOG_BUF_SIZE 65536
+#define LOG_LINE_MAX 16384
+
+/* waiting for another request after at least one has been answered */
+#define IDLE(c) ((c)->state == C_READ && (c)->hlen == 0 && (c)->n_requests > 0)
+
+/* state of a client connection */
+struct connection {
+	int fd;
+	enum { C_READ, C_WRITE, C_DONE } state;
+	time_t deadline;
+	char h[HEADER_MAX];
+	size_t hlen;
+	size_t reqlen;
+	int n_requests;
+	struct timespec t_request; /* request received */
+	long ttfb;                 /* microseconds to the first byte sent */
+	struct request req;
+	struct response res;
+	enum status status;
+	struct sockaddr_storage sa;
+};
 
 /* forwards */
-static void serve(int, struct sockaddr_storage *);
+static void serve(struct pollfd *, int, int);
+static void conn_accept(int);
+static void conn_read(struct connection *);
+static void conn_request(struct connection *);
+static void conn_write(struct connection *);
+static void conn_log(struct connection *);
+static void line_printf(char *, size_t *, const char *, ...);
+static void line_json_str(char *, size_t *, const char *);
+static void log_line(const char *, size_t);
+static void log_flush(void);
+static void conn_close(int);
+static int conn_cmp_sent(const void *, const void *);
+static long long rate_refill(void);
+static long long parse_rate(const char *);
+static long elapsed(const struct timespec *);
+static void cache_report(void);
+static void stats_report(void);
+static void sigreport(int);
+static void sigquit(int);
 static void sigcleanup(int);
 static void handlesignals(void (*hdl)(int));
 static void usage(bool);
@@ -30,39 +86,508 @@ static void usage(bool);
 struct server {
 	char *listen_addr;
 	char *port;
+	char *unix_path; /* listen on a Unix domain socket instead of a port */
+	long long rate; /* bytes per second sent to all clients, or 0 */
+	bool json;      /* log requests as JSON lines */
 } s;
 
+struct connection *conns[MAX_CONNECTIONS];
+int n_conns;
+long long tokens; /* bytes that may be sent within the bandwidth limit */
+struct timespec refilled;
+char log_buf[LOG_BUF_SIZE]; /* lines not yet written to stdout */
+size_t log_len;
+volatile sig_atomic_t report_requested;
+volatile sig_atomic_t quit_requested;
+
+/*
+ * serve - handle all connections in one process, and receive the digests
+ * computed by child processes on digest_fd
+ */
 static void
-serve(int infd, struct sockaddr_storage *in_sa) {
-	struct request r;
-	enum status status;
+serve(struct pollfd *listen_pfd, int addr_count, int digest_fd) {
+	int i, n, throttled;
+	int timeout;
+	time_t now, next;
+	struct pollfd pfd[LISTEN_MAX + MAX_CONNECTIONS + 2];
+	struct connection *ready[MAX_CONNECTIONS];
+
+	clock_gettime(CLOCK_MONOTONIC, &refilled);
+
+	while (1) {
+		if (report_requested) {
+			report_requested = 0;
+			cache_report();
+		}
+		if (quit_requested) {
+			stats_report();
+			return;
+		}
+
+		/* stop accepting when the limit on connections is reached */
+		for (n = 0; n < addr_count; n++) {
+			pfd[n].fd = (n_conns < MAX_CONNECTIONS) ? listen_pfd[n].fd : -1;
+			pfd[n].events = POLLIN;
+		}
+
+		/* responses wait while the bandwidth limit is exhausted */
+		throttled = s.rate && rate_refill() <= 0;
+
+		now = time(NULL);
+		next = 0;
+		for (i = 0; i < n_conns; i++) {
+			pfd[addr_count + i].fd = conns[i]->fd;
+			pfd[addr_count + i].events = (conns[i]->state == C_READ) ? POLLIN : POLLOUT;
+
+			/* a streamed body waits for the process producing it */
+			if (conns[i]->state == C_WRITE && conns[i]->res.wait_input) {
+				pfd[addr_count + i].fd = conns[i]->res.fd;
+				pfd[addr_count + i].events = POLLIN;
+			}
+			if (conns[i]->state == C_WRITE && throttled) {
+				pfd[addr_count + i].fd = -1;
+				conns[i]->deadline = now + CONNECTION_TIMEOUT;
+			}
+			if (next == 0 || conns[i]->deadline < next)
+				next = conns[i]->deadline;
+		}
+		timeout = next ? ((next > now) ? (next - now) * 1000 : 0) : -1;
+
+		pfd[addr_count + n_conns].fd = digest_fd;
+		pfd[addr_count + n_conns].events = POLLIN;
+		pfd[addr_count + n_conns + 1].fd = log_len ? STDOUT_FILENO : -1;
+		pfd[addr_count + n_conns + 1].events = POLLOUT;
+
+		/* a signal that arrives before poll() is noticed within a second */
+		if (timeout < 0 || timeout > 1000)
+			timeout = 1000;
+		if (throttled)
+			timeout = MIN(timeout, RATE_INTERVAL);
+
+		if (poll(pfd, addr_count + n_conns + 2, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		}
+		if (pfd[addr_count + n_conns].revents & POLLIN)
+			digest_read();
+		if (pfd[addr_count + n_conns + 1].revents & (POLLOUT | POLLERR | POLLHUP))
+			log_flush();
+
+		now = time(NULL);
+		n = 0;
+		for (i = 0; i < n_conns; i++) {
+			if (pfd[addr_count + i].revents & (POLLIN | POLLOUT | POLLHUP | POLLERR)) {
+				conns[i]->deadline = now + CONNECTION_TIMEOUT;
+				if (conns[i]->state == C_READ)
+					conn_read(conns[i]);
+				if (conns[i]->state == C_WRITE)
+					ready[n++] = conns[i];
+			} else if (conns[i]->deadline <= now) {
+				/* idle persistent connections expire quietly */
+				if (!IDLE(conns[i])) {
+					conns[i]->status = S_REQUEST_TIMEOUT;
+					conn_log(conns[i]);
+				}
+				conns[i]->state = C_DONE;
+			}
+		}
+
+		/*
+		 * Within a bandwidth limit the responses that have sent the least
+		 * go first, so that small files are not held up by large ones
+		 */
+		if (s.rate)
+			qsort(ready, n, sizeof(*ready), conn_cmp_sent);
+		for (i = 0; i < n; i++)
+			conn_write(ready[i]);
+
+		/* later connections are swapped into the place of closed ones */
+		for (i = n_conns - 1; i >= 0; i--) {
+			if (conns[i]->state == C_DONE)
+				conn_close(i);
+		}
+
+		for (n = 0; n < addr_count; n++) {
+			if (pfd[n].revents & (POLLERR | POLLNVAL))
+				errx(1, "bad fd %d", pfd[n].fd);
+			if (pfd[n].revents & (POLLIN | POLLHUP))
+				conn_accept(pfd[n].fd);
+		}
+	}
+}
+
+static void
+conn_accept(int listen_fd) {
+	int infd;
+	socklen_t in_sa_len;
+	struct connection *c;
+
+	while (n_conns < MAX_CONNECTIONS) {
+		if ((c = calloc(1, sizeof(struct connection))) == NULL)
+			err(1, "calloc");
+		in_sa_len = sizeof(c->sa);
+		if ((infd = accept(listen_fd, (struct sockaddr *) &c->sa, &in_sa_len)) < 0) {
+			free(c);
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED
+			    || errno == EINTR)
+				return;
+			err(1, "accept");
+		}
+		if (sock_set_nonblocking(infd)) {
+			close(infd);
+			free(c);
+			continue;
+		}
+		sock_set_nodelay(infd);
+		c->fd = infd;
+		c->state = C_READ;
+		c->ttfb = -1;
+		c->deadline = time(NULL) + CONNECTION_TIMEOUT;
+		http_response_init(&c->res);
+		conns[n_conns++] = c;
+		stats_connection(1);
+	}
+}
+
+/*
+ * conn_read - receive a request header
+ */
+static void
+conn_read(struct connection *c) {
+	ssize_t off;
+
+	off = read(c->fd, c->h + c->hlen, sizeof(c->h) - c->hlen);
+	if (off < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		if (IDLE(c)) {
+			c->state = C_DONE;
+			return;
+		}
+		c->status = http_send_status(&c->res, S_REQUEST_TIMEOUT);
+		c->state = C_WRITE;
+		return;
+	}
+	if (off == 0 && IDLE(c)) {
+		c->state = C_DONE;
+		return;
+	}
+	c->hlen += off;
+	if (off > 0 && !http_header_length(c->h, c->hlen) && c->hlen < sizeof(c->h))
+		return;
+
+	conn_request(c);
+}
+
+/*
+ * conn_request - parse the first request in the buffer and prepare the response
+ */
+static void
+conn_request(struct connection *c) {
+	if ((c->reqlen = http_header_length(c->h, c->hlen)) == 0)
+		c->reqlen = c->hlen;
+
+	c->n_requests++;
+	clock_gettime(CLOCK_MONOTONIC, &c->t_request);
+	c->ttfb = -1;
+	if (!(c->status = http_get_request(c->h, c->reqlen, &c->req, &c->res))) {
+		if (c->n_requests >= MAX_REQUESTS)
+			c->res.keep_alive = 0;
+		/* statistics are only available to clients on this host */
+		if (strcmp(c->req.target, STATS_PATH))
+			c->status = http_send_response(&c->req, &c->res);
+		else if (sock_is_loopback(&c->sa))
+			c->status = http_send_stats(&c->req, &c->res);
+		else
+			c->status = http_send_status(&c->res, S_FORBIDDEN);
+	}
+	c->state = C_WRITE;
+}
+
+/*
+ * conn_write - send the response and wait for the next request if the
+ * connection is persistent
+ */
+static void
+conn_write(struct connection *c) {
+	int ret;
+	unsigned long sent = c->req.bytes_sent;
+
+	ret = http_send(c->fd, &c->req, &c->res, s.rate ? MIN(tokens, SEND_QUANTUM) : SEND_QUANTUM);
+	tokens -= c->req.bytes_sent - sent;
+	if (c->ttfb < 0 && c->res.head_sent > 0)
+		c->ttfb = elapsed(&c->t_request);
+	switch (ret) {
+	case 1:
+		return;
+	case -1:
+		c->status = S_REQUEST_TIMEOUT;
+		c->res.keep_alive = 0;
+		break;
+	}
+	conn_log(c);
+	if (!c->res.keep_alive) {
+		c->state = C_DONE;
+		return;
+	}
+
+	/* retain pipelined requests */
+	c->hlen -= c->reqlen;
+	memmove(c->h, c->h + c->reqlen, c->hlen);
+	http_response_free(&c->res);
+	http_response_init(&c->res);
+	c->t_request.tv_sec = c->t_request.tv_nsec = 0;
+	c->state = C_READ;
+	c->deadline = time(NULL) + (c->hlen ? CONNECTION_TIMEOUT : KEEPALIVE_TIMEOUT);
+	if (http_header_length(c->h, c->hlen))
+		conn_request(c);
+}
+
+/*
+ * conn_log - record the result of a request
+ */
+static void
+conn_log(struct connection *c) {
+	long duration = elapsed(&c->t_request);
+	size_t len = 0;
+	char line[LOG_LINE_MAX];
 	char inaddr[INET6_ADDRSTRLEN /* > INET_ADDRSTRLEN */];
 
-	/* set connection timeout */
-	if (sock_set_timeout(infd, 30)) {
-		goto cleanup;
+	stats_request(c->status, c->req.bytes_sent, c->ttfb, duration);
+	if (inaddr_to_str(&c->sa, inaddr, LEN(inaddr)))
+		return;
+
+	if (s.json) {
+		line_printf(line, &len, "{\"time\":%lld,\"session\":", (long long) time(NULL));
+		line_json_str(line, &len, c->req.field[REQ_SESSION]);
+		line_printf(line, &len,
+		    ",\"address\":\"%s\",\"status\":%d,\"bytes\":%lu,\"ttfb_us\":%ld,"
+		    "\"duration_us\":%ld,\"agent\":",
+		    inaddr, c->status, c->req.bytes_sent, c->ttfb, duration);
+		line_json_str(line, &len, c->req.field[REQ_AGENT]);
+		line_printf(line, &len, ",\"target\":");
+		line_json_str(line, &len, c->req.target);
+		line_printf(line, &len, ",\"query\":");
+		line_json_str(line, &len, c->req.query);
+		line_printf(line, &len, "}\n");
+	} else {
+		line_printf(line, &len, "%lu\t%s\t%d\t%s\t%s\n", c->req.bytes_sent, inaddr,
+		    c->status, c->req.field[REQ_AGENT], c->req.target);
 	}
+	log_line(line, len);
+}
 
-	/* handle request */
-	if (!(status = http_get_request(infd, &r))) {
-		status = http_send_response(infd, &r);
+/*
+ * line_printf - append to a log line of LOG_LINE_MAX bytes; a line that
+ * does not fit is marked by a length of LOG_LINE_MAX
+ */
+static void
+line_printf(char *line, size_t *len, const char *fmt, ...) {
+	int n;
+	va_list ap;
+
+	if (*len >= LOG_LINE_MAX)
+		return;
+	va_start(ap, fmt);
+	n = vsnprintf(line + *len, LOG_LINE_MAX - *len, fmt, ap);
+	va_end(ap);
+	*len = (n < 0 || (size_t) n >= LOG_LINE_MAX - *len) ? LOG_LINE_MAX : *len + n;
+}
+
+/*
+ * line_json_str - append a quoted JSON string to a log line
+ */
+static void
+line_json_str(char *line, size_t *len, const char *str) {
+	line_printf(line, len, "\"");
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			line_printf(line, len, "\\%c", *str);
+		else if ((unsigned char) *str < 0x20 || *str == 0x7f)
+			line_printf(line, len, "\\u%04x", (unsigned char) *str);
+		else
+			line_printf(line, len, "%c", *str);
 	}
+	line_printf(line, len, "\"");
+}
 
-	if (inaddr_to_str(in_sa, inaddr, LEN(inaddr))) {
-		goto cleanup;
+/*
+ * log_line - queue a line for stdout, which is written without blocking so
+ * that a reader that falls behind does not hold up requests; a line that
+ * does not fit in the buffer is dropped and counted
+ */
+static void
+log_line(const char *line, size_t len) {
+	if (len >= LOG_LINE_MAX || log_len + len > sizeof(log_buf)) {
+		stats_log_dropped();
+		return;
 	}
-	printf("%lu\t%s\t%d\t%s\t%s\n", r.bytes_sent, inaddr, status, r.field[REQ_AGENT], r.target);
+	memcpy(log_buf + log_len, line, len);
+	log_len += len;
+	log_flush();
+}
 
-cleanup:
-	/* clean up and finish */
-	shutdown(infd, SHUT_RD);
-	shutdown(infd, SHUT_WR);
-	close(infd);
+/*
+ * log_flush - write as much of the log buffer as stdout accepts
+ */
+static void
+log_flush(void) {
+	ssize_t nw;
+
+	while (log_len > 0) {
+		if ((nw = write(STDOUT_FILENO, log_buf, log_len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			/* output that fails for another reason is discarded */
+			if (errno != EAGAIN)
+				log_len = 0;
+			return;
+		}
+		memmove(log_buf, log_buf + nw, log_len - nw);
+		log_len -= nw;
+	}
+}
+
+/*
+ * conn_close - release the connection
+ */
+static void
+conn_close(int i) {
+	struct connection *c = conns[i];
+
+	shutdown(c->fd, SHUT_RD);
+	shutdown(c->fd, SHUT_WR);
+	close(c->fd);
+	http_response_free(&c->res);
+	free(c);
+	conns[i] = conns[--n_conns];
+	stats_connection(-1);
+}
+
+static int
+conn_cmp_sent(const void *a, const void *b) {
+	const struct connection *ca = *(struct connection *const *) a;
+	const struct connection *cb = *(struct connection *const *) b;
+
+	return (ca->req.bytes_sent > cb->req.bytes_sent) - (ca->req.bytes_sent < cb->req.bytes_sent);
+}
+
+/*
+ * rate_refill - add the bytes allowed by the bandwidth limit since the last
+ * call, up to a quarter of a second's worth
+ * Returns the number of bytes that may be sent
+ */
+static long long
+rate_refill(void) {
+	long long us;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = (now.tv_sec - refilled.tv_sec) * 1000000LL + (now.tv_nsec - refilled.tv_nsec) / 1000;
+	us = MIN(us, 1000000);
+	if (s.rate * us / 1000000 > 0) {
+		tokens = MIN(tokens + s.rate * us / 1000000, s.rate / 4 + 1);
+		refilled = now;
+	}
+	return tokens;
+}
+
+/*
+ * parse_rate - convert a number of bytes per second with an optional K, M or
+ * G suffix
+ * Returns 0 if the rate is not valid
+ */
+static long long
+parse_rate(const char *str) {
+	long long rate;
+	char *end;
+
+	errno = 0;
+	rate = strtoll(str, &end, 10);
+	if (errno || end == str || rate <= 0)
+		return 0;
+	switch (*end) {
+	case 'G':
+		rate *= 1024;
+		/* FALLTHROUGH */
+	case 'M':
+		rate *= 1024;
+		/* FALLTHROUGH */
+	case 'K':
+		rate *= 1024;
+		end++;
+		break;
+	}
+	return (*end == '\0' && rate < LLONG_MAX / 1000000) ? rate : 0;
+}
+
+/*
+ * elapsed - microseconds since a request was received, or -1 if none was
+ */
+static long
+elapsed(const struct timespec *since) {
+	struct timespec now;
+
+	if (since->tv_sec == 0 && since->tv_nsec == 0)
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1000000 + (now.tv_nsec - since->tv_nsec) / 1000;
+}
+
+/*
+ * cache_report - print cache hit rate and size
+ */
+static void
+cache_report(void) {
+	int len;
+	char line[256];
+	const struct cache_stats *cs = cache_stats();
+	unsigned long lookups = cs->hits + cs->misses;
+
+	len = snprintf(line, sizeof(line),
+	    "cache: %lu hits, %lu misses, %lu%% hit rate, %lu entries, %zu bytes, "
+	    "%lu evictions\n",
+	    cs->hits, cs->misses, lookups ? cs->hits * 100 / lookups : 0, cs->entries, cs->size,
+	    cs->evictions);
+	if (len > 0 && (size_t) len < sizeof(line))
+		log_line(line, len);
+}
+
+/*
+ * stats_report - print the counters and histograms of the server once it
+ * stops serving, waiting for the log to be read
+ */
+static void
+stats_report(void) {
+	size_t len;
+	char *buf;
+
+	fcntl(STDOUT_FILENO, F_SETFL, fcntl(STDOUT_FILENO, F_GETFL) & ~O_NONBLOCK);
+	log_flush();
+	if ((buf = stats_format("stats: ", &len)) == NULL)
+		return;
+	fwrite(buf, 1, len, stdout);
+	fflush(stdout);
+	free(buf);
+}
+
+static void
+sigreport(int sig) {
+	report_requested = 1;
+}
+
+static void
+sigquit(int sig) {
+	quit_requested = 1;
 }
 
 static void
 sigcleanup(int sig) {
 	kill(0, sig);
+	/* the server removes its socket before exiting */
+	while (wait(NULL) > 0)
+		;
 	_exit(1);
 }
 
@@ -82,7 +607,8 @@ handlesignals(void (*hdl)(int)) {
 static void
 usage(bool summary) {
 	fprintf(stderr, "release: %s\n", RELEASE);
-	fprintf(stderr, "usage: miniquark [-d dir] [-l address] port\n");
+	fprintf(stderr, "usage: miniquark [-j] [-d dir] [-l address] [-r rate] port\n"
+	                "       miniquark [-j] [-d dir] [-r rate] -u socket\n");
 	if (!summary) {
 		fprintf(stderr, "hint: use -h to display option summary\n");
 		goto end;
@@ -90,7 +616,10 @@ usage(bool summary) {
 
 	printf("summary:\n"
 	       "    -d dir      Switch to the specified directory\n"
-	       "    -l address  Hostname or IP address listen on\n");
+	       "    -j          Log each request as a line of JSON\n"
+	       "    -l address  Hostname or IP address listen on\n"
+	       "    -r rate     Limit bandwidth to bytes per second, e.g. 10M\n"
+	       "    -u socket   Absolute path of a Unix domain socket to listen on\n");
 	printf("docs:\n"
 	       "    man miniquark\n");
 
@@ -101,38 +630,56 @@ end:
 int
 main(int argc, char *argv[]) {
 	int ch;
-	struct sockaddr_storage in_sa;
-	socklen_t in_sa_len;
-	int status = 0, infd;
-	int addr_count, nready, n;
+	int status = 0;
+	int addr_count, n;
+	int digest_fd;
+	struct stat st;
 	char inaddr[INET6_ADDRSTRLEN];
 	struct pollfd pfd[LISTEN_MAX];
 	struct sockaddr_storage resolved[LISTEN_MAX];
+	struct sigaction sa_report = {
+		.sa_handler = sigreport,
+	};
 
 	/* defaults */
 	char *servedir = ".";
 
 	s.listen_addr = "localhost";
 	s.port = NULL;
+	s.unix_path = NULL;
+	s.rate = 0;
+	s.json = false;
 
 	if (argv[1] && strcmp(argv[1], "-h") == 0)
 		usage(true);
 
 	opterr = 0;
-	while ((ch = getopt(argc, argv, "d:l:")) != -1) {
+	while ((ch = getopt(argc, argv, "d:jl:r:u:")) != -1) {
 		switch (ch) {
 		case 'd':
 			servedir = optarg;
 			break;
+		case 'j':
+			s.json = true;
+			break;
 		case 'l':
 			s.listen_addr = optarg;
 			break;
+		case 'r':
+			if ((s.rate = parse_rate(optarg)) == 0)
+				errx(1, "invalid rate '%s'", optarg);
+			break;
+		case 'u':
+			if (optarg[0] != '/')
+				errx(1, "socket path must be absolute: %s", optarg);
+			s.unix_path = optarg;
+			break;
 		default:
 			usage(false);
 		}
 	}
 
-	if (argc != optind + 1)
+	if (argc != optind + (s.unix_path ? 0 : 1))
 		usage(false);
 
 	s.port = argv[optind];
@@ -142,65 +689,57 @@ main(int argc, char *argv[]) {
 
 	handlesignals(sigcleanup);
 
+	/* only the server process prints statistics */
+	signal(SIGUSR1, SIG_IGN);
+
 	switch (fork()) {
 	case -1:
 		warn("fork");
 		break;
 	case 0:
-		/* restore default handlers */
-		handlesignals(SIG_DFL);
+		/* statistics are printed before the server exits */
+		handlesignals(sigquit);
 
-		/* reap children automatically */
-		if (signal(SIGCHLD, SIG_IGN) == SIG_ERR) {
-			err(1, "Failed to set SIG_IGN on SIGCHLD");
+		/* a client closing a connection must not terminate the server */
+		if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+			err(1, "Failed to set SIG_IGN on SIGPIPE");
 		}
+		sigemptyset(&sa_report.sa_mask);
+		sigaction(SIGUSR1, &sa_report, NULL);
 
 		if (chdir(servedir) < 0)
 			err(1, "chdir '%s'", servedir);
 
-		addr_count = addr_listen(s.listen_addr, s.port, pfd, resolved);
-		printf("Listening on");
-		for (n = 0; n < addr_count; n++) {
-			inaddr_to_str(&resolved[n], inaddr, sizeof(inaddr));
-			printf(" %s", inaddr);
+		stats_init();
+		if ((digest_fd = digest_init()) == -1)
+			err(1, "pipe");
+
+		if (s.unix_path) {
+			addr_count = unix_listen(s.unix_path, pfd);
+			printf("Listening on %s\n", s.unix_path);
+		} else {
+			addr_count = addr_listen(s.listen_addr, s.port, pfd, resolved);
+			printf("Listening on");
+			for (n = 0; n < addr_count; n++) {
+				inaddr_to_str(&resolved[n], inaddr, sizeof(inaddr));
+				printf(" %s", inaddr);
+			}
+			printf(" port %s\n", s.port);
 		}
-		printf(" port %s\n", s.port);
 		fflush(stdout);
 
-		/* accept incoming connections */
-		while (1) {
-			infd = 0;
-			nready = poll(pfd, addr_count, -1);
-			if (nready < 1)
-				err(1, "poll");
+		/* a reader of the access log that falls behind must not stop the server */
+		if (fstat(STDOUT_FILENO, &st) == 0 && (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode)))
+			fcntl(STDOUT_FILENO, F_SETFL, fcntl(STDOUT_FILENO, F_GETFL) | O_NONBLOCK);
 
-			for (n = 0; n < addr_count; n++) {
-				if (pfd[n].revents & (POLLERR | POLLNVAL))
-					errx(1, "bad fd %d", pfd[n].fd);
-				if (pfd[n].revents & (POLLIN | POLLHUP)) {
-					in_sa_len = sizeof(in_sa);
-					infd = accept(pfd[n].fd, (struct sockaddr *) &in_sa, &in_sa_len);
-					if (infd < 0)
-						err(1, "accept");
-				}
-			}
-			if (!infd)
-				continue;
+		/* index the digests of all files; manifests then only read changed files */
+		if (digest_child(-1) == 0)
+			_exit(manifest_write(-1, ".") ? 1 : 0);
 
-			/* fork and handle */
-			switch (fork()) {
-			case 0:
-				serve(infd, &in_sa);
-				exit(0);
-				break;
-			case -1:
-				warn("fork");
-				/* fallthrough */
-			default:
-				/* close the connection in the parent */
-				close(infd);
-			}
-		}
+		/* accept and handle incoming connections */
+		serve(pfd, addr_count, digest_fd);
+		if (s.unix_path)
+			unlink(s.unix_path);
 		exit(0);
 	default:
 		while (wait(&status) > 0)
@@ -0,0 +1,34 @@
+/*
+ * closefrom.c
+ * Close every descriptor from lowfd, reading the list of open descriptors
+ * where the system provides one
+ */
+
+#include <dirent.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+void
+closefrom(int lowfd) {
+	int fd;
+	long max;
+	char *end;
+	DIR *dirp;
+	struct dirent *dp;
+
+	if ((dirp = opendir("/proc/self/fd")) != NULL || (dirp = opendir("/dev/fd")) != NULL) {
+		while ((dp = readdir(dirp)) != NULL) {
+			fd = strtol(dp->d_name, &end, 10);
+			if (*end == '\0' && end != dp->d_name && fd >= lowfd && fd != dirfd(dirp))
+				close(fd);
+		}
+		closedir(dirp);
+		return;
+	}
+
+	if ((max = sysconf(_SC_OPEN_MAX)) < 0 || max > INT_MAX)
+		max = INT_MAX;
+	for (fd = lowfd; fd < max; fd++)
+		close(fd);
+}
@@ -6,6 +6,7 @@ long long strtonum(const char *numstr, long long minval, long long maxval, const
 #endif
 
 #if defined(_MACOS_PORT) || defined(_LINUX_PORT)
+void closefrom(int lowfd);
 void setproctitle(const char *fmt, ...);
 #endif
 
@@ -8,9 +8,15 @@ set_defaults() {
 	fetched=0       # set to 1 when source was fetched via HTTP
 	samedir=0       # set to 1 when target is $SD (Staging Directory)
 	source_local=0  # set to 1 if source is defined with an absolute path
+	recursive=0     # set to 1 if source is a directory
+	list=""         # file listing sources and targets, or - for stdin
+	prefetched=""   # sources fetched ahead of installing a list
+	same=0          # set to 1 if the target is known to match the source
 	owner=""
 	mode=""
 	alt_location=""
+	src_digest=""   # digest and size of the source listed by the server
+	src_size=""
 	: ${INSTALL_URL:=http://localhost:6000}
 	: ${RINSTALL_DIFF_ARGS:="-U 2"}
 }
@@ -19,7 +25,20 @@ main() {
 	set_defaults
 	parse_args "$@"
 	init
-	set_source_target_vars "$arg_src" "$arg_dst"
+	if [ -n "$list" ]; then
+		install_list
+		exit $ret
+	fi
+	if [ $recursive -eq 1 ]; then
+		install_tree
+		exit $ret
+	fi
+	install_file "$arg_src" "$arg_dst"
+	exit $ret
+}
+
+install_file() {
+	set_source_target_vars "$1" "$2"
 
 	# If source does not exist then it was not found on a local file system
 	# (with an absolute path) or in the current directory (normally $SD)
@@ -41,13 +60,118 @@ main() {
 
 	# Target file exists: try changing owner and/or permissions but do not fail
 	set_mode_owner
+}
 
-	exit $ret
+install_each() {
+	# Each file is installed in a subshell, which is much cheaper than running
+	# rinstall again and starts from the same defaults
+	(fetched=${3:-0}; install_file "$1" "$2"; exit $ret)
+	status=$?
+	case $status in
+		0) ret=0 ;;
+		1) ;;
+		*) exit $status ;;
+	esac
+}
+
+install_list() {
+	# Each line is "source [target [mode [owner:group]]]", where - leaves a
+	# field unset. Sources that are not staged are fetched together first, so
+	# that the list is installed in a single pass
+	if [ "$list" = "-" ]; then
+		entries="$(cat)"
+	else
+		entries="$(cat "$list")" || exit 1
+	fi
+	prefetch_list
+	opt_mode="$mode"
+	opt_owner="$owner"
+	while read -r l_src l_dst l_mode l_owner; do
+		case "$l_src" in
+			"" | \#*) continue ;;
+		esac
+		[ "$l_dst" != "-" ] || l_dst=""
+		[ "$l_mode" != "-" ] || l_mode=""
+		[ "$l_owner" != "-" ] || l_owner=""
+		mode="${l_mode:-$opt_mode}"
+		owner="${l_owner:-$opt_owner}"
+		case " $prefetched " in
+			*" $l_src "*) install_each "$l_src" "$l_dst" 1 ;;
+			*) install_each "$l_src" "$l_dst" ;;
+		esac
+	done <<-ENTRIES
+	$entries
+	ENTRIES
+}
+
+prefetch_list() {
+	# Sources that are not staged and whose target does not match the manifest
+	# are fetched by one curl(1) over persistent connections. Anything that is
+	# not fetched here is fetched while it is installed
+	command -v curl > /dev/null || return 0
+	fetch_list="$SD/.rinstall.$$"
+	: > "$fetch_list.src"
+	targets=""
+	while read -r l_src l_dst l_rest; do
+		case "$l_src" in
+			"" | \#* | /*) continue ;;
+		esac
+		[ ! -f "$l_src" -a ! -f "$SD/$l_src" ] || continue
+		[ "$l_dst" != "-" ] || l_dst=""
+		[ -z "$l_dst" -o ! -d "$l_dst" ] || l_dst="$l_dst/${l_src##*/}"
+		echo "$l_src	$l_dst" >> "$fetch_list.src"
+		[ ! -f "$l_dst" ] || targets="$targets $l_dst"
+	done <<-ENTRIES
+	$entries
+	ENTRIES
+
+	manifest_entry "" > /dev/null
+	[ -z "$targets" ] || file_digests $targets > "$fetch_list.dgst" 2> /dev/null
+	: >> "$fetch_list.dgst"
+	awk -F '\t' -v sd="$SD" -v url="$INSTALL_URL" -v max="${RINSTALL_RANGE_SIZE:-67108864}" '
+		FILENAME ~ /\.manifest$/ {
+			if (NF == 4 && length($1) == 64) {
+				digest[$4] = $1
+				size[$4] = $2
+			}
+			next
+		}
+		FILENAME ~ /\.dgst$/ {
+			split($0, f, " ")
+			target[f[2]] = f[1]
+			next
+		}
+		{
+			path = $1
+			sub(/^\.\//, "", path)
+			if (seen[$1]++ || path in digest && (digest[path] == target[$2] || size[path] >= max))
+				next
+			printf "url = \"%s/%s\"\noutput = \"%s/%s\"\n", url, $1, sd, $1
+		}' "$SD/.manifest" "$fetch_list.dgst" "$fetch_list.src" > "$fetch_list.cfg"
+
+	if [ -s "$fetch_list.cfg" ]; then
+		curl_get -K "$fetch_list.cfg" --parallel --parallel-max "${RINSTALL_FETCHES:-8}" \
+		    --create-dirs -w '%{http_code} %{filename_effective}\n' \
+		    > "$fetch_list.out" 2> /dev/null
+		# The status of each transfer is listed; a failed transfer must not
+		# be mistaken for a staged file
+		while read -r code file; do
+			if [ "$code" = 200 ]; then
+				prefetched="$prefetched ${file#$SD/}"
+			else
+				rm -f "$file"
+			fi
+		done < "$fetch_list.out"
+		fix_permissions
+	fi
+	rm -f "$fetch_list".*
 }
 
 usage() {
 	>&2 echo "release: ${release}"
 	>&2 echo "usage: rinstall [-a location] [-m mode] [-o owner:group] source [target]"
+	>&2 echo "       rinstall -r [-m mode] [-o owner:group] source [target]"
+	>&2 echo "       rinstall [-a location] [-m mode] [-o owner:group] -f list"
 	if [ -z "$1" ]; then
 		echo >&2 "hint: use -h to display option summary"
 		exit 1
@@ -56,8 +180,11 @@ usage() {
 	cat <<- HELP
 		summary:
 		    -a location      URL to use if source is not found locally
+		    -b               Same as -f -
+		    -f list          Install each "source [target [mode [owner]]]" in list
 		    -m mode          Arguments passed to chmod(1)
 		    -o owner:group   Arguments passed to chown(8)
+		    -r               Install all files in the source directory
 		docs:
 		    man rinstall
 	HELP
@@ -80,15 +207,22 @@ init() {
 
 parse_args() {
 	[ "x$1" = "x-h" ] && usage $1
-	while getopts m:o:a: arg; do
+	while getopts m:o:a:bf:r arg; do
 		case "$arg" in
 			o) owner="$OPTARG" ;;
 			m) mode="$OPTARG" ;;
 			a) alt_location="$OPTARG" ;;
+			b) list="-" ;;
+			f) list="$OPTARG" ;;
+			r) recursive=1 ;;
 			?) usage ;;
 		esac
 	done
 	shift $(($OPTIND - 1))
+	if [ -n "$list" ]; then
+		[ $# -eq 0 -a $recursive -eq 0 ] || usage
+		return
+	fi
 	[ $# -eq 1 -o $# -eq 2 ] || usage
 	arg_src="$1"
 	arg_dst="$2"
@@ -97,14 +231,24 @@ parse_args() {
 set_source_target_vars() {
 	# Source can be a local file defined by absolute path or remote defined
 	# using a relative path
+	# Paths are split using parameter expansion instead of dirname(1) and
+	# basename(1) since this runs for every file installed
 	source="$1"
-	src_path="$(dirname $source)"
+	src_name="${source##*/}"
+	case "$source" in
+		/*/* | [!/]*/*) src_path="${source%/*}" ;;
+		/*) src_path="/" ;;
+		*) src_path="." ;;
+	esac
 
 	if [ -z "$2" ]; then
 		# Target is not defined, try source located in $SD
 
 		# Ensure the source has a relative path by removing leading slashes
-		src_rel_path="$(echo "$src_path" | sed 's|^/*||')"
+		src_rel_path="$src_path"
+		while [ "${src_rel_path#/}" != "$src_rel_path" ]; do
+			src_rel_path="${src_rel_path#/}"
+		done
 
 		# prepare a relative path for the target in $SD
 		[ -d "$SD/$src_rel_path" ] || mkdir -p "$SD/$src_rel_path" || {
@@ -114,13 +258,13 @@ set_source_target_vars() {
 		fix_permissions
 
 		if [ "$src_rel_path" = "." ]; then
-			target="$SD/$(basename "$source")"
+			target="$SD/$src_name"
 		else
-			target="$SD/$src_rel_path/$(basename "$source")"
+			target="$SD/$src_rel_path/$src_name"
 		fi
 		samedir=1
 	elif [ -d "$2" ]; then
-		target="$2/$(basename "$source")"
+		target="$2/$src_name"
 	else
 		target="$2"
 	fi
@@ -152,11 +296,26 @@ download_source() {
 		fix_permissions
 	fi
 
-	fetch_file "$INSTALL_URL/$source"
+	# A target that matches the manifest of the server does not need to be
+	# fetched
+	entry="$(manifest_entry "$source")"
+	src_digest="${entry% *}"
+	src_size="${entry#* }"
+	if [ -f "$target" ] && [ -n "$src_digest" ] \
+	    && [ "$src_digest" = "$(file_digest "$target")" ]; then
+		cp "$target" "$SD/$source"
+		fetched=1
+		same=1
+		return
+	fi
+
+	fetch_file "$INSTALL_URL/$source" "$SD/$source"
 	if [ $? -ne 0 ]; then
 		if [ -n "$alt_location" ]; then
 			echo "rinstall: using alternate source: $alt_location"
-			fetch_file "$alt_location"
+			src_digest=""
+			src_size=""
+			fetch_file "$alt_location" "$SD/$source"
 			[ $? -eq 0 ] || {
 				>&2 echo "rinstall: unable to fetch $alt_location"
 				exit 3
@@ -169,25 +328,224 @@ download_source() {
 	fetched=1
 }
 
+install_tree() {
+	source="${arg_src%/}"
+	if check_absolute_path "$source/."; then
+		src_dir="$source"
+		[ -d "$src_dir" ] || {
+			>&2 echo "rinstall: source $source with absolute path does not exist"
+			exit 1
+		}
+	else
+		src_dir="$SD/$source"
+		[ -d "$src_dir" ] || download_tree
+	fi
+
+	if [ -z "$arg_dst" ]; then
+		[ $fetched -eq 0 ] || {
+			ret=0
+			echo "rinstall: fetched $src_dir"
+		}
+		return
+	fi
+	if ! check_absolute_path "$arg_dst/."; then
+		>&2 echo "rinstall: $arg_dst is not an absolute path"
+		exit 1
+	fi
+
+	# Install each file using the staged copy
+	files="$(cd "$src_dir" && find . -type f | sort)"
+	while IFS= read -r f; do
+		[ -n "$f" ] || continue
+		f="${f#./}"
+		dst_dir="$arg_dst/$f"
+		dst_dir="${dst_dir%/*}"
+		[ -d "$dst_dir" ] || mkdir -p "$dst_dir" || exit 1
+		install_each "$src_dir/$f" "$arg_dst/$f"
+	done <<-FILES
+	$files
+	FILES
+}
+
+download_tree() {
+	# A directory is fetched as a single tar archive
+	mkdir -p "$src_dir" || {
+		>&2 echo "rinstall: could not create a relative path: $src_dir"
+		exit 1
+	}
+	fix_permissions
+
+	fetch_file "$INSTALL_URL/$source/?tar" "$src_dir.tar" && tar -xf "$src_dir.tar" -C "$src_dir"
+	status=$?
+	rm -f "$src_dir.tar"
+	if [ $status -ne 0 ]; then
+		>&2 echo "rinstall: unable to fetch $INSTALL_URL/$source/?tar"
+		exit 3
+	fi
+	fetched=1
+}
+
 fetch_file() {
+	# rset -u forwards the web server to a socket beside the staging directory,
+	# which only curl is able to connect to
+	if [ -S "$SD.sock" ]; then
+		fetch_curl "$1" "$2"
+		return $?
+	fi
 	case $(uname) in
 		OpenBSD)
-			ftp -o "$SD/$source" -n "$1"
+			ftp -o "$2" -n "$1"
 			;;
 		FreeBSD)
-			fetch -qo "$SD/$source" "$1"
+			fetch -qo "$2" "$1"
 			;;
 		*)
 			if command -v curl > /dev/null; then
-				curl -fsLo "$SD/$source" "$1"
+				fetch_curl "$1" "$2"
 			else
-				wget -qO "$SD/$source" "$1"
+				wget -qO "$2" "$1"
 			fi
 			;;
 	esac
 	return $?
 }
 
+fetch_curl() {
+	# Large files are fetched as parallel ranges, or as a whole if the server
+	# does not support them.
+	# Offer the digest of the current target; 304 Not Modified indicates that
+	# the target is identical to the remote source
+	if [ -n "$src_size" ] && [ "$src_size" -ge "${RINSTALL_RANGE_SIZE:-67108864}" ]; then
+		fetch_ranges "$1" "$2" "$src_size" || {
+			[ $? -eq 2 ] || return 1
+			curl_get -o "$2" "$1"
+		}
+	elif [ -f "$target" ] && etag="$(file_digest "$target")" && [ -n "$etag" ]; then
+		code="$(curl_get --compressed -w '%{http_code}' -H "If-None-Match: \"$etag\"" \
+		    -o "$2" "$1")" || return $?
+		[ "$code" != 304 ] || { cp "$target" "$2" && same=1; }
+	else
+		curl_get --compressed -o "$2" "$1"
+	fi
+}
+
+curl_get() {
+	# rset exports the session of each host, which allows the server to
+	# attribute the request to a host
+	[ -S "$SD.sock" ] && unix_socket="$SD.sock" || unix_socket=""
+	curl -fsL ${unix_socket:+--unix-socket "$unix_socket"} \
+	    ${RSET_SESSION:+-H "X-Rset-Session: $RSET_SESSION"} "$@"
+}
+
+fetch_ranges() {
+	# Each range is kept in a part file named after its bounds, in a directory
+	# named after the digest of the file beside the staging directory, so that
+	# an interrupted transfer is resumed by the next run. Complete parts are
+	# not fetched again. Returns 2 if the server does not support ranges
+	parts="${SD%/*}/rinstall.$(id -u)/$src_digest"
+	(umask 077 && mkdir -p "$parts") && [ -O "$parts" ] || return 1
+	n=${RINSTALL_RANGES:-4}
+	chunk=$((($3 + n - 1) / n))
+	pids=""
+	i=0
+	while [ $i -lt $n ]; do
+		lower=$((i * chunk))
+		upper=$(((i + 1) * chunk - 1))
+		[ $upper -lt $3 ] || upper=$(($3 - 1))
+		[ $lower -gt $upper ] || {
+			fetch_range "$1" "$parts/$lower-$upper" $lower $upper &
+			pids="$pids $!:$lower-$upper"
+		}
+		i=$((i + 1))
+	done
+	status=0
+	for pid in $pids; do
+		wait ${pid%%:*} || case $? in
+			2) status=2 ;;
+			*) [ $status -eq 2 ] || status=1 ;;
+		esac
+	done
+	[ $status -ne 2 ] || rm -rf "$parts"
+	[ $status -eq 0 ] || return $status
+
+	: > "$2"
+	for pid in $pids; do
+		cat "$parts/${pid#*:}" >> "$2" || return 1
+	done
+	if [ $(($(wc -c < "$2"))) -ne $3 ] || [ "$src_digest" != "$(file_digest "$2")" ]; then
+		rm -rf "$2" "$parts"
+		return 1
+	fi
+	rm -rf "$parts"
+}
+
+fetch_range() {
+	# Append the missing bytes of a part, retrying a failed transfer. A part
+	# that is too long is not a range of this file
+	len=$(($4 - $3 + 1))
+	tries=0
+	while :; do
+		have=0
+		[ ! -f "$2" ] || have=$(($(wc -c < "$2")))
+		[ $have -lt $len ] || break
+		[ $tries -lt ${RINSTALL_RETRIES:-3} ] || return 1
+		tries=$((tries + 1))
+		code="$(curl_get -r "$(($3 + have))-$4" -w '%{http_code}' -o "$2.tmp" "$1")"
+		case "$code" in
+			206) [ ! -f "$2.tmp" ] || cat "$2.tmp" >> "$2" ;;
+			200)
+				rm -f "$2.tmp"
+				return 2
+				;;
+		esac
+		rm -f "$2.tmp"
+	done
+	[ $have -eq $len ] || {
+		rm -f "$2"
+		return 1
+	}
+}
+
+manifest_entry() {
+	# The manifest is fetched once for each staging directory. Lines are
+	# "digest<TAB>size<TAB>mtime<TAB>path"; any other response is ignored
+	manifest="$SD/.manifest"
+	if [ ! -f "$manifest" ]; then
+		fetch_file "$INSTALL_URL/?manifest" "$manifest.tmp" > /dev/null 2>&1 \
+		    && mv "$manifest.tmp" "$manifest" || {
+			rm -f "$manifest.tmp"
+			: > "$manifest"
+		}
+	fi
+	awk -F '\t' -v path="${1#./}" \
+	    'NF == 4 && length($1) == 64 && $4 == path { print $1, $2; exit }' "$manifest"
+}
+
+file_digests() {
+	# Print "digest path" for each file
+	if command -v sha256sum > /dev/null; then
+		sha256sum "$@"
+	elif command -v sha256 > /dev/null; then
+		sha256 -r "$@"
+	elif command -v shasum > /dev/null; then
+		shasum -a 256 "$@"
+	else
+		return 1
+	fi
+}
+
+file_digest() {
+	if command -v sha256sum > /dev/null; then
+		sha256sum < "$1" | cut -d' ' -f1
+	elif command -v sha256 > /dev/null; then
+		sha256 -q < "$1"
+	elif command -v shasum > /dev/null; then
+		shasum -a 256 < "$1" | cut -d' ' -f1
+	else
+		return 1
+	fi
+}
+
 check_diff_source_target() {
 	# Set the 'create' flag:
 	#   0 - files are the same
@@ -209,6 +567,9 @@ check_diff_source_target() {
 				ret=0
 				echo "rinstall: fetched $target"
 			}
+		elif [ $same -eq 1 ]; then
+			# The digest of the target matched the source
+			create=0
 		else
 			if output="$(diff $RINSTALL_DIFF_ARGS "$target" "$src_file" 2>&1)"
 			then
@@ -230,8 +591,20 @@ check_diff_source_target() {
 }
 
 install_target() {
+	# The source is copied beside the target and renamed over it, so that the
+	# target is never seen partially written. An updated file keeps the mode
+	# and owner of the target it replaces
 	if [ $create -ne 0 ]; then
-		cp "$src_file" "$target" && ret=0 || {
+		tmp=""
+		if [ -L "$target" ]; then
+			cp "$src_file" "$target"
+		else
+			tmp="${target%/*}/.rinstall.$$"
+			{ [ $create -eq 1 ] || cp -p "$target" "$tmp"; } \
+			    && cp "$src_file" "$tmp" && mv -f "$tmp" "$target"
+		fi
+		[ $? -eq 0 ] && ret=0 || {
+			[ -z "$tmp" ] || rm -f "$tmp"
 			>&2 echo "rinstall: could not copy $src_file into $target"
 			exit 1
 		}
@@ -251,7 +624,7 @@ set_mode_owner() {
 }
 
 check_absolute_path() {
-	case $(dirname "$1") in
+	case "$1" in
 		/*) return 0
 			;;
 		*)  return 1
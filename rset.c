@@ -22,6 +22,7 @@
 #include "execute.h"
 #include "input.h"
 #include "rutils.h"
+#include "snapshot.h"
 #include "worker.h"
 #include "xlibc.h"
 
@@ -29,20 +30,35 @@
 static void handle_exit(int sig);
 static void usage(bool);
 static char **set_options(int argc, char *argv[]);
-static void compare_argv(char *args[], char *hostnames[], char *m_args[]);
+static int compare_argv(char *args[], char *hostnames[], char *m_args[], int max_hosts);
 static void not_found(char *name);
-static void start_http_server(int stdout_pipe[], int http_port);
-static int execute_remote(char *hostnames[], regex_t *label_reg);
-static int dry_run(char *hostnames[], char *m_args[], regex_t *label_reg);
+static void load_route_labels(const char *snapshot_path);
+static unsigned int hash_name(const char *s);
+static void index_labels(regex_t *label_reg);
+static void select_http_server(void);
+static void start_http_server(int stdout_fd, int http_port, const char *http_socket);
+static void drain_http_log(int fd);
+static int execute_remote(char *hostnames[]);
+static int dry_run(char *hostnames[], char *m_args[]);
 
 /* globals from input.h */
 Label **route_labels;
 
+/* label names and their match against label_pattern, indexed by name_id */
+typedef struct {
+	const char *name;
+	regoff_t rm_so; /* -1 if the label is not selected */
+	regoff_t rm_eo;
+} LabelMatch;
+
 /* globals */
+LabelMatch *label_matches;
+int n_label_names;
 int archive_opt;
 int dryrun_opt;
 int restore_opt;
 int tty_opt;
+int unix_socket_opt;
 int stop_on_err_opt;
 int n_parallel;
 char *sshconfig_file;
@@ -55,6 +71,9 @@ char *routes_file = ROUTES_FILE;
 char *socket_path;
 char *hostname;
 int http_port;
+char *http_socket;         /* Unix domain socket used instead of a port */
+int shared_http_server;    /* started by the parent of parallel workers */
+char *http_log_label = ""; /* label that web server records are attributed to */
 
 /*
  * Remote Staging Execution Tool
@@ -65,6 +84,7 @@ main(int argc, char *argv[]) {
 	int fd;
 	int i, j;
 	int ret;
+	int n_hosts;
 	int n_workers;
 	int worker_argc[MAX_WORKERS];
 	int worker_pid[MAX_WORKERS];
@@ -72,6 +92,10 @@ main(int argc, char *argv[]) {
 	char **args, **hostnames, **m_args;
 	char **worker_argv[MAX_WORKERS];
 	char routes_realpath[PATH_MAX];
+	char snapshot_path[PATH_MAX];
+	char http_log_path[PATH_MAX];
+	char port[6];
+	const char *errstr;
 	regex_t label_reg;
 	struct sigaction act;
 
@@ -125,21 +149,20 @@ main(int argc, char *argv[]) {
 		create_dir(PUBLIC_DIRECTORY);
 	}
 
-	/* parse route labels */
-	route_labels = alloc_labels();
-	read_route_labels(routes_file);
-	expand_route_labels();
-
 	xregcomp(&label_reg, label_pattern, REG_EXTENDED);
 
-	/* parse pln files for each host */
-	for (i = 0; route_labels[i]; i++)
-		read_host_labels(route_labels[i]);
+	/* parse route labels and pln files for each host */
+	snprintf(snapshot_path, sizeof(snapshot_path), ROUTES_SNAPSHOT, xbasename(routes_file));
+	load_route_labels(snapshot_path);
+	index_labels(&label_reg);
+	regfree(&label_reg);
 
 	/* generate list of matching hostnames */
-	hostnames = xcalloc(MAX_LABELS, sizeof(char *), "hostnames");
-	m_args = xcalloc(MAX_LABELS, sizeof(char *), "m_args");
-	compare_argv(args, hostnames, m_args);
+	for (i = 0, n_hosts = 1; route_labels[i]; i++)
+		n_hosts += route_host_count(route_labels[i]);
+	hostnames = xcalloc(n_hosts, sizeof(char *), "hostnames");
+	m_args = xcalloc(n_hosts, sizeof(char *), "m_args");
+	n_hosts = compare_argv(args, hostnames, m_args, n_hosts);
 
 	if (n_parallel > 0) {
 		n_workers = 0;
@@ -149,34 +172,69 @@ main(int argc, char *argv[]) {
 		for (i = 0; hostnames[i]; i++) {
 			j = i % n_parallel;
 			if (j + 1 > n_workers) {
-				worker_argv[n_workers] = xcalloc(argc, sizeof(char *), "worker_argv[]");
+				worker_argv[n_workers] =
+				    xcalloc(argc + n_hosts / n_parallel + 1, sizeof(char *), "worker_argv[]");
 				worker_argc[n_workers] = create_worker_argv(argv, worker_argv[n_workers]);
 				n_workers++;
 			}
 			worker_argv[j][worker_argc[j]++] = hostnames[i];
 		}
 
+		/* workers do not need to parse pln files again */
+		snprintf(snapshot_path, sizeof(snapshot_path), "%s/%s.snapshot", log_directory,
+		    get_tmstr());
+		if (snapshot_write(snapshot_path) == 0)
+			setenv("RSET_SNAPSHOT", snapshot_path, 1);
+
+		/* one web server is shared by all workers; its log is kept with theirs */
+		select_http_server();
+		snprintf(http_log_path, sizeof(http_log_path), "%s/%s.http", log_directory,
+		    get_tmstr());
+		if ((fd = open(http_log_path, O_WRONLY | O_CREAT | O_APPEND, 0640)) == -1)
+			err(1, "open %s", http_log_path);
+		start_http_server(fd, http_port, http_socket);
+		close(fd);
+		if (http_socket) {
+			setenv("RSET_HTTP_SOCKET", http_socket, 1);
+		} else {
+			snprintf(port, sizeof(port), "%u", http_port);
+			setenv("RSET_HTTP_PORT", port, 1);
+		}
+
 		for (i = 0; i < n_workers; i++)
 			worker_pid[i] = exec_worker(log_directory, i + 1, worker_argv[i]);
 
 		rexec_summary(n_workers, worker_pid, log_directory);
+		unlink(snapshot_path);
 		exit(0);
 	}
 
-	/* select a port to communicate on */
-	http_port = get_socket();
+	/* select a port or socket to communicate on, unless a parallel worker */
+	if (getenv("RSET_HTTP_SOCKET")) {
+		http_socket = xstrdup(getenv("RSET_HTTP_SOCKET"), "http_socket");
+		unsetenv("RSET_HTTP_SOCKET");
+		shared_http_server = 1;
+	} else if (getenv("RSET_HTTP_PORT")) {
+		http_port = strtonum(getenv("RSET_HTTP_PORT"), 1, 65535, &errstr);
+		if (errstr)
+			errx(1, "RSET_HTTP_PORT is %s", errstr);
+		unsetenv("RSET_HTTP_PORT");
+		shared_http_server = 1;
+	} else {
+		select_http_server();
+	}
 
 	if (pledge("stdio rpath wpath cpath proc exec unveil", NULL) == -1)
 		err(1, "pledge");
 
 	/* main loop */
 	if (dryrun_opt) {
-		ret = dry_run(hostnames, m_args, &label_reg);
+		ret = dry_run(hostnames, m_args);
 		free(hostnames);
 		return ret;
 	}
 
-	ret = execute_remote(hostnames, &label_reg);
+	ret = execute_remote(hostnames);
 	free(hostnames);
 	return ret;
 }
@@ -187,14 +245,12 @@ main(int argc, char *argv[]) {
  */
 
 static int
-execute_remote(char *hostnames[], regex_t *label_reg) {
-	char httpd_log[32768];
-	int i, j, k, l;
-	int nr;
+execute_remote(char *hostnames[]) {
+	int i, j, k;
+	int flags;
 	int ret;
-	int stdout_pipe[2];
+	int stdout_pipe[2] = { -1, -1 };
 	size_t len;
-	regmatch_t regmatch;
 	Label **host_labels;
 
 	int exit_code = 0;
@@ -209,7 +265,16 @@ execute_remote(char *hostnames[], regex_t *label_reg) {
 	char *host_disconnect_msg = 0;
 
 	/* start background web server */
-	start_http_server(stdout_pipe, http_port);
+	if (!shared_http_server) {
+		xpipe(stdout_pipe, "stdout");
+		start_http_server(stdout_pipe[1], http_port, http_socket);
+
+		/* close output side of pipe, and ensure readers don't block */
+		close(stdout_pipe[1]);
+		flags = fcntl(stdout_pipe[0], F_GETFL);
+		fcntl(stdout_pipe[0], F_SETFL, flags | O_NONBLOCK);
+		set_log_reader(stdout_pipe[0], drain_http_log);
+	}
 
 	/* custom log format */
 	if (getenv("RSET_HOST_CONNECT")) {
@@ -225,114 +290,106 @@ execute_remote(char *hostnames[], regex_t *label_reg) {
 		host_labels = route_labels[i]->labels;
 
 		for (k = 0; hostnames[k]; k++) {
-			for (l = 0; l < route_labels[i]->n_aliases; l++) {
-				if (strcmp(hostnames[k], route_labels[i]->aliases[l]) == 0)
-					hostname = route_labels[i]->aliases[l];
-				else
+			if ((hostname = (char *) route_alias(route_labels[i], hostnames[k])) == NULL)
+				continue;
+
+			generate_session_id();
+			log_msg(host_connect_msg, hostname, "", 0);
+
+			len = PLN_LABEL_SIZE + sizeof(LOCAL_CONTROL_SOCKET);
+			socket_path = xmalloc(len, "socket_path");
+			snprintf(socket_path, len, LOCAL_CONTROL_SOCKET, hostname);
+
+			ret = start_connection(
+			    socket_path, hostname, route_labels[i], http_port, http_socket, sshconfig_file);
+			if (ret != 0) {
+				log_msg(host_connect_error_msg, hostname, "", ret);
+				end_connection(socket_path, hostname);
+				free(socket_path);
+				socket_path = NULL;
+				continue;
+			}
+
+			for (j = 0; host_labels[j]; j++) {
+				if (label_matches[host_labels[j]->name_id].rm_so == -1)
 					continue;
 
-				generate_session_id();
-				log_msg(host_connect_msg, hostname, "", 0);
+				log_msg(label_exec_begin_msg, hostname, host_labels[j]->name, 0);
+				http_log_label = host_labels[j]->name;
 
-				len = PLN_LABEL_SIZE + sizeof(LOCAL_CONTROL_SOCKET);
-				socket_path = xmalloc(len, "socket_path");
-				snprintf(socket_path, len, LOCAL_CONTROL_SOCKET, hostname);
+				/* local begin */
+				local_exit_code = local_exec(host_labels[j], host_labels[j]->options.begin);
 
-				ret = start_connection(
-				    socket_path, hostname, route_labels[i], http_port, sshconfig_file);
-				if (ret != 0) {
-					log_msg(host_connect_error_msg, hostname, "", ret);
-					end_connection(socket_path, hostname);
-					free(socket_path);
-					socket_path = NULL;
-					continue;
+				if (stop_on_err_opt && local_exit_code != 0) {
+					log_msg(
+					    label_exec_error_msg, hostname, host_labels[j]->name, local_exit_code);
+					goto exit;
 				}
 
-				for (j = 0; host_labels[j]; j++) {
-					if (xregexec(label_reg, host_labels[j]->name, 1, &regmatch) != 0)
-						continue;
-
-					log_msg(label_exec_begin_msg, hostname, host_labels[j]->name, 0);
+				/* restore */
+				if (restore_opt && host_labels[j]->export_paths[0])
+					scp_exit_code = scp_archive(hostname, socket_path, host_labels[j], true);
 
-					/* local begin */
-					local_exit_code = local_exec(host_labels[j], host_labels[j]->options.begin);
-
-					if (stop_on_err_opt && local_exit_code != 0) {
-						log_msg(
-						    label_exec_error_msg, hostname, host_labels[j]->name, local_exit_code);
-						goto exit;
-					}
+				if (stop_on_err_opt && scp_exit_code != 0) {
+					log_msg(
+					    label_exec_error_msg, hostname, host_labels[j]->name, scp_exit_code);
+					goto exit;
+				}
 
-					/* restore */
-					if (restore_opt && host_labels[j]->export_paths[0])
-						scp_exit_code = scp_archive(hostname, socket_path, host_labels[j], true);
+				/* remote execution */
+				if (tty_opt)
+					exit_code =
+					    ssh_command_tty(hostname, socket_path, host_labels[j], env_override);
+				else
+					exit_code =
+					    ssh_command_pipe(hostname, socket_path, host_labels[j], env_override);
 
-					if (stop_on_err_opt && scp_exit_code != 0) {
-						log_msg(
-						    label_exec_error_msg, hostname, host_labels[j]->name, scp_exit_code);
-						goto exit;
-					}
+				if (stop_on_err_opt && (exit_code != 0)) {
+					log_msg(label_exec_error_msg, hostname, host_labels[j]->name, exit_code);
+					goto exit;
+				}
 
-					/* remote execution */
-					if (tty_opt)
-						exit_code =
-						    ssh_command_tty(hostname, socket_path, host_labels[j], env_override);
-					else
-						exit_code =
-						    ssh_command_pipe(hostname, socket_path, host_labels[j], env_override);
-
-					if (stop_on_err_opt && (exit_code != 0)) {
-						log_msg(label_exec_error_msg, hostname, host_labels[j]->name, exit_code);
-						goto exit;
-					}
+				/* archive */
+				if (archive_opt && host_labels[j]->export_paths[0])
+					scp_exit_code = scp_archive(hostname, socket_path, host_labels[j], false);
 
-					/* archive */
-					if (archive_opt && host_labels[j]->export_paths[0])
-						scp_exit_code = scp_archive(hostname, socket_path, host_labels[j], false);
+				if (stop_on_err_opt && scp_exit_code != 0) {
+					log_msg(
+					    label_exec_error_msg, hostname, host_labels[j]->name, scp_exit_code);
+					goto exit;
+				}
 
-					if (stop_on_err_opt && scp_exit_code != 0) {
-						log_msg(
-						    label_exec_error_msg, hostname, host_labels[j]->name, scp_exit_code);
-						goto exit;
-					}
+				/* local end */
+				local_exit_code = local_exec(host_labels[j], host_labels[j]->options.end);
 
-					/* local end */
-					local_exit_code = local_exec(host_labels[j], host_labels[j]->options.end);
+				if (stop_on_err_opt && local_exit_code != 0) {
+					log_msg(
+					    label_exec_error_msg, hostname, host_labels[j]->name, local_exit_code);
+					goto exit;
+				}
 
-					if (stop_on_err_opt && local_exit_code != 0) {
-						log_msg(
-						    label_exec_error_msg, hostname, host_labels[j]->name, local_exit_code);
-						goto exit;
-					}
+				/* ssh terminated, unable to execute local interpreter */
+				if ((exit_code == 255) || (exit_code == 127))
+					log_msg(label_exec_error_msg, hostname, host_labels[j]->name, exit_code);
+				else
+					log_msg(label_exec_end_msg, hostname, host_labels[j]->name, exit_code);
 
-					/* ssh terminated, unable to execute local interpreter */
-					if ((exit_code == 255) || (exit_code == 127))
-						log_msg(label_exec_error_msg, hostname, host_labels[j]->name, exit_code);
-					else
-						log_msg(label_exec_end_msg, hostname, host_labels[j]->name, exit_code);
-
-					/* read output of web server */
-					nr = read(stdout_pipe[0], httpd_log, sizeof(httpd_log));
-					if (nr > 0) {
-						httpd_log[nr] = '\0';
-						trace_http(httpd_log);
-					}
-					if ((nr == -1) && (errno != EAGAIN))
-						warn("read from httpd output");
-				}
+				/* read the rest of the web server output; a shared server uses a file */
+				if (stdout_pipe[0] != -1)
+					drain_http_log(stdout_pipe[0]);
+			}
 
-			exit:
-				if (socket_path) {
-					if (archive_opt || restore_opt)
-						log_msg(host_disconnect_msg, hostname, "",
-						    stop_on_err_opt ? exit_code : scp_exit_code);
-					else
-						log_msg(host_disconnect_msg, hostname, "",
-						    stop_on_err_opt ? exit_code : local_exit_code);
-					end_connection(socket_path, hostname);
-					free(socket_path);
-					socket_path = NULL;
-				}
+		exit:
+			if (socket_path) {
+				if (archive_opt || restore_opt)
+					log_msg(host_disconnect_msg, hostname, "",
+					    stop_on_err_opt ? exit_code : scp_exit_code);
+				else
+					log_msg(host_disconnect_msg, hostname, "",
+					    stop_on_err_opt ? exit_code : local_exit_code);
+				end_connection(socket_path, hostname);
+				free(socket_path);
+				socket_path = NULL;
 			}
 		}
 	}
@@ -349,38 +406,45 @@ execute_remote(char *hostnames[], regex_t *label_reg) {
  */
 
 static int
-dry_run(char *hostnames[], char *m_args[], regex_t *label_reg) {
-	int i, j, k, l;
+dry_run(char *hostnames[], char *m_args[]) {
+	int i, j, k;
 	regmatch_t regmatch;
 	regex_t route_reg;
+	const char *compiled = NULL;
 	Label **host_labels;
+	LabelMatch *match;
 
 	for (i = 0; route_labels[i]; i++) {
 		host_labels = route_labels[i]->labels;
 
 		for (k = 0; hostnames[k]; k++) {
-			for (l = 0; l < route_labels[i]->n_aliases; l++) {
-				if (strcmp(hostnames[k], route_labels[i]->aliases[l]) == 0)
-					hostname = route_labels[i]->aliases[l];
-				else
-					continue;
+			if ((hostname = (char *) route_alias(route_labels[i], hostnames[k])) == NULL)
+				continue;
 
+			/* hosts selected by the same argument are adjacent */
+			if (m_args[k] != compiled) {
+				if (compiled)
+					regfree(&route_reg);
 				xregcomp(&route_reg, m_args[k], REG_EXTENDED);
-				xregexec(&route_reg, hostname, 1, &regmatch);
+				compiled = m_args[k];
+			}
+			xregexec(&route_reg, hostname, 1, &regmatch);
 
-				hl_range(hostname, HL_HOST, regmatch.rm_so, regmatch.rm_eo);
-				printf("\n");
+			hl_range(hostname, HL_HOST, regmatch.rm_so, regmatch.rm_eo);
+			printf("\n");
 
-				for (j = 0; host_labels[j]; j++) {
-					if (xregexec(label_reg, host_labels[j]->name, 1, &regmatch) != 0)
-						continue;
+			for (j = 0; host_labels[j]; j++) {
+				match = &label_matches[host_labels[j]->name_id];
+				if (match->rm_so == -1)
+					continue;
 
-					hl_range(host_labels[j]->name, HL_LABEL, regmatch.rm_so, regmatch.rm_eo);
-					printf("\n");
-				}
+				hl_range(host_labels[j]->name, HL_LABEL, match->rm_so, match->rm_eo);
+				printf("\n");
 			}
 		}
 	}
+	if (compiled)
+		regfree(&route_reg);
 
 	return 0;
 }
@@ -389,7 +453,7 @@ dry_run(char *hostnames[], char *m_args[], regex_t *label_reg) {
 
 void
 handle_exit(int sig) {
-	if (socket_path && hostname && http_port) {
+	if (socket_path && hostname && (http_port || http_socket)) {
 		printf("caught signal %d, terminating connection to '%s'\n", sig, hostname);
 		/* clean up socket and SSH connection; leaving staging dir */
 		execlp("ssh", "ssh", "-S", socket_path, "-O", "exit", hostname, NULL);
@@ -403,9 +467,9 @@ static void
 usage(bool summary) {
 	fprintf(stderr, "release: %s\n", RELEASE);
 	fprintf(stderr,
-	    "usage: rset [-AenRt] [-E environment] [-F sshconfig_file] [-f routes_file]\n"
+	    "usage: rset [-AenRtu] [-E environment] [-F sshconfig_file] [-f routes_file]\n"
 	    "            [-x label_pattern] hostname ...\n"
-	    "       rset [-e] [-E environment] [-F sshconfig_file] [-f routes_file]\n"
+	    "       rset [-eu] [-E environment] [-F sshconfig_file] [-f routes_file]\n"
 	    "            [-x label_pattern] -o log_directory -p workers hostname ...\n");
 	if (!summary) {
 		fprintf(stderr, "hint: use -h to display option summary\n");
@@ -423,6 +487,7 @@ usage(bool summary) {
 	       "    -p workers         Run using parallel execution\n"
 	       "    -R                 Upload files listed in label export paths\n"
 	       "    -t                 Enable TTY input on remote host\n"
+	       "    -u                 Serve files over a forwarded Unix domain socket\n"
 	       "    -x label_pattern   Execute labels matching specified regex\n");
 	printf("docs:\n"
 	       "    man rset\n");
@@ -437,13 +502,15 @@ set_options(int argc, char *argv[]) {
 	const char *errstr;
 	opterr = 0;
 	Options op;
+	Parser p;
 
 	bzero(&op, sizeof op);
+	bzero(&p, sizeof p);
 
 	if (argv[1] && strcmp(argv[1], "-h") == 0)
 		usage(true);
 
-	while ((ch = getopt(argc, argv, "AenRtE:F:f:o:p:x:")) != -1) {
+	while ((ch = getopt(argc, argv, "AenRtuE:F:f:o:p:x:")) != -1) {
 		switch (ch) {
 		case 'A':
 			archive_opt = 1;
@@ -457,12 +524,15 @@ set_options(int argc, char *argv[]) {
 		case 't':
 			tty_opt = 1;
 			break;
+		case 'u':
+			unix_socket_opt = 1;
+			break;
 		case 'R':
 			restore_opt = 1;
 			break;
 		case 'E':
 			env_override = xstrdup(optarg, "env_override");
-			env_split_lines(env_override);
+			env_split_lines(&p, env_override);
 			break;
 		case 'F':
 			sshconfig_file = optarg;
@@ -502,16 +572,64 @@ set_options(int argc, char *argv[]) {
 
 /* construct a list of hostnames matching routes */
 
+/*
+ * add_host - append a copy of a hostname unless it was already selected
+ * buckets is an open addressing table of indexes into hostnames + 1
+ */
 static void
-compare_argv(char *args[], char *hostnames[], char *m_args[]) {
-	int i, j, k;
+add_host(const char *match, char *arg, char *hostnames[], char *m_args[], int *n_hosts,
+    int *buckets, unsigned int mask) {
+	unsigned int slot;
+
+	slot = hash_name(match) & mask;
+	while (buckets[slot]) {
+		if (strcmp(match, hostnames[buckets[slot] - 1]) == 0)
+			return;
+		slot = (slot + 1) & mask;
+	}
+	/* add to list */
+	hostnames[*n_hosts] = xstrdup(match, "hostname");
+	m_args[*n_hosts] = arg;
+	buckets[slot] = ++(*n_hosts);
+}
+
+static int
+compare_argv(char *args[], char *hostnames[], char *m_args[], int max_hosts) {
+	int i, j, k, n;
 	int labels_matched;
 	int n_hosts = 0;
+	int *buckets;
+	unsigned int n_buckets = 64;
+	char buf[PLN_LABEL_SIZE];
 	const char *match;
+	HostRange *range;
+
+	while (n_buckets < (unsigned int) max_hosts * 2)
+		n_buckets *= 2;
+	buckets = xcalloc(n_buckets, sizeof(int), "buckets");
 
 	for (i = 0; args[i]; i++) {
 		labels_matched = 0;
 		for (j = 0; route_labels[j]; j++) {
+			/* hostnames in a range are only generated when matching a pattern */
+			if ((range = route_labels[j]->range)) {
+				if (range_contains(range, args[i])) {
+					add_host(args[i], args[i], hostnames, m_args, &n_hosts, buckets,
+					    n_buckets - 1);
+					labels_matched++;
+					continue;
+				}
+				for (n = 0; n < range_count(range); n++) {
+					match = pattern_match(args[i], range_format(range, n, buf, sizeof(buf)));
+					if (match) {
+						add_host(match, args[i], hostnames, m_args, &n_hosts, buckets,
+						    n_buckets - 1);
+						labels_matched++;
+					}
+				}
+				continue;
+			}
+
 			match = pattern_match(args[i], route_labels[j]->aliases[0]);
 
 			/* scan aliases for an exact match */
@@ -521,18 +639,9 @@ compare_argv(char *args[], char *hostnames[], char *m_args[]) {
 						match = route_labels[j]->aliases[k];
 				}
 			}
-			/* skip if already exists to set of hosts */
-			for (k = 0; match && k < n_hosts; k++) {
-				if (strcmp(match, hostnames[k]) == 0) {
-					match = NULL;
-					labels_matched++;
-				}
-			}
-			/* add to list */
 			if (match) {
-				hostnames[n_hosts] = (char *) match;
-				m_args[n_hosts] = args[i];
-				n_hosts++;
+				add_host(match, args[i], hostnames, m_args, &n_hosts, buckets,
+				    n_buckets - 1);
 				labels_matched++;
 			}
 		}
@@ -540,8 +649,10 @@ compare_argv(char *args[], char *hostnames[], char *m_args[]) {
 			errx(1, "No match for '%s' in %s", args[i], routes_file);
 	}
 
+	free(buckets);
 	hostnames[n_hosts] = NULL;
 	m_args[n_hosts] = NULL;
+	return n_hosts;
 }
 
 /* failure to locate utility */
@@ -551,14 +662,117 @@ not_found(char *name) {
 	errx(1, "'%s' not found in PATH", name);
 }
 
+/*
+ * load_route_labels - read a snapshot or parse routes and pln files
+ */
+
+static void
+load_route_labels(const char *snapshot_path) {
+	long n_cpus;
+	char *worker_snapshot;
+
+	/* a parallel worker uses the labels parsed by the parent process */
+	if ((worker_snapshot = getenv("RSET_SNAPSHOT"))) {
+		if (snapshot_read(worker_snapshot, false) == -1)
+			errx(1, "unable to read snapshot %s", worker_snapshot);
+		unsetenv("RSET_SNAPSHOT");
+		return;
+	}
+
+	if (snapshot_read(snapshot_path, true) == 0)
+		return;
+
+	route_labels = alloc_labels();
+	read_route_labels(routes_file);
+	expand_route_labels();
+
+	n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	read_all_host_labels((n_cpus > MAX_PARSERS) ? MAX_PARSERS : n_cpus, PARSER_MIN_FILES);
+
+	/* output of local execution must be regenerated on each run */
+	if (!snapshot_is_volatile())
+		snapshot_write(snapshot_path);
+}
+
+/*
+ * index_labels - assign each distinct label name an id and match it once
+ */
+
+static unsigned int
+hash_name(const char *s) {
+	unsigned int h = 2166136261u;
+
+	while (*s)
+		h = (h ^ (unsigned char) *s++) * 16777619u;
+	return h;
+}
+
+static void
+index_labels(regex_t *label_reg) {
+	int i, j;
+	int *buckets;
+	unsigned int mask, slot;
+	unsigned int n_buckets = 64;
+	size_t n_total = 0;
+	regmatch_t regmatch;
+	Label *label;
+
+	for (i = 0; route_labels[i]; i++) {
+		for (j = 0; route_labels[i]->labels[j]; j++)
+			n_total++;
+	}
+	while (n_buckets < n_total * 2)
+		n_buckets *= 2;
+	mask = n_buckets - 1;
+
+	/* open addressing; each bucket holds name_id + 1 */
+	buckets = xcalloc(n_buckets, sizeof(int), "buckets");
+	label_matches = xcalloc(n_total + 1, sizeof(LabelMatch), "label_matches");
+	n_label_names = 0;
+
+	for (i = 0; route_labels[i]; i++) {
+		for (j = 0; (label = route_labels[i]->labels[j]); j++) {
+			slot = hash_name(label->name) & mask;
+			while (buckets[slot]
+			    && strcmp(label_matches[buckets[slot] - 1].name, label->name) != 0)
+				slot = (slot + 1) & mask;
+
+			if (buckets[slot] == 0) {
+				label_matches[n_label_names].name = label->name;
+				if (xregexec(label_reg, label->name, 1, &regmatch) == 0) {
+					label_matches[n_label_names].rm_so = regmatch.rm_so;
+					label_matches[n_label_names].rm_eo = regmatch.rm_eo;
+				} else
+					label_matches[n_label_names].rm_so = -1;
+				buckets[slot] = ++n_label_names;
+			}
+			label->name_id = buckets[slot] - 1;
+		}
+	}
+	free(buckets);
+}
+
 /* built-in http server */
 
+/*
+ * select_http_server - choose an unused port, or a Unix domain socket which
+ * is forwarded to the remote host instead
+ */
 static void
-start_http_server(int stdout_pipe[], int http_port) {
-	int flags;
+select_http_server(void) {
+	if (unix_socket_opt) {
+		if (asprintf(&http_socket, LOCAL_HTTP_SOCKET, getpid()) == -1)
+			err(1, "asprintf");
+	} else {
+		http_port = get_socket();
+	}
+}
+
+static void
+start_http_server(int stdout_fd, int http_port, const char *http_socket) {
 	int status;
 	char port[6];
-	char *http_srv_argv[5];
+	char *http_srv_argv[7];
 	char *httpd_bin;
 	pid_t http_server_pid;
 	pid_t rset_pid;
@@ -566,21 +780,27 @@ start_http_server(int stdout_pipe[], int http_port) {
 
 	snprintf(port, sizeof(port), "%u", http_port);
 	http_srv_argv[0] = "miniquark";
-	http_srv_argv[1] = "-d";
-	http_srv_argv[2] = PUBLIC_DIRECTORY;
-	http_srv_argv[3] = port;
-	http_srv_argv[4] = NULL;
+	http_srv_argv[1] = "-j";
+	http_srv_argv[2] = "-d";
+	http_srv_argv[3] = PUBLIC_DIRECTORY;
+	if (http_socket) {
+		http_srv_argv[4] = "-u";
+		http_srv_argv[5] = (char *) http_socket;
+		http_srv_argv[6] = NULL;
+	} else {
+		http_srv_argv[4] = port;
+		http_srv_argv[5] = NULL;
+	}
 
 	if ((httpd_bin = findprog(http_srv_argv[0])) == 0)
 		not_found(http_srv_argv[0]);
 
 	/* start the web server */
-	xpipe(stdout_pipe, "stdout");
 	http_server_pid = fork();
 	if (http_server_pid == 0) {
-		/* close input side of pipe, and connect stdout */
-		dup2(stdout_pipe[1], STDOUT_FILENO);
-		close(stdout_pipe[1]);
+		/* connect stdout */
+		dup2(stdout_fd, STDOUT_FILENO);
+		close(stdout_fd);
 		if (unveil(xdirname(PUBLIC_DIRECTORY), "r") == -1)
 			err(1, "unveil");
 		if (unveil(xdirname(httpd_bin), "x") == -1)
@@ -589,7 +809,9 @@ start_http_server(int stdout_pipe[], int http_port) {
 			err(1, "unveil");
 		if (unveil("/usr/libexec", "r") == -1)
 			err(1, "unveil");
-		if (pledge("stdio rpath proc exec", "stdio rpath proc inet") == -1)
+		if (http_socket && unveil(xdirname(http_socket), "rwc") == -1)
+			err(1, "unveil");
+		if (pledge("stdio rpath proc exec", "stdio rpath cpath proc inet unix") == -1)
 			err(1, "pledge");
 
 		execv(httpd_bin, http_srv_argv);
@@ -597,11 +819,6 @@ start_http_server(int stdout_pipe[], int http_port) {
 		err(1, "%s", httpd_bin);
 	}
 
-	/* close output side of pipe, and ensure readers don't block */
-	close(stdout_pipe[1]);
-	flags = fcntl(stdout_pipe[0], F_GETFL);
-	fcntl(stdout_pipe[0], F_SETFL, flags | O_NONBLOCK);
-
 	/* watchdog to ensure that the http server is shut down*/
 	rset_pid = fork();
 	if (rset_pid > 0) {
@@ -618,3 +835,33 @@ start_http_server(int stdout_pipe[], int http_port) {
 		exit(WEXITSTATUS(status));
 	}
 }
+
+/*
+ * drain_http_log - read every record written by the web server so far
+ * Records are JSON lines; a partial line is kept until the rest arrives.
+ * Called while a label runs and after it is finished
+ */
+static void
+drain_http_log(int fd) {
+	static char buf[32768];
+	static size_t len;
+	ssize_t nr;
+	char *p, *q;
+
+	while ((nr = read(fd, buf + len, sizeof(buf) - len - 1)) > 0) {
+		len += nr;
+		buf[len] = '\0';
+		for (p = buf; (q = strchr(p, '\n')); p = q + 1) {
+			*q = '\0';
+			trace_http(p, hostname, http_log_label);
+		}
+		len -= p - buf;
+		memmove(buf, p, len);
+
+		/* a line that does not fit is not a record */
+		if (len == sizeof(buf) - 1)
+			len = 0;
+	}
+	if ((nr == -1) && (errno != EAGAIN))
+		warn("read from httpd output");
+}
@@ -5,9 +5,13 @@
 
 set_defaults() {
 	ret=1     # global exit status
-	append=1  # set to 0 to append text in line-replace mode
-	line_regex=""
+	append=0  # set to 1 to append text in line-replace mode
+	n_regex=0
+	n_text=0
+	line_regex=""   # newline-separated patterns and replacements
 	line_text=""
+	nl="
+"
 	: ${RSUB_START:="# start managed block"}
 	: ${RSUB_END:="# end managed block"}
 	: ${RSUB_DIFF_ARGS:="-U 2"}
@@ -18,22 +22,23 @@ main() {
 	parse_args "$@"
 	init
 
-	if [ -z "$line_regex$line_text" ]; then
+	# The new contents are only written if they differ from the target
+	if [ $n_regex -eq 0 ]; then
 		replace_block
 	else
 		replace_line
 	fi
-
-	# Source file exists: check the difference between source and target
-	check_diff_source_target
-
-	rm -f $source
+	case $? in
+		0) install_source ;;
+		1) ;;
+		*) rm -f "$source" ;;
+	esac
 	exit $ret
 }
 
 usage() {
 	>&2 echo "release: ${release}"
-	>&2 echo "usage: rsub [-A] -r line_regex -l line_text target"
+	>&2 echo "usage: rsub [-A] -r line_regex -l line_text [-r line_regex -l line_text ...] target"
 	>&2 echo "usage: rsub target < block_content"
 	if [ -z "$1" ]; then
 		echo >&2 "hint: use -h to display option summary"
@@ -62,7 +67,7 @@ init() {
 		exit 3
 	}
 
-	source=$(mktemp rsub_XXXXXXXX)
+	source="${target%/*}/.rsub.$$"
 
 	trap '' HUP
 }
@@ -71,47 +76,115 @@ parse_args() {
 	[ "x$1" = "x-h" ] && usage $1
 	while getopts Al:r: arg; do
 		case "$arg" in
-			A) append=0 ;;
-			r) line_regex="$OPTARG" ;;
-			l) line_text="$OPTARG" ;;
+			A) append=1 ;;
+			r)
+				[ $n_regex -eq 0 ] || line_regex="$line_regex$nl"
+				line_regex="$line_regex$OPTARG"
+				n_regex=$(($n_regex + 1))
+				;;
+			l)
+				[ $n_text -eq 0 ] || line_text="$line_text$nl"
+				line_text="$line_text$OPTARG"
+				n_text=$(($n_text + 1))
+				;;
 			?) usage ;;
 		esac
 	done
 	shift $(($OPTIND - 1))
-	[ $# -eq 1 ] || usage
+	[ $# -eq 1 -a $n_regex -eq $n_text ] || usage
 	target=$1
 }
 
-check_diff_source_target() {
-	[ -e "$target" ] && diff $RSUB_DIFF_ARGS "$target" $source || {
-		cp $source "$target"
-		ret=0
-	}
+install_source() {
+	# Show the difference, then replace the target. A symlink or a file with
+	# several links is written in place so that it stays shared; otherwise an
+	# empty file is given the mode and owner of the target, filled with the new
+	# contents and renamed over the target
+	diff $RSUB_DIFF_ARGS "$target" "$source"
+	set -- $(target_attributes)
+	if [ -L "$target" ] || [ "$3" -gt 1 ]; then
+		cat "$source" > "$target" && ret=0
+	else
+		# chown fails unless the owner may give the file away, as for cp -p
+		: > "$source.new" && chown "$2" "$source.new" 2> /dev/null
+		chmod "$1" "$source.new" && cat "$source" > "$source.new" \
+		    && mv -f "$source.new" "$target" && ret=0
+	fi
+	rm -f "$source" "$source.new"
+}
+
+target_attributes() {
+	# Print the arguments for chmod(1) and chown(8) that match the target, and
+	# its number of links, taken from the listing of ls(1)
+	ls -ldn "$target" | awk '{
+	    s = ""
+	    for (i = 0; i < 3; i++) {
+	        p = substr($1, 2 + 3 * i, 3)
+	        m = ""
+	        if (substr(p, 1, 1) == "r") m = m "r"
+	        if (substr(p, 2, 1) == "w") m = m "w"
+	        x = substr(p, 3, 1)
+	        if (x ~ /[xst]/) m = m "x"
+	        if (i < 2 && x ~ /[sS]/) m = m "s"
+	        if (i == 2 && x ~ /[tT]/) m = m "t"
+	        s = s (i ? "," : "") substr("ugo", i + 1, 1) "=" m
+	    }
+	    print s, $3 ":" $4, $2
+	}'
 }
 
+# The awk programs below keep the original and new lines, and exit with 1
+# if they are the same instead of writing the new contents to $source
+
 replace_block() {
-	cat <<-EOF > ${source}_b
-	${RSUB_START}
-	`cat`
-	${RSUB_END}
-	EOF
-	awk -v m="$RSUB_START" -v n="$RSUB_END" -v block=${source}_b '
-	    $0 == m, $0 == n { if (!x) system("cat " block) ; x=1; next; }; 1
-	    END { if (!x) system("cat " block) }
-	    ' "$target" > $source
-	rm ${source}_b
+	awk -v m="$RSUB_START" -v n="$RSUB_END" -v out="$source" '
+	    function block(    l, start) {
+	        if (x++)
+	            return
+	        line[++k] = m
+	        start = k
+	        while ((getline l < "-") > 0)
+	            line[++k] = l
+	        while (k > start && line[k] == "")
+	            k--
+	        if (k == start)
+	            line[++k] = ""
+	        line[++k] = n
+	    }
+	    { orig[NR] = $0 }
+	    $0 == m, $0 == n { block(); next }
+	    { line[++k] = $0 }
+	    END { block(); exit write() }
+	    '"$write_lines" "$target"
 }
 
 replace_line() {
-	awk -v n=$append -v a="$line_regex" -v b="$line_text" '
-	    BEGIN { gsub("&", "\\\\&", b) }
-	    { n+=sub(a, b); print }
-	    END { if (n==0) print b }
-	    ' "$target" > $source
+	awk -v append=$append -v a="$line_regex" -v b="$line_text" -v out="$source" '
+	    BEGIN {
+	        n = split(a, re, "\n")
+	        split(b, text, "\n")
+	        for (i = 1; i <= n; i++) {
+	            repl[i] = text[i]
+	            gsub("&", "\\\\&", repl[i])
+	        }
+	    }
+	    {
+	        orig[NR] = $0
+	        for (i = 1; i <= n; i++)
+	            found[i] += sub(re[i], repl[i])
+	        line[++k] = $0
+	    }
+	    END {
+	        for (i = 1; i <= n; i++)
+	            if (append && !found[i])
+	                line[++k] = text[i]
+	        exit write()
+	    }
+	    '"$write_lines" "$target"
 }
 
 check_absolute_path() {
-	case $(dirname "$1") in
+	case "$1" in
 		/*) return 0
 			;;
 		*)  return 1
@@ -119,4 +192,16 @@ check_absolute_path() {
 	esac
 }
 
+write_lines='
+    function write(    i) {
+        for (i = 1; i <= k && k == NR && line[i] == orig[i]; i++)
+            ;
+        if (i > k && k == NR)
+            return 1
+        for (i = 1; i <= k; i++)
+            print line[i] > out
+        close(out)
+        return 0
+    }'
+
 main "$@"
@@ -203,9 +203,12 @@ pattern_match(const char *pattern, const char *string) {
 	bool is_char, is_digit, is_dash, is_dot, is_colon;
 	bool try_regex = false;
 	const char *match = NULL;
-	regex_t label_reg;
 	regmatch_t regmatch;
 
+	/* the same pattern is usually compared with many hostnames */
+	static char *compiled_pattern = NULL;
+	static regex_t label_reg;
+
 	/* test for input consistant with a valid hostname or address */
 	len = strlen(pattern);
 	for (n = 0; n < len; n++) {
@@ -222,7 +225,14 @@ pattern_match(const char *pattern, const char *string) {
 	}
 
 	if (try_regex) {
-		xregcomp(&label_reg, pattern, REG_EXTENDED);
+		if (!compiled_pattern || strcmp(compiled_pattern, pattern) != 0) {
+			if (compiled_pattern) {
+				regfree(&label_reg);
+				free(compiled_pattern);
+			}
+			xregcomp(&label_reg, pattern, REG_EXTENDED);
+			compiled_pattern = xstrdup(pattern, "pattern");
+		}
 		if (xregexec(&label_reg, string, 1, &regmatch) == 0) {
 			match = string;
 		}
@@ -312,17 +322,16 @@ trace_exec(char *cmd[]) {
 }
 
 void
-trace_http(const char *http_log) {
-	char *ap, *bp, *input;
+trace_http(const char *record, const char *host_name, const char *label_name) {
+	char session[32];
 
-	if (!getenv("HTTP_TRACE"))
+	if (!getenv("HTTP_TRACE") || *record == '\0')
 		return;
 
-	bp = input = xstrdup(http_log, "http_log");
-
-	while ((ap = strsep(&input, "\n")) != NULL) {
-		if (*ap != '\0')
-			printf("+ " HL_TRACE "%s" HL_RESET "\n", ap);
-	}
-	free(bp);
+	/* requests made by rinstall(1) carry the session ID */
+	snprintf(session, sizeof(session), "\"session\":\"%08" PRIx32 "\"", session_id);
+	if (strstr(record, session))
+		printf("+ " HL_TRACE "%s %s %s" HL_RESET "\n", host_name, label_name, record);
+	else
+		printf("+ " HL_TRACE "%s" HL_RESET "\n", record);
 }
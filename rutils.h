@@ -23,4 +23,4 @@ const char *pattern_match(const char *, const char *);
 void log_msg(char *, char *, char *, int);
 void trace_shell(char *);
 void trace_exec(char *[]);
-void trace_http(const char *);
+void trace_http(const char *, const char *, const char *);
@@ -0,0 +1,20 @@
+/*
+ * sha256.h
+ * SHA-256 message digest (FIPS 180-4)
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_LENGTH 32
+#define SHA256_DIGEST_STRING_LENGTH (SHA256_DIGEST_LENGTH * 2 + 1)
+
+typedef struct {
+	uint32_t state[8];
+	uint64_t count;
+	uint8_t buffer[64];
+} SHA256_CTX;
+
+void sha256_init(SHA256_CTX *);
+void sha256_update(SHA256_CTX *, const void *, size_t);
+void sha256_end(SHA256_CTX *, char *);
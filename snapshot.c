@@ -0,0 +1,473 @@
+/*
+ * snapshot.c
+ * Save and restore parsed labels to avoid repeated parsing
+ */
+
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "missing/compat.h"
+
+#include "config.h"
+#include "input.h"
+#include "rutils.h"
+#include "snapshot.h"
+#include "xlibc.h"
+
+#define SNAPSHOT_MAGIC "RSETSNAP"
+
+typedef struct {
+	char *path;
+	long long size;
+	long long ino;
+	long long mtime_sec;
+	long long mtime_nsec;
+} Dependency;
+
+/* globals */
+static Dependency *dependencies;
+static int n_dependencies;
+static int dependency_allocation;
+static bool is_volatile;
+static bool read_error;
+
+/*
+ * stat_dependency - record the attributes used to detect a modified file
+ */
+static int
+stat_dependency(const char *path, Dependency *dep) {
+	struct stat sb;
+
+	if (stat(path, &sb) == -1)
+		return -1;
+	dep->size = sb.st_size;
+	dep->ino = sb.st_ino;
+	dep->mtime_sec = sb.st_mtim.tv_sec;
+	dep->mtime_nsec = sb.st_mtim.tv_nsec;
+	return 0;
+}
+
+static bool
+has_dependency(const char *path) {
+	int i;
+
+	for (i = 0; i < n_dependencies; i++) {
+		if (strcmp(dependencies[i].path, path) == 0)
+			return true;
+	}
+	return false;
+}
+
+static Dependency *
+next_dependency() {
+	if (n_dependencies == dependency_allocation) {
+		dependency_allocation = dependency_allocation ? dependency_allocation * 2 : 64;
+		dependencies = xrealloc(
+		    dependencies, dependency_allocation * sizeof(Dependency), "dependencies");
+	}
+	return &dependencies[n_dependencies];
+}
+
+/*
+ * snapshot_add_dependency - record a file that was used to construct labels
+ * snapshot_mark_volatile  - labels depend on the output of local execution
+ * snapshot_is_volatile    - true if labels may not be saved to a snapshot
+ */
+void
+snapshot_add_dependency(const char *path) {
+	Dependency *dep;
+
+	if (has_dependency(path))
+		return;
+
+	/* a snapshot can not be validated without this file */
+	dep = next_dependency();
+	if (stat_dependency(path, dep) == -1) {
+		is_volatile = true;
+		return;
+	}
+	dep->path = xstrdup(path, "dependency");
+	n_dependencies++;
+}
+
+void
+snapshot_mark_volatile() {
+	is_volatile = true;
+}
+
+bool
+snapshot_is_volatile() {
+	return is_volatile;
+}
+
+/* serialization */
+
+static void
+put_int(FILE *fp, long long n) {
+	fwrite(&n, sizeof(n), 1, fp);
+}
+
+static void
+put_bytes(FILE *fp, const char *s, long long len) {
+	if (s == NULL)
+		len = -1;
+	put_int(fp, len);
+	if (len > 0)
+		fwrite(s, 1, len, fp);
+}
+
+static void
+put_str(FILE *fp, const char *s) {
+	put_bytes(fp, s, s ? strlen(s) : 0);
+}
+
+static void
+put_array(FILE *fp, char *argv[], int max_elements) {
+	int n;
+
+	for (n = 0; n < max_elements && argv[n]; n++)
+		;
+	put_int(fp, n);
+	while (n-- > 0)
+		put_str(fp, *argv++);
+}
+
+static void
+put_dependencies(FILE *fp) {
+	int i;
+
+	put_int(fp, n_dependencies);
+	for (i = 0; i < n_dependencies; i++) {
+		put_str(fp, dependencies[i].path);
+		put_int(fp, dependencies[i].size);
+		put_int(fp, dependencies[i].ino);
+		put_int(fp, dependencies[i].mtime_sec);
+		put_int(fp, dependencies[i].mtime_nsec);
+	}
+}
+
+static void
+put_label(FILE *fp, Label *label) {
+	int n;
+
+	put_str(fp, label->name);
+	put_int(fp, label->n_aliases);
+	put_array(fp, label->aliases, PLN_MAX_ALIASES);
+	put_array(fp, label->export_paths, PLN_MAX_PATHS);
+	put_bytes(fp, label->content, label->content_size);
+	put_str(fp, label->generator);
+
+	put_str(fp, label->options.execute_with);
+	put_str(fp, label->options.interpreter);
+	put_str(fp, label->options.local_interpreter);
+	put_str(fp, label->options.local_output);
+	put_str(fp, label->options.environment);
+	put_str(fp, label->options.environment_file);
+	put_str(fp, label->options.begin);
+	put_str(fp, label->options.end);
+
+	if (label->range == NULL)
+		put_int(fp, -1);
+	else {
+		put_int(fp, label->range->n_groups);
+		for (n = 0; n < label->range->n_groups; n++) {
+			put_int(fp, label->range->low[n]);
+			put_int(fp, label->range->high[n]);
+			put_int(fp, label->range->width[n]);
+		}
+		for (n = 0; n <= label->range->n_groups; n++)
+			put_str(fp, label->range->parts[n]);
+	}
+
+	if (label->labels == NULL) {
+		put_int(fp, -1);
+		return;
+	}
+	for (n = 0; label->labels[n]; n++)
+		;
+	put_int(fp, n);
+	for (n = 0; label->labels[n]; n++)
+		put_label(fp, label->labels[n]);
+}
+
+/* deserialization: errors are accumulated in read_error */
+
+static long long
+get_int(FILE *fp) {
+	long long n;
+
+	if (fread(&n, sizeof(n), 1, fp) != 1) {
+		read_error = true;
+		return -1;
+	}
+	return n;
+}
+
+static char *
+get_bytes(FILE *fp, int *size) {
+	long long len;
+	char *s;
+
+	len = get_int(fp);
+	if (size)
+		*size = 0;
+	if (len < 0)
+		return NULL;
+	if (len >= REALLOC_MAX_SIZE) {
+		read_error = true;
+		return NULL;
+	}
+	s = xmalloc(len + 1, "snapshot string");
+	if (fread(s, 1, len, fp) != (size_t) len) {
+		read_error = true;
+		len = 0;
+	}
+	s[len] = '\0';
+	if (size)
+		*size = len;
+	return s;
+}
+
+static void
+get_fixed_str(FILE *fp, char *dst, size_t dsize) {
+	char *s;
+
+	dst[0] = '\0';
+	if ((s = get_bytes(fp, NULL)) == NULL)
+		return;
+	if (strlen(s) < dsize)
+		memcpy(dst, s, strlen(s) + 1);
+	else
+		read_error = true;
+	free(s);
+}
+
+static void
+get_array(FILE *fp, char *argv[], int max_elements) {
+	long long i, n;
+
+	n = get_int(fp);
+	if (n < 0 || n > max_elements) {
+		read_error = true;
+		n = 0;
+	}
+	for (i = 0; i < n; i++)
+		argv[i] = get_bytes(fp, NULL);
+	if (i < max_elements)
+		argv[i] = NULL;
+}
+
+static Label *
+get_label(FILE *fp) {
+	long long i, n;
+	Label *label;
+
+	label = xcalloc(1, sizeof(Label), "labels[]");
+	get_fixed_str(fp, label->name, sizeof(label->name));
+	label->n_aliases = get_int(fp);
+	get_array(fp, label->aliases, PLN_MAX_ALIASES);
+	get_array(fp, label->export_paths, PLN_MAX_PATHS - 1);
+	label->content = get_bytes(fp, &label->content_size);
+	label->generator = get_bytes(fp, NULL);
+
+	get_fixed_str(fp, label->options.execute_with, PLN_OPTION_SIZE);
+	get_fixed_str(fp, label->options.interpreter, PLN_OPTION_SIZE);
+	get_fixed_str(fp, label->options.local_interpreter, PLN_OPTION_SIZE);
+	get_fixed_str(fp, label->options.local_output, PLN_OPTION_SIZE);
+	get_fixed_str(fp, label->options.environment, PLN_OPTION_SIZE);
+	get_fixed_str(fp, label->options.environment_file, PLN_OPTION_SIZE);
+	label->options.begin = get_bytes(fp, NULL);
+	label->options.end = get_bytes(fp, NULL);
+
+	n = get_int(fp);
+	if (n > PLN_MAX_RANGES) {
+		read_error = true;
+		return label;
+	}
+	if (n >= 0) {
+		label->range = xcalloc(1, sizeof(HostRange), "range");
+		label->range->n_groups = n;
+		for (i = 0; i < n; i++) {
+			label->range->low[i] = get_int(fp);
+			label->range->high[i] = get_int(fp);
+			label->range->width[i] = get_int(fp);
+		}
+		for (i = 0; i <= n; i++)
+			get_fixed_str(fp, label->range->parts[i], PLN_LABEL_SIZE);
+	}
+
+	n = get_int(fp);
+	if (n < 0)
+		return label;
+	if (n >= MAX_LABELS) {
+		read_error = true;
+		return label;
+	}
+	label->labels = alloc_labels();
+	for (i = 0; i < n && !read_error; i++)
+		label->labels[i] = get_label(fp);
+	return label;
+}
+
+/*
+ * snapshot_write - save route_labels and the files they were read from
+ */
+int
+snapshot_write(const char *fn) {
+	int fd;
+	int i, n;
+	char tmp_fn[PATH_MAX];
+	FILE *fp;
+
+	snprintf(tmp_fn, sizeof(tmp_fn), "%s.XXXXXX", fn);
+	if ((fd = mkstemp(tmp_fn)) == -1) {
+		/* a snapshot is only a cache; a read-only directory is not an error */
+		if (errno != EACCES && errno != EROFS && errno != EPERM)
+			warn("mkstemp %s", tmp_fn);
+		return -1;
+	}
+	if ((fp = fdopen(fd, "w")) == NULL)
+		err(1, "fdopen %s", tmp_fn);
+
+	fwrite(SNAPSHOT_MAGIC, 1, sizeof(SNAPSHOT_MAGIC), fp);
+	put_int(fp, SNAPSHOT_VERSION);
+	put_dependencies(fp);
+
+	for (n = 0; route_labels[n]; n++)
+		;
+	put_int(fp, n);
+	for (i = 0; i < n; i++)
+		put_label(fp, route_labels[i]);
+
+	if (fclose(fp) != 0) {
+		warn("write %s", tmp_fn);
+		unlink(tmp_fn);
+		return -1;
+	}
+	if (rename(tmp_fn, fn) == -1) {
+		warn("rename %s", tmp_fn);
+		unlink(tmp_fn);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * snapshot_read - restore route_labels if no dependencies have changed
+ */
+int
+snapshot_read(const char *fn, bool validate) {
+	int i, n;
+	char magic[sizeof(SNAPSHOT_MAGIC)];
+	char *path;
+	FILE *fp;
+	Dependency saved, current;
+
+	if ((fp = fopen(fn, "r")) == NULL)
+		return -1;
+
+	read_error = false;
+	if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic)
+	    || memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) != 0
+	    || get_int(fp) != SNAPSHOT_VERSION)
+		goto invalid;
+
+	n = get_int(fp);
+	for (i = 0; i < n && !read_error; i++) {
+		path = get_bytes(fp, NULL);
+		saved.size = get_int(fp);
+		saved.ino = get_int(fp);
+		saved.mtime_sec = get_int(fp);
+		saved.mtime_nsec = get_int(fp);
+		if (read_error || path == NULL)
+			goto invalid;
+
+		if (validate) {
+			if (stat_dependency(path, &current) == -1 || current.size != saved.size
+			    || current.ino != saved.ino || current.mtime_sec != saved.mtime_sec
+			    || current.mtime_nsec != saved.mtime_nsec) {
+				free(path);
+				goto invalid;
+			}
+		}
+		free(path);
+	}
+
+	n = get_int(fp);
+	if (read_error || n < 0 || n >= MAX_LABELS)
+		goto invalid;
+	route_labels = alloc_labels();
+	for (i = 0; i < n && !read_error; i++)
+		route_labels[i] = get_label(fp);
+	if (read_error)
+		goto invalid;
+
+	fclose(fp);
+	return 0;
+
+invalid:
+	fclose(fp);
+	return -1;
+}
+
+/*
+ * snapshot_put_labels - save labels and dependencies collected by a parser process
+ * snapshot_get_labels - append saved labels and merge dependencies
+ * Returns the number of labels read or -1
+ */
+void
+snapshot_put_labels(FILE *fp, Label **labels) {
+	int n;
+
+	put_int(fp, is_volatile);
+	put_dependencies(fp);
+	for (n = 0; labels[n]; n++)
+		;
+	put_int(fp, n);
+	for (n = 0; labels[n]; n++)
+		put_label(fp, labels[n]);
+}
+
+int
+snapshot_get_labels(FILE *fp, Label **labels, int offset) {
+	int i, n;
+	Dependency *dep;
+
+	read_error = false;
+	if (get_int(fp))
+		is_volatile = true;
+
+	n = get_int(fp);
+	for (i = 0; i < n && !read_error; i++) {
+		dep = next_dependency();
+		dep->path = get_bytes(fp, NULL);
+		dep->size = get_int(fp);
+		dep->ino = get_int(fp);
+		dep->mtime_sec = get_int(fp);
+		dep->mtime_nsec = get_int(fp);
+		if (read_error || dep->path == NULL)
+			return -1;
+		if (has_dependency(dep->path))
+			free(dep->path);
+		else
+			n_dependencies++;
+	}
+
+	n = get_int(fp);
+	if (read_error || n < 0)
+		return -1;
+	/* caller reports the error */
+	if (offset + n >= MAX_LABELS)
+		return n;
+	for (i = 0; i < n && !read_error; i++)
+		labels[offset + i] = get_label(fp);
+	if (read_error)
+		return -1;
+	return n;
+}
@@ -0,0 +1,21 @@
+/*
+ * snapshot.h
+ * Save and restore parsed labels to avoid repeated parsing
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "input.h"
+
+#define SNAPSHOT_VERSION 3
+
+/* forwards */
+
+void snapshot_add_dependency(const char *);
+void snapshot_mark_volatile();
+bool snapshot_is_volatile();
+int snapshot_write(const char *);
+int snapshot_read(const char *, bool);
+void snapshot_put_labels(FILE *, Label **);
+int snapshot_get_labels(FILE *, Label **, int);
@@ -4,13 +4,17 @@
  */
 
 #include <sys/socket.h>
-#include <sys/time.h>
+#include <sys/un.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include <err.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -40,6 +44,8 @@ addr_listen(const char *host, const char *port, struct pollfd *pfd, struct socka
 			err(1, "bind");
 		if (listen(insock, SOMAXCONN) < 0)
 			err(1, "listen");
+		if (sock_set_nonblocking(insock))
+			exit(1);
 
 		pfd[addr_count].fd = insock;
 		pfd[addr_count].events = POLLIN;
@@ -51,22 +57,57 @@ addr_listen(const char *host, const char *port, struct pollfd *pfd, struct socka
 	return addr_count;
 }
 
+/*
+ * unix_listen - listen on a Unix domain socket, replacing a stale one
+ */
 int
-sock_set_timeout(int fd, int sec) {
-	struct timeval tv;
+unix_listen(const char *path, struct pollfd *pfd) {
+	int insock;
+	struct sockaddr_un sun;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", path) >= (int) sizeof(sun.sun_path))
+		errx(1, "socket path too long: %s", path);
+
+	if ((insock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		err(1, "socket");
+	unlink(path);
+	if (bind(insock, (struct sockaddr *) &sun, sizeof(sun)) < 0)
+		err(1, "bind %s", path);
+	if (listen(insock, SOMAXCONN) < 0)
+		err(1, "listen");
+	if (sock_set_nonblocking(insock))
+		exit(1);
+
+	pfd[0].fd = insock;
+	pfd[0].events = POLLIN;
+	return 1;
+}
 
-	tv.tv_sec = sec;
-	tv.tv_usec = 0;
+int
+sock_set_nonblocking(int fd) {
+	int flags;
 
-	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0
-	    || setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0) {
-		warn("setsockopt");
+	if ((flags = fcntl(fd, F_GETFL)) == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		warn("fcntl");
 		return 1;
 	}
 
 	return 0;
 }
 
+/*
+ * sock_set_nodelay - send the body of a response without waiting for the
+ * client to acknowledge the header
+ */
+void
+sock_set_nodelay(int fd) {
+	int on = 1;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
 int
 inaddr_to_str(const struct sockaddr_storage *in_sa, char *str, size_t len) {
 	switch (in_sa->ss_family) {
@@ -82,7 +123,26 @@ inaddr_to_str(const struct sockaddr_storage *in_sa, char *str, size_t len) {
 			return 1;
 		}
 		break;
+	case AF_UNIX:
+		snprintf(str, len, "local");
+		break;
 	}
 
 	return 0;
 }
+
+/*
+ * sock_is_loopback - check if a client connected from this host
+ */
+int
+sock_is_loopback(const struct sockaddr_storage *in_sa) {
+	switch (in_sa->ss_family) {
+	case AF_INET:
+		return (ntohl(((struct sockaddr_in *) in_sa)->sin_addr.s_addr) >> 24) == 127;
+	case AF_INET6:
+		return IN6_IS_ADDR_LOOPBACK(&((struct sockaddr_in6 *) in_sa)->sin6_addr);
+	case AF_UNIX:
+		return 1;
+	}
+	return 0;
+}
@@ -8,5 +8,8 @@
 #include <poll.h>
 
 int addr_listen(const char *, const char *, struct pollfd *, struct sockaddr_storage *);
-int sock_set_timeout(int, int);
+int unix_listen(const char *, struct pollfd *);
+int sock_set_nonblocking(int);
+void sock_set_nodelay(int);
 int inaddr_to_str(const struct sockaddr_storage *, char *, size_t);
+int sock_is_loopback(const struct sockaddr_storage *);
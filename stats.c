@@ -0,0 +1,153 @@
+/*
+ * stats.c
+ * Request counters and histograms for miniquark
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "stats.h"
+
+/* globals */
+static struct stats stats;
+
+/*
+ * bucket - index of the histogram bucket for a value; the first bucket
+ * holds values below 1, bucket n holds values below 2^n
+ */
+static int
+bucket(unsigned long v) {
+	int i;
+
+	for (i = 0; v > 0 && i < STATS_BUCKETS - 1; i++)
+		v >>= 1;
+	return i;
+}
+
+void
+stats_init(void) {
+	memset(&stats, 0, sizeof(stats));
+	stats.started = time(NULL);
+}
+
+/*
+ * stats_connection - count a connection that is opened (1) or closed (-1)
+ */
+void
+stats_connection(int delta) {
+	if (delta > 0)
+		stats.connections++;
+	stats.active += delta;
+}
+
+/*
+ * stats_request - count a response; times are in microseconds and are
+ * negative if the request was never received
+ */
+void
+stats_request(int status, unsigned long bytes, long ttfb, long duration) {
+	stats.requests++;
+	if (status >= 100 && status < 600)
+		stats.status[status / 100]++;
+	stats.bytes += bytes;
+	stats.size[bucket(bytes / 1024)]++;
+	if (ttfb >= 0)
+		stats.ttfb[bucket(ttfb / 1000)]++;
+	if (duration >= 0)
+		stats.duration[bucket(duration / 1000)]++;
+}
+
+static int
+out_printf(char **buf, size_t *len, size_t *size, const char *fmt, ...) {
+	int n;
+	char *p;
+	va_list ap;
+
+	while (1) {
+		va_start(ap, fmt);
+		n = vsnprintf(*buf + *len, *size - *len, fmt, ap);
+		va_end(ap);
+		if (n < 0)
+			return -1;
+		if ((size_t) n < *size - *len)
+			break;
+		if ((p = realloc(*buf, *size * 2 + n)) == NULL)
+			return -1;
+		*buf = p;
+		*size = *size * 2 + n;
+	}
+	*len += n;
+	return 0;
+}
+
+/*
+ * out_histogram - write one line for each bucket with its upper bound
+ */
+static int
+out_histogram(char **buf, size_t *len, size_t *size, const char *prefix, const char *name,
+    const unsigned long *h) {
+	int i;
+
+	for (i = 0; i < STATS_BUCKETS - 1; i++) {
+		if (out_printf(buf, len, size, "%s%s_lt %lu %lu\n", prefix, name, 1UL << i, h[i]) < 0)
+			return -1;
+	}
+	return out_printf(buf, len, size, "%s%s_lt inf %lu\n", prefix, name, h[i]);
+}
+
+void
+stats_log_dropped(void) {
+	stats.log_dropped++;
+}
+
+/*
+ * stats_format - list "name value" for each counter and "name_lt bound count"
+ * for each histogram bucket, prepending a prefix to each line
+ * Returns an allocated buffer or NULL on error
+ */
+char *
+stats_format(const char *prefix, size_t *len) {
+	int i;
+	size_t size = 4096;
+	char *buf;
+	const struct cache_stats *cs = cache_stats();
+
+	*len = 0;
+	if ((buf = malloc(size)) == NULL)
+		return NULL;
+
+	if (out_printf(&buf, len, &size,
+	        "%suptime %lld\n"
+	        "%sconnections %lu\n"
+	        "%sconnections_active %lu\n"
+	        "%srequests %lu\n",
+	        prefix, (long long) (time(NULL) - stats.started), prefix, stats.connections,
+	        prefix, stats.active, prefix, stats.requests)
+	    < 0)
+		goto fail;
+	for (i = 1; i < 6; i++) {
+		if (out_printf(&buf, len, &size, "%srequests_%dxx %lu\n", prefix, i, stats.status[i])
+		    < 0)
+			goto fail;
+	}
+	if (out_printf(&buf, len, &size,
+	        "%sbytes_sent %llu\n"
+	        "%scache_hits %lu\n"
+	        "%scache_misses %lu\n"
+	        "%slog_dropped %lu\n",
+	        prefix, stats.bytes, prefix, cs->hits, prefix, cs->misses, prefix,
+	        stats.log_dropped)
+	        < 0
+	    || out_histogram(&buf, len, &size, prefix, "ttfb_ms", stats.ttfb) < 0
+	    || out_histogram(&buf, len, &size, prefix, "duration_ms", stats.duration) < 0
+	    || out_histogram(&buf, len, &size, prefix, "size_kb", stats.size) < 0)
+		goto fail;
+	return buf;
+
+fail:
+	free(buf);
+	return NULL;
+}
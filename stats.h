@@ -0,0 +1,29 @@
+/*
+ * stats.h
+ * Request counters and histograms for miniquark
+ */
+
+#include <stddef.h>
+#include <time.h>
+
+#define STATS_PATH "/_stats"
+#define STATS_BUCKETS 16 /* each histogram bucket is twice as wide as the previous */
+
+struct stats {
+	time_t started;
+	unsigned long connections;        /* accepted */
+	unsigned long active;             /* currently open */
+	unsigned long requests;
+	unsigned long status[6];          /* requests by status class, 1xx to 5xx */
+	unsigned long long bytes;
+	unsigned long log_dropped;        /* log lines discarded while output was blocked */
+	unsigned long ttfb[STATS_BUCKETS];     /* milliseconds to the first byte */
+	unsigned long duration[STATS_BUCKETS]; /* milliseconds to the last byte */
+	unsigned long size[STATS_BUCKETS];     /* kilobytes sent */
+};
+
+void stats_init(void);
+void stats_connection(int);
+void stats_request(int, unsigned long, long, long);
+void stats_log_dropped(void);
+char *stats_format(const char *, size_t *);
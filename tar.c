@@ -0,0 +1,175 @@
+/*
+ * tar.c
+ * Write a directory tree as a ustar archive for miniquark
+ */
+
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tar.h"
+
+static int
+write_all(int fd, const char *buf, size_t len) {
+	ssize_t nr;
+
+	while (len > 0) {
+		if ((nr = write(fd, buf, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += nr;
+		len -= nr;
+	}
+	return 0;
+}
+
+/*
+ * tar_header - write a ustar header block
+ * Returns 1 if the name cannot be represented
+ */
+static int
+tar_header(int fd, const char *name, const struct stat *st, char type) {
+	char h[TAR_BLOCK_SIZE];
+	const char *base = name;
+	size_t len = strlen(name), i;
+	unsigned int sum = 0;
+
+	memset(h, 0, sizeof(h));
+
+	/* long names are split into a prefix and a name at a slash */
+	if (len > 100) {
+		for (i = len - 101; i < len - 1 && i <= 155 && name[i] != '/'; i++)
+			;
+		if (i >= len - 1 || i > 155 || name[i] != '/')
+			return 1;
+		memcpy(h + 345, name, i);
+		base = name + i + 1;
+	}
+	memcpy(h, base, strlen(base));
+
+	snprintf(h + 100, 8, "%07o", (unsigned int) (st->st_mode & 0777));
+	snprintf(h + 108, 8, "%07o", 0);
+	snprintf(h + 116, 8, "%07o", 0);
+	snprintf(h + 124, 12, "%011llo", (type == '0') ? (unsigned long long) st->st_size : 0);
+	snprintf(h + 136, 12, "%011llo", (unsigned long long) st->st_mtime);
+	memset(h + 148, ' ', 8);
+	h[156] = type;
+	memcpy(h + 257, "ustar", 6);
+	memcpy(h + 263, "00", 2);
+
+	for (i = 0; i < sizeof(h); i++)
+		sum += (unsigned char) h[i];
+	snprintf(h + 148, 8, "%06o", sum);
+
+	return write_all(fd, h, sizeof(h)) ? -1 : 0;
+}
+
+/*
+ * tar_file - write the header and contents of a regular file
+ * A file that changes size is truncated or padded to the size in the header
+ */
+static int
+tar_file(int fd, const char *path, const char *name, const struct stat *st) {
+	int in, ret;
+	size_t len;
+	ssize_t nr;
+	off_t remaining = st->st_size;
+	char buf[65536];
+
+	if ((in = open(path, O_RDONLY)) == -1)
+		return 0;
+	if ((ret = tar_header(fd, name, st, '0')) != 0) {
+		close(in);
+		return (ret < 0) ? -1 : 0;
+	}
+
+	while (remaining > 0) {
+		len = (remaining < (off_t) sizeof(buf)) ? (size_t) remaining : sizeof(buf);
+		nr = read(in, buf, len);
+		if (nr < 0 && errno == EINTR)
+			continue;
+		if (nr <= 0) {
+			nr = len;
+			memset(buf, 0, nr);
+		}
+		if (write_all(fd, buf, nr) < 0) {
+			close(in);
+			return -1;
+		}
+		remaining -= nr;
+	}
+	close(in);
+
+	/* pad to a full block */
+	memset(buf, 0, TAR_BLOCK_SIZE);
+	if (st->st_size % TAR_BLOCK_SIZE)
+		return write_all(fd, buf, TAR_BLOCK_SIZE - st->st_size % TAR_BLOCK_SIZE);
+	return 0;
+}
+
+/*
+ * tar_dir - add the entries of a directory in lexical order; hidden entries
+ * are not served and are skipped
+ */
+static int
+tar_dir(int fd, const char *path, const char *prefix, int depth) {
+	int i, n, ret = 0;
+	char sub_path[PATH_MAX], name[PATH_MAX];
+	struct dirent **ents;
+	struct stat st;
+
+	if (depth > TAR_MAX_DEPTH || (n = scandir(path, &ents, NULL, alphasort)) < 0)
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		if (ret || ents[i]->d_name[0] == '.')
+			goto next;
+		/* leave room for the slash that is appended to directory names */
+		if (snprintf(sub_path, sizeof(sub_path), "%s/%s", path, ents[i]->d_name)
+		        >= (int) sizeof(sub_path)
+		    || snprintf(name, sizeof(name), "%s%s", prefix, ents[i]->d_name)
+		           >= (int) sizeof(name) - 1)
+			goto next;
+		if (stat(sub_path, &st) < 0)
+			goto next;
+
+		if (S_ISDIR(st.st_mode)) {
+			strcat(name, "/");
+			if ((ret = tar_header(fd, name, &st, '5')) > 0) {
+				ret = 0;
+				goto next;
+			}
+			if (ret == 0)
+				ret = tar_dir(fd, sub_path, name, depth + 1);
+		} else if (S_ISREG(st.st_mode)) {
+			ret = tar_file(fd, sub_path, name, &st);
+		}
+	next:
+		free(ents[i]);
+	}
+	free(ents);
+	return ret;
+}
+
+/*
+ * tar_write - write an archive of the regular files and directories below a
+ * directory, followed by the end-of-archive marker
+ */
+int
+tar_write(int fd, const char *dir) {
+	char end[TAR_BLOCK_SIZE * 2];
+
+	if (tar_dir(fd, dir, "", 0) < 0)
+		return -1;
+	memset(end, 0, sizeof(end));
+	return write_all(fd, end, sizeof(end));
+}
@@ -0,0 +1,9 @@
+/*
+ * tar.h
+ * Write a directory tree as a ustar archive for miniquark
+ */
+
+#define TAR_BLOCK_SIZE 512
+#define TAR_MAX_DEPTH 32
+
+int tar_write(int, const char *);
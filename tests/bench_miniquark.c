@@ -0,0 +1,346 @@
+/*
+ * bench_miniquark.c
+ * Replay a mix of requests against a local miniquark over concurrent
+ * persistent connections, and report throughput and latency
+ *
+ * usage: bench_miniquark [-c connections] [-n requests] port spec ...
+ *
+ * Each spec is "[weight:]path[|header]...", for example
+ *   9:/smallfile
+ *   1:/largefile|Range: bytes=0-65535
+ *   /smallfile|If-None-Match: *
+ */
+
+#include <sys/socket.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "missing/compat.h"
+
+#define MAX_CONNECTIONS 1024
+#define MAX_SPECS 64
+#define REQUEST_MAX 2048
+#define HEAD_MAX 8192
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+struct spec {
+	char request[REQUEST_MAX];
+	size_t len;
+	int weight;
+};
+
+/* state of a client connection */
+struct bconn {
+	int fd;
+	enum { B_SEND, B_HEAD, B_BODY, B_DONE } state;
+	const struct spec *spec;
+	size_t sent;
+	char head[HEAD_MAX];
+	size_t head_len;
+	long long remaining; /* body bytes still expected, or -1 until EOF */
+	int closing;         /* the server closes the connection after the response */
+	struct timespec start;
+};
+
+/* globals */
+struct spec specs[MAX_SPECS];
+int n_specs, total_weight;
+struct sockaddr_in addr;
+long *latencies;
+long n_started, n_done, n_requests, n_errors;
+unsigned long long bytes;
+
+static void
+usage(void) {
+	fprintf(stderr, "usage: bench_miniquark [-c connections] [-n requests] port spec ...\n");
+	exit(1);
+}
+
+static long
+elapsed_us(const struct timespec *since) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1000000 + (now.tv_nsec - since->tv_nsec) / 1000;
+}
+
+/*
+ * parse_spec - format the request for "[weight:]path[|header]..."
+ */
+static void
+parse_spec(struct spec *sp, char *str) {
+	char *p, *path;
+	int n;
+
+	sp->weight = 1;
+	if ((p = strchr(str, ':')) && p < strchr(str, '/')) {
+		*p = '\0';
+		if ((sp->weight = atoi(str)) < 1)
+			errx(1, "invalid weight '%s'", str);
+		str = p + 1;
+	}
+	path = strsep(&str, "|");
+	n = snprintf(sp->request, sizeof(sp->request), "GET %s HTTP/1.1\r\nHost: localhost\r\n"
+	    "User-Agent: bench_miniquark\r\n", path);
+	while ((p = strsep(&str, "|")) && n < (int) sizeof(sp->request))
+		n += snprintf(sp->request + n, sizeof(sp->request) - n, "%s\r\n", p);
+	if (n < (int) sizeof(sp->request))
+		n += snprintf(sp->request + n, sizeof(sp->request) - n, "\r\n");
+	if (n >= (int) sizeof(sp->request))
+		errx(1, "request for '%s' is too long", path);
+	sp->len = n;
+	total_weight += sp->weight;
+}
+
+static const struct spec *
+pick_spec(void) {
+	int i, r = random() % total_weight;
+
+	for (i = 0; r >= specs[i].weight; i++)
+		r -= specs[i].weight;
+	return &specs[i];
+}
+
+static void
+conn_close(struct bconn *c) {
+	if (c->fd != -1)
+		close(c->fd);
+	c->fd = -1;
+}
+
+/*
+ * conn_start - send the next request, connecting again if the server closed
+ * the previous connection
+ */
+static void
+conn_start(struct bconn *c) {
+	if (n_started == n_requests) {
+		conn_close(c);
+		c->state = B_DONE;
+		return;
+	}
+	if (c->fd == -1) {
+		if ((c->fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+			err(1, "socket");
+		if (connect(c->fd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+			err(1, "connect");
+		fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+	}
+	n_started++;
+	c->spec = pick_spec();
+	c->state = B_SEND;
+	c->sent = 0;
+	c->head_len = 0;
+	c->closing = 0;
+	clock_gettime(CLOCK_MONOTONIC, &c->start);
+}
+
+static void
+conn_finish(struct bconn *c, int ok) {
+	latencies[n_done++] = elapsed_us(&c->start);
+	if (!ok)
+		n_errors++;
+	if (c->closing || !ok)
+		conn_close(c);
+	conn_start(c);
+}
+
+/*
+ * parse_head - find the length of the body from the status and header fields
+ * Returns the number of header bytes, or 0 if the header is incomplete
+ */
+static size_t
+parse_head(struct bconn *c, int *status) {
+	char *end, *p;
+
+	c->head[c->head_len] = '\0';
+	if ((end = strstr(c->head, "\r\n\r\n")) == NULL)
+		return 0;
+	*end = '\0';
+
+	*status = (strncmp(c->head, "HTTP/1.1 ", 9) == 0) ? atoi(c->head + 9) : 0;
+	c->remaining = -1;
+	if ((p = strcasestr(c->head, "\r\nContent-Length: ")))
+		c->remaining = strtoll(p + 18, NULL, 10);
+	else if (*status == 304 || *status == 204)
+		c->remaining = 0;
+	c->closing = (strcasestr(c->head, "\r\nConnection: close") != NULL);
+	return end - c->head + 4;
+}
+
+static void
+conn_read(struct bconn *c) {
+	int status;
+	size_t hlen;
+	ssize_t nr;
+	char buf[65536];
+
+	if (c->state == B_HEAD) {
+		nr = read(c->fd, c->head + c->head_len, sizeof(c->head) - c->head_len - 1);
+	} else {
+		nr = read(c->fd, buf,
+		    (c->remaining >= 0 && c->remaining < (long long) sizeof(buf)) ? c->remaining
+		                                                                  : sizeof(buf));
+	}
+	if (nr < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (nr <= 0) {
+		/* a body without a length ends with the connection */
+		c->closing = 1;
+		conn_finish(c, c->state == B_BODY && c->remaining == -1);
+		return;
+	}
+	bytes += nr;
+
+	if (c->state == B_BODY) {
+		if (c->remaining > 0 && (c->remaining -= nr) == 0)
+			conn_finish(c, 1);
+		return;
+	}
+
+	c->head_len += nr;
+	if ((hlen = parse_head(c, &status)) == 0) {
+		if (c->head_len == sizeof(c->head) - 1)
+			conn_finish(c, 0);
+		return;
+	}
+	c->state = B_BODY;
+	if (c->remaining > 0)
+		c->remaining -= MIN(c->remaining, (long long) (c->head_len - hlen));
+	if (c->remaining == 0)
+		conn_finish(c, status >= 200 && status < 400);
+	else if (status < 200 || status >= 400)
+		n_errors++;
+}
+
+static void
+conn_write(struct bconn *c) {
+	ssize_t nr;
+
+	nr = write(c->fd, c->spec->request + c->sent, c->spec->len - c->sent);
+	if (nr < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		c->closing = 1;
+		conn_finish(c, 0);
+		return;
+	}
+	if ((c->sent += nr) == c->spec->len)
+		c->state = B_HEAD;
+}
+
+static int
+cmp_long(const void *a, const void *b) {
+	long la = *(const long *) a, lb = *(const long *) b;
+
+	return (la > lb) - (la < lb);
+}
+
+static double
+percentile(double p) {
+	long i = (long) (p * n_done);
+
+	return latencies[(i < n_done) ? i : n_done - 1] / 1000.0;
+}
+
+int
+main(int argc, char *argv[]) {
+	int ch, i, n, n_conns = 16;
+	double seconds;
+	const char *errstr;
+	struct timespec start;
+	struct bconn *conns;
+	struct pollfd *pfd;
+
+	n_requests = 10000;
+	while ((ch = getopt(argc, argv, "c:n:")) != -1) {
+		switch (ch) {
+		case 'c':
+			n_conns = strtonum(optarg, 1, MAX_CONNECTIONS, &errstr);
+			if (errstr)
+				errx(1, "connections is %s", errstr);
+			break;
+		case 'n':
+			n_requests = strtonum(optarg, 1, 100000000, &errstr);
+			if (errstr)
+				errx(1, "requests is %s", errstr);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc < 2 || argc - 1 > MAX_SPECS)
+		usage();
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	addr.sin_port = htons(strtonum(argv[0], 1, 65535, &errstr));
+	if (errstr)
+		errx(1, "port is %s", errstr);
+	for (n_specs = 0; n_specs < argc - 1; n_specs++)
+		parse_spec(&specs[n_specs], argv[n_specs + 1]);
+
+	if ((latencies = calloc(n_requests, sizeof(long))) == NULL
+	    || (conns = calloc(n_conns, sizeof(struct bconn))) == NULL
+	    || (pfd = calloc(n_conns, sizeof(struct pollfd))) == NULL)
+		err(1, "calloc");
+
+	srandom(time(NULL));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n_conns; i++) {
+		conns[i].fd = -1;
+		conn_start(&conns[i]);
+	}
+
+	while (n_done < n_requests) {
+		for (i = 0, n = 0; i < n_conns; i++) {
+			pfd[i].fd = conns[i].fd;
+			pfd[i].events = (conns[i].state == B_SEND) ? POLLOUT : POLLIN;
+			n += (conns[i].state != B_DONE);
+		}
+		if (n == 0)
+			break;
+		if (poll(pfd, n_conns, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		}
+		for (i = 0; i < n_conns; i++) {
+			if (!(pfd[i].revents & (POLLIN | POLLOUT | POLLHUP | POLLERR)))
+				continue;
+			if (conns[i].state == B_SEND)
+				conn_write(&conns[i]);
+			else if (conns[i].state != B_DONE)
+				conn_read(&conns[i]);
+		}
+	}
+	seconds = elapsed_us(&start) / 1e6;
+	if (n_done == 0)
+		errx(1, "no requests were completed");
+
+	qsort(latencies, n_done, sizeof(long), cmp_long);
+	printf("requests     %ld (%ld errors)\n", n_done, n_errors);
+	printf("connections  %d\n", n_conns);
+	printf("seconds      %.3f\n", seconds);
+	printf("requests/s   %.1f\n", n_done / seconds);
+	printf("MB/s         %.2f\n", bytes / seconds / 1048576);
+	printf("latency ms   p50 %.3f  p99 %.3f  p999 %.3f  max %.3f\n", percentile(0.5),
+	    percentile(0.99), percentile(0.999), latencies[n_done - 1] / 1000.0);
+
+	return n_errors ? 1 : 0;
+}
@@ -1,6 +1,7 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <strings.h>
 #include <unistd.h>
 
 #include "execute.h"
@@ -15,9 +16,10 @@ main(int argc, char *argv[]) {
 	size_t len;
 	char *buf;
 	char *cmd_argv[16];
+	Label label;
 
-	if (argc != 2) {
-		fprintf(stderr, "usage: ./cmd_pipe_stdin input_file\n");
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "usage: ./cmd_pipe_stdin input_file [local_script]\n");
 		return 1;
 	}
 
@@ -28,6 +30,15 @@ main(int argc, char *argv[]) {
 	len = read(fd, buf, ALLOCATION_SIZE);
 	close(fd);
 
+	/* stream output of a local script before the input */
+	if (argc == 3) {
+		bzero(&label, sizeof(label));
+		label.content = buf;
+		label.content_size = len;
+		label.generator = argv[2];
+		return cmd_pipe_local(cmd_argv, &label);
+	}
+
 	cmd_pipe_stdin(cmd_argv, buf, len);
 
 	return 0;
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <strings.h>
 
 #include "input.h"
 #include "xlibc.h"
@@ -23,19 +24,21 @@ main(int argc, char *argv[]) {
 	char cmd[PATH_MAX];
 	char *env;
 	char *mode;
+	Parser p;
 
 	if (argc != 3)
 		usage();
 	mode = argv[1];
 	env = xstrdup(argv[2], "env");
+	bzero(&p, sizeof(p));
 
 	switch (mode[0]) {
 	case 'E':
-		env_split_lines(env);
+		env_split_lines(&p, env);
 		printf("%s", env);
 		break;
 	case 'F':
-		env_file_check(env);
+		env_file_check(&p, env);
 		snprintf(cmd, PATH_MAX, "cat %s", env);
 		system(cmd);
 		break;
@@ -8,19 +8,20 @@ Label **route_labels;
 
 int
 main(int argc, char **argv) {
-	char *hostlist[MAX_LABELS];
+	char hostname[PLN_LABEL_SIZE];
 	int n;
 	int n_hosts;
+	HostRange range;
 
 	if (argc != 2) {
 		fprintf(stderr, "usage: ./hostlist hostname\n");
 		return 1;
 	}
 
-	n_hosts = expand_numeric_range(hostlist, argv[1]);
+	n_hosts = parse_numeric_range(&range, argv[1]);
 	printf("(%d)\n", n_hosts);
-	for (n = 0; hostlist[n]; n++)
-		printf("%s\n", hostlist[n]);
+	for (n = 0; n < n_hosts; n++)
+		printf("%s\n", range_format(&range, n, hostname, sizeof(hostname)));
 
 	return 0;
 }
@@ -1,3 +1,4 @@
+#include <err.h>
 #include <libgen.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,6 +9,7 @@
 #include "missing/compat.h"
 
 #include "rutils.h"
+#include "snapshot.h"
 #include "xlibc.h"
 
 /* forwards */
@@ -18,8 +20,6 @@ char *str_or_empty(char *s);
 
 /* globals */
 Label **route_labels;
-extern const char *yyfn;
-extern FILE *yyin;
 
 void usage();
 
@@ -28,16 +28,24 @@ usage() {
 	fprintf(stderr,
 	    "usage:\n"
 	    "  ./parser R routes_file\n"
-	    "  ./parser H hosts_file\n");
+	    "  ./parser H hosts_file\n"
+	    "  ./parser S routes_file\n"
+	    "  ./parser P routes_file\n");
 	exit(1);
 }
 
 int
 main(int argc, char *argv[]) {
-	int i, j;
+	int i, j, n;
+	int n_hosts;
+	char buf[PLN_LABEL_SIZE];
+	char *host[2] = { NULL, NULL };
+	char **aliases;
 	char *fn;
 	char *mode;
+	char snapshot_fn[] = "/tmp/rset_snapshot.XXXXXX";
 	Label **host_labels;
+	Parser p;
 
 	if (argc != 3)
 		usage();
@@ -48,6 +56,8 @@ main(int argc, char *argv[]) {
 	route_labels = alloc_labels();
 	switch (mode[0]) {
 	case 'R':
+	case 'S':
+	case 'P':
 		read_route_labels(fn);
 		expand_route_labels();
 		break;
@@ -57,13 +67,32 @@ main(int argc, char *argv[]) {
 		str_cpy(route_labels[0]->name, fn, PLN_LABEL_SIZE);
 		route_labels[0]->labels = alloc_labels();
 		route_labels[0]->labels[0] = xmalloc(sizeof(Label), "route_labels[].labels[]");
-		yyfn = fn;
-		yyin = fopen(fn, "r");
-		parse_pln(route_labels[0]->labels);
+		bzero(&p, sizeof(p));
+		p.fn = fn;
+		p.in = fopen(fn, "r");
+		p.mode = HostLabel;
+		parse_pln(&p, route_labels[0]->labels);
 		break;
 	}
 	chdir(xdirname(fn));
 
+	/* parse each pln file in a separate process */
+	if (mode[0] == 'P')
+		read_all_host_labels(4, 1);
+
+	/* parse all labels and then restore them from a snapshot */
+	if (mode[0] == 'S') {
+		for (i = 0; route_labels[i]; i++)
+			read_host_labels(route_labels[i]);
+		close(mkstemp(snapshot_fn));
+		if (snapshot_write(snapshot_fn) != 0)
+			errx(1, "snapshot_write %s", snapshot_fn);
+		route_labels = NULL;
+		if (snapshot_read(snapshot_fn, false) != 0)
+			errx(1, "snapshot_read %s", snapshot_fn);
+		unlink(snapshot_fn);
+	}
+
 	printf("[\n");
 	for (i = 0; route_labels[i]; i++) {
 		switch (mode[0]) {
@@ -73,52 +102,62 @@ main(int argc, char *argv[]) {
 		}
 		host_labels = route_labels[i]->labels;
 
-		if (i > 0)
-			printf(",\n");
-		indent(1);
-		printf("{\n");
-		indent(2);
-		printf("\"aliases\": %s,\n", array_to_json(route_labels[i]->aliases));
-		indent(2);
-		printf("\"export_paths\": %s,\n", array_to_json(route_labels[i]->export_paths));
-
-		indent(2);
-		printf("\"labels\": [\n");
-		for (j = 0; host_labels[j]; j++) {
-			if (j > 0)
+		/* list each host of a range as a route, as they are executed */
+		n_hosts = route_labels[i]->range ? range_count(route_labels[i]->range) : 1;
+		for (n = 0; n < n_hosts; n++) {
+			aliases = route_labels[i]->aliases;
+			if (route_labels[i]->range) {
+				host[0] = range_format(route_labels[i]->range, n, buf, sizeof(buf));
+				aliases = host;
+			}
+
+			if (i > 0 || n > 0)
 				printf(",\n");
-			indent(3);
+			indent(1);
 			printf("{\n");
-			indent(4);
-			printf("\"name\": \"%s\",\n", host_labels[j]->name);
-			indent(4);
-			printf("\"content_size\": %d,\n", host_labels[j]->content_size);
-			indent(4);
-			printf("\"options\": {\n");
-			indent(5);
-			printf("\"environment\": \"%s\",\n", quote(host_labels[j]->options.environment));
-			indent(5);
-			printf("\"environment_file\": \"%s\",\n", host_labels[j]->options.environment_file);
-			indent(5);
-			printf("\"interpreter\": \"%s\",\n", host_labels[j]->options.interpreter);
-			indent(5);
-			printf("\"local_interpreter\": \"%s\",\n", host_labels[j]->options.local_interpreter);
-			indent(5);
-			printf("\"execute_with\": \"%s\",\n", host_labels[j]->options.execute_with);
-			indent(5);
-			printf("\"begin\": \"%s\",\n", str_or_empty(host_labels[j]->options.begin));
-			indent(5);
-			printf("\"end\": \"%s\"\n", str_or_empty(host_labels[j]->options.end));
-			indent(4);
-			printf("}\n");
-			indent(3);
+			indent(2);
+			printf("\"aliases\": %s,\n", array_to_json(aliases));
+			indent(2);
+			printf("\"export_paths\": %s,\n", array_to_json(route_labels[i]->export_paths));
+
+			indent(2);
+			printf("\"labels\": [\n");
+			for (j = 0; host_labels[j]; j++) {
+				if (j > 0)
+					printf(",\n");
+				indent(3);
+				printf("{\n");
+				indent(4);
+				printf("\"name\": \"%s\",\n", host_labels[j]->name);
+				indent(4);
+				printf("\"content_size\": %d,\n", host_labels[j]->content_size);
+				indent(4);
+				printf("\"options\": {\n");
+				indent(5);
+				printf("\"environment\": \"%s\",\n", quote(host_labels[j]->options.environment));
+				indent(5);
+				printf("\"environment_file\": \"%s\",\n", host_labels[j]->options.environment_file);
+				indent(5);
+				printf("\"interpreter\": \"%s\",\n", host_labels[j]->options.interpreter);
+				indent(5);
+				printf("\"local_interpreter\": \"%s\",\n", host_labels[j]->options.local_interpreter);
+				indent(5);
+				printf("\"execute_with\": \"%s\",\n", host_labels[j]->options.execute_with);
+				indent(5);
+				printf("\"begin\": \"%s\",\n", str_or_empty(host_labels[j]->options.begin));
+				indent(5);
+				printf("\"end\": \"%s\"\n", str_or_empty(host_labels[j]->options.end));
+				indent(4);
+				printf("}\n");
+				indent(3);
+				printf("}");
+			}
+			printf("\n");
+			indent(2);
+			printf("]\n");
+			indent(1);
 			printf("}");
 		}
-		printf("\n");
-		indent(2);
-		printf("]\n");
-		indent(1);
-		printf("}");
 	}
 	printf("\n]\n");
 
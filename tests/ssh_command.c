@@ -21,6 +21,7 @@ usage() {
 	    "  ./ssh_command S hostname [export_paths]\n" /* Start session */
 	    "  ./ssh_command P hostname [env_override]\n" /* Remote execution over a pipe */
 	    "  ./ssh_command T hostname [env_override]\n" /* Remote execution with TTY */
+	    "  ./ssh_command M hostname hostname\n"       /* Pipe to hosts in new sessions */
 	    "  ./ssh_command A hostname [export_paths]\n" /* Archive files */
 	    "  ./ssh_command R hostname [export_paths]\n" /* Resore files */
 	    "  ./ssh_command E hostname\n");              /* End session */
@@ -32,6 +33,7 @@ main(int argc, char *argv[]) {
 	char *socket_path;
 	Label host_label = { .name = "networking" };
 	int http_port = 6000;
+	int i;
 	char *env_override = 0;
 	char *host_name;
 	char *mode;
@@ -49,7 +51,7 @@ main(int argc, char *argv[]) {
 	case 'S':
 		if (argc == 4)
 			str_to_array(host_label.export_paths, argv[3], PLN_MAX_PATHS, " ");
-		start_connection(socket_path, host_name, &host_label, http_port, NULL);
+		start_connection(socket_path, host_name, &host_label, http_port, NULL, NULL);
 		break;
 	case 'P':
 		if (argc == 4)
@@ -71,6 +73,13 @@ main(int argc, char *argv[]) {
 			str_to_array(host_label.export_paths, argv[3], PLN_MAX_PATHS, " ");
 		scp_archive(host_name, socket_path, &host_label, true);
 		break;
+	case 'M':
+		/* rset starts a new session for each host */
+		for (i = 2; i < argc; i++) {
+			generate_session_id();
+			ssh_command_pipe(argv[i], socket_path, &host_label, NULL);
+		}
+		break;
 	case 'E':
 		end_connection(socket_path, host_name);
 		break;
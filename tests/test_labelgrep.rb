@@ -1,10 +1,16 @@
 require 'open3'
+require 'tmpdir'
 
 # Test Utilities
 @tests = 0
 @test_description = 0
 
 # Setup
+@systmp = Dir.mktmpdir
+
+at_exit do
+  FileUtils.remove_dir @systmp
+end
 
 def try(descr)
   start = Time.now
@@ -52,3 +58,22 @@ try 'Find more than one match per label' do
   eq out, expected
   eq status.success?, true
 end
+
+try 'Search many files in parallel using an index' do
+  # enough files for several jobs of MIN_FILES_PER_JOB
+  files = 'input/t460s.pln input/common/openbsd.pln ' * 40
+  index = "#{@systmp}/labelgrep.idx"
+  expected, = Open3.capture3("../labelgrep -j 1 'pkg_add.' #{files}")
+  2.times do
+    out, err, status = Open3.capture3("../labelgrep -j 4 -x #{index} 'pkg_add.' #{files}")
+    eq err, ''
+    eq out, expected
+    eq status.success?, true
+  end
+  eq expected.lines.length, 160
+  eq File.exist?(index), true
+  out, err, status = Open3.capture3("../labelgrep -x #{index} 'not_in_any_file' #{files}")
+  eq err, ''
+  eq out, ''
+  eq status.success?, true
+end
@@ -2,6 +2,11 @@ require 'open3'
 require 'tempfile'
 require 'socket'
 require 'time'
+require 'digest'
+require 'zlib'
+require 'json'
+require 'rubygems/package'
+require 'stringio'
 
 # Test Utilities
 @tests = 0
@@ -39,6 +44,10 @@ def try(descr, skip=false)
   puts "#{delta}: #{descr}"
 end
 
+def etag(path)
+  "\"#{Digest::SHA256.file(File.join(@systmp, 'www', path)).hexdigest}\""
+end
+
 def eq(result, expected)
   a = result.to_s.gsub(/^/, '> ')
   b = expected.to_s.gsub(/^/, '< ')
@@ -65,10 +74,18 @@ puts "\e[32m---\e[39m"
     echo ABCDEFGHIJKLMNOPQRSTUVWXYZ > smallfile
     mkdir -p x/y
     echo 0123456789 > x/y/digits
+    touch x/.hidden
     touch noread.sh
     chmod 110 noread.sh
     touch empty.tar.gz
 }
+File.write(File.join(@systmp, 'www/numbers.txt'), (1..1000).to_a.join("\n"))
+File.write(File.join(@systmp, 'www/counting.txt'), (1..2000).to_a.join("\n"))
+File.write(File.join(@systmp, 'www/lines.txt'),
+           (1..30_000).map { |i| "line #{i} #{(i * 7919) % 1000}" }.join("\n"))
+Zlib::GzipWriter.open(File.join(@systmp, 'www/counting.txt.gz')) do |gz|
+  gz.write File.read(File.join(@systmp, 'www/counting.txt'))
+end
 
 # Temporary server
 
@@ -78,7 +95,7 @@ port = socket.local_address.ip_port
 socket.close
 
 reader, writer = IO.pipe
-@pid = spawn('../miniquark', '-d', File.join(@systmp, 'www'), port.to_s,
+@pid = spawn('../miniquark', '-j', '-d', File.join(@systmp, 'www'), port.to_s,
              out: writer, unsetenv_others: true)
 today = 'Sat, 11 Jul 2020 01:25:02 GMT'
 
@@ -92,25 +109,33 @@ end
 # Fetch content
 
 try 'HEAD request with target host and user-agent' do
-  Socket.tcp('localhost', port) do |sock|
-    sock.print <<~REQUEST
-      HEAD /largefile HTTP/1.0\r
-      Host: localhost\r
-      User-Agent: Ruby tcp\r
-      \r
-    REQUEST
-    sock.close_write
-    response = sock.read.gsub(/^(Date: |Last-Modified: ).+(\r)/, "\\1#{today}\\2")
-    eq response, <<~REPLY
-      HTTP/1.1 200 OK\r
-      Date: #{today}\r
-      Connection: close\r
-      Last-Modified: #{today}\r
-      Content-Type: application/octet-stream\r
-      Content-Length: 10485760\r
-      \r
-    REPLY
+  response = nil
+  # the digest is computed in the background after startup
+  50.times do
+    Socket.tcp('localhost', port) do |sock|
+      sock.print <<~REQUEST
+        HEAD /largefile HTTP/1.0\r
+        Host: localhost\r
+        User-Agent: Ruby tcp\r
+        \r
+      REQUEST
+      sock.close_write
+      response = sock.read.gsub(/^(Date: |Last-Modified: ).+(\r)/, "\\1#{today}\\2")
+    end
+    break if response.include?('ETag')
+
+    sleep 0.1
   end
+  eq response, <<~REPLY
+    HTTP/1.1 200 OK\r
+    Date: #{today}\r
+    Connection: close\r
+    Last-Modified: #{today}\r
+    Content-Type: application/octet-stream\r
+    Content-Length: 10485760\r
+    ETag: #{etag('largefile')}\r
+    \r
+  REPLY
 end
 
 try 'HEAD request for missing file' do
@@ -158,12 +183,27 @@ try 'GET a small file' do
       Last-Modified: #{today}\r
       Content-Type: application/octet-stream\r
       Content-Length: 27\r
+      ETag: #{etag('smallfile')}\r
       \r
       ABCDEFGHIJKLMNOPQRSTUVWXYZ
     REPLY
   end
 end
 
+try 'GET a small file while other connections are idle' do
+  idle = Array.new(20) do
+    sock = Socket.tcp('localhost', port)
+    sock.print "GET /smallfile HTTP/1.1\r\n"
+    sock
+  end
+  Socket.tcp('localhost', port) do |sock|
+    sock.print "GET /smallfile HTTP/1.0\r\n\r\n"
+    sock.close_write
+    eq sock.read.end_with?("\r\n\r\nABCDEFGHIJKLMNOPQRSTUVWXYZ\n"), true
+  end
+  idle.each(&:close)
+end
+
 try 'GET a small from a subdirectory' do
   Socket.tcp('localhost', port) do |sock|
     sock.print "GET /x/y/digits HTTP/1.0\r\n\r\n"
@@ -176,6 +216,7 @@ try 'GET a small from a subdirectory' do
       Last-Modified: #{today}\r
       Content-Type: application/octet-stream\r
       Content-Length: 11\r
+      ETag: #{etag('x/y/digits')}\r
       \r
       0123456789
     REPLY
@@ -195,12 +236,104 @@ try 'GET a file using If-Modified-Since' do
     eq response, <<~REPLY
       HTTP/1.1 304 Not Modified\r
       Date: #{today}\r
-      Connection: close\r
+      Connection: keep-alive\r
+      ETag: #{etag('smallfile')}\r
       \r
     REPLY
   end
 end
 
+try 'GET a file using If-None-Match' do
+  Socket.tcp('localhost', port) do |sock|
+    sock.print <<~REQUEST
+      GET /smallfile HTTP/1.1\r
+      If-None-Match: "0000", #{etag('smallfile')}\r
+      If-Modified-Since: Thu, 01 Jan 1970 00:00:00 GMT\r
+      \r
+    REQUEST
+    sock.close_write
+    response = sock.read.gsub(/(Date: |Last-Modified: ).+(\r)/, "\\1#{today}\\2")
+    eq response, <<~REPLY
+      HTTP/1.1 304 Not Modified\r
+      Date: #{today}\r
+      Connection: keep-alive\r
+      ETag: #{etag('smallfile')}\r
+      \r
+    REPLY
+  end
+end
+
+try 'GET a file using If-None-Match with a different digest' do
+  Socket.tcp('localhost', port) do |sock|
+    sock.print <<~REQUEST
+      GET /smallfile HTTP/1.1\r
+      If-None-Match: W/"#{'0' * 64}"\r
+      \r
+    REQUEST
+    sock.close_write
+    eq sock.read.end_with?("\r\n\r\nABCDEFGHIJKLMNOPQRSTUVWXYZ\n"), true
+  end
+end
+
+try 'GET a precompressed file' do
+  Socket.tcp('localhost', port) do |sock|
+    sock.print "GET /counting.txt HTTP/1.0\r\nAccept-Encoding: gzip, zstd;q=0\r\n\r\n"
+    sock.close_write
+    header, body = sock.read.split("\r\n\r\n", 2)
+    eq header.include?("Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n"), true
+    eq header.include?("ETag: \"#{etag('counting.txt')[1..-2]}-gzip\""), true
+    eq body, File.binread(File.join(@systmp, 'www', 'counting.txt.gz'))
+  end
+end
+
+try 'GET a text file compressed on the fly' do
+  2.times do
+    Socket.tcp('localhost', port) do |sock|
+      sock.print "GET /numbers.txt HTTP/1.0\r\nAccept-Encoding: deflate, gzip\r\n\r\n"
+      sock.close_write
+      header, body = sock.read.split("\r\n\r\n", 2)
+      eq header.include?("Content-Encoding: gzip\r\n"), true
+      eq header.include?("Content-Length: #{body.bytesize}\r\n"), true
+      eq Zlib.gunzip(body), File.read(File.join(@systmp, 'www', 'numbers.txt'))
+    end
+  end
+end
+
+try 'Compress a text file only after checking validators' do
+  tag = etag('lines.txt')[1..-2]
+  Socket.tcp('localhost', port) do |sock|
+    sock.print "HEAD /lines.txt HTTP/1.0\r\nAccept-Encoding: gzip\r\nIf-None-Match: \"#{tag}\"\r\n\r\n"
+    sock.close_write
+    header = sock.read
+    eq header.start_with?("HTTP/1.1 304 Not Modified\r\n"), true
+    eq header.include?("ETag: \"#{tag}\"\r\n"), true
+  end
+  Socket.tcp('localhost', port) do |sock|
+    sock.print "GET /lines.txt HTTP/1.0\r\nAccept-Encoding: gzip\r\n\r\n"
+    sock.close_write
+    header, body = sock.read.split("\r\n\r\n", 2)
+    eq header.include?("Content-Encoding: gzip\r\n"), true
+    eq body.bytesize < File.size(File.join(@systmp, 'www', 'lines.txt')) / 3, true
+    eq Zlib.gunzip(body), File.read(File.join(@systmp, 'www', 'lines.txt'))
+  end
+  Socket.tcp('localhost', port) do |sock|
+    sock.print "HEAD /lines.txt HTTP/1.0\r\nAccept-Encoding: gzip\r\nIf-None-Match: \"#{tag}\"\r\n\r\n"
+    sock.close_write
+    eq sock.read.include?("ETag: \"#{tag}-gzip\"\r\n"), true
+  end
+end
+
+try 'GET a text file without compression' do
+  Socket.tcp('localhost', port) do |sock|
+    sock.print "GET /numbers.txt HTTP/1.0\r\nAccept-Encoding: gzip;q=0\r\n\r\n"
+    sock.close_write
+    header, body = sock.read.split("\r\n\r\n", 2)
+    eq header.include?('Content-Encoding'), false
+    eq header.include?("Vary: Accept-Encoding\r\n"), true
+    eq body, File.read(File.join(@systmp, 'www', 'numbers.txt'))
+  end
+end
+
 try 'GET Range (partial content, part 1)' do
   Socket.tcp('localhost', port) do |sock|
     sock.print <<~REQUEST
@@ -213,11 +346,12 @@ try 'GET Range (partial content, part 1)' do
     eq response, <<~REPLY.chomp
       HTTP/1.1 206 Partial Content\r
       Date: #{today}\r
-      Connection: close\r
+      Connection: keep-alive\r
       Last-Modified: #{today}\r
       Content-Type: application/octet-stream\r
       Content-Length: 13\r
       Content-Range: bytes 0-12/27\r
+      ETag: #{etag('smallfile')}\r
       \r
       ABCDEFGHIJKLM
     REPLY
@@ -236,17 +370,53 @@ try 'GET Range (partial content, part 2)' do
     eq response, <<~REPLY
       HTTP/1.1 206 Partial Content\r
       Date: #{today}\r
-      Connection: close\r
+      Connection: keep-alive\r
       Last-Modified: #{today}\r
       Content-Type: application/octet-stream\r
       Content-Length: 14\r
       Content-Range: bytes 13-26/27\r
+      ETag: #{etag('smallfile')}\r
       \r
       NOPQRSTUVWXYZ
     REPLY
   end
 end
 
+try 'GET Range (large file)' do
+  Socket.tcp('localhost', port) do |sock|
+    sock.print <<~REQUEST
+      GET /largefile HTTP/1.1\r
+      Range: bytes=1000000-1199999\r
+      \r
+    REQUEST
+    sock.close_write
+    header, body = sock.read.split("\r\n\r\n", 2)
+    eq header.include?('Content-Range: bytes 1000000-1199999/10485760'), true
+    eq body.bytesize, 200_000
+    eq body, File.binread(File.join(@systmp, 'www', 'largefile'), 200_000, 1_000_000)
+  end
+end
+
+try 'Send the ETag of a large file once its digest is computed' do
+  File.binwrite(File.join(@systmp, 'www', 'newfile'), Random.new(1).bytes(9_000_000))
+  head = lambda do
+    Socket.tcp('localhost', port) do |sock|
+      sock.print "HEAD /newfile HTTP/1.0\r\n\r\n"
+      sock.close_write
+      sock.read
+    end
+  end
+  response = head.call
+  eq response.include?("Content-Length: 9000000\r\n"), true
+  eq response.include?('ETag'), false
+  50.times do
+    break if head.call.include?('ETag')
+
+    sleep 0.1
+  end
+  eq head.call.include?("ETag: #{etag('newfile')}\r\n"), true
+end
+
 try 'GET Range (past end of file)' do
   Socket.tcp('localhost', port) do |sock|
     sock.print <<~REQUEST
@@ -278,17 +448,94 @@ try 'GET Range (suffix)' do
     eq response, <<~REPLY
       HTTP/1.1 206 Partial Content\r
       Date: #{today}\r
-      Connection: close\r
+      Connection: keep-alive\r
       Last-Modified: #{today}\r
       Content-Type: application/octet-stream\r
       Content-Length: 8\r
       Content-Range: bytes 19-26/27\r
+      ETag: #{etag('smallfile')}\r
       \r
       TUVWXYZ
     REPLY
   end
 end
 
+try 'GET Range (multiple ranges)' do
+  Socket.tcp('localhost', port) do |sock|
+    sock.print <<~REQUEST
+      GET /smallfile HTTP/1.1\r
+      Range: bytes=0-2, -3\r
+      \r
+    REQUEST
+    sock.close_write
+    header, body = sock.read.split("\r\n\r\n", 2)
+    boundary = header[/boundary=(\h+)/, 1]
+    eq header.start_with?('HTTP/1.1 206 Partial Content'), true
+    eq header.include?("Content-Length: #{body.bytesize}"), true
+    eq body, <<~BODY
+      \r
+      --#{boundary}\r
+      Content-Type: application/octet-stream\r
+      Content-Range: bytes 0-2/27\r
+      \r
+      ABC\r
+      --#{boundary}\r
+      Content-Type: application/octet-stream\r
+      Content-Range: bytes 24-26/27\r
+      \r
+      YZ
+      \r
+      --#{boundary}--\r
+    BODY
+  end
+end
+
+try 'GET two pipelined requests on a persistent connection' do
+  Socket.tcp('localhost', port) do |sock|
+    sock.print "GET /x/y/digits HTTP/1.1\r\n\r\nGET /smallfile HTTP/1.1\r\n\r\n"
+    sock.close_write
+    response = sock.read.gsub(/(Date: |Last-Modified: ).+(\r)/, "\\1#{today}\\2")
+    eq response, <<~REPLY
+      HTTP/1.1 200 OK\r
+      Date: #{today}\r
+      Connection: keep-alive\r
+      Last-Modified: #{today}\r
+      Content-Type: application/octet-stream\r
+      Content-Length: 11\r
+      ETag: #{etag('x/y/digits')}\r
+      \r
+      0123456789
+      HTTP/1.1 200 OK\r
+      Date: #{today}\r
+      Connection: keep-alive\r
+      Last-Modified: #{today}\r
+      Content-Type: application/octet-stream\r
+      Content-Length: 27\r
+      ETag: #{etag('smallfile')}\r
+      \r
+      ABCDEFGHIJKLMNOPQRSTUVWXYZ
+    REPLY
+  end
+end
+
+try 'GET with Connection: close is not followed by another response' do
+  Socket.tcp('localhost', port) do |sock|
+    sock.print "GET /x/y/digits HTTP/1.1\r\nConnection: close\r\n\r\nGET /smallfile HTTP/1.1\r\n\r\n"
+    response = sock.read.gsub(/(Date: |Last-Modified: ).+(\r)/, "\\1#{today}\\2")
+    eq response, <<~REPLY
+      HTTP/1.1 200 OK\r
+      Date: #{today}\r
+      Connection: close\r
+      Last-Modified: #{today}\r
+      Content-Type: application/octet-stream\r
+      Content-Length: 11\r
+      ETag: #{etag('x/y/digits')}\r
+      \r
+      0123456789
+    REPLY
+  end
+end
+
 try 'GET Range (bogus range)' do
   Socket.tcp('localhost', port) do |sock|
     sock.print <<~REQUEST
@@ -320,6 +567,7 @@ try 'GET an empty archive' do
       Last-Modified: #{today}\r
       Content-Type: application/octet-stream\r
       Content-Length: 0\r
+      ETag: #{etag('empty.tar.gz')}\r
       \r
     REPLY
   end
@@ -357,6 +605,60 @@ try 'List a directory' do
   end
 end
 
+try 'GET a directory as a tar archive' do
+  Socket.tcp('localhost', port) do |sock|
+    sock.print "GET /x/?tar HTTP/1.1\r\n\r\n"
+    sock.close_write
+    header, body = sock.read.split("\r\n\r\n", 2)
+    eq header.sub(/Date: .+/, "Date: #{today}\r"), <<~REPLY.chomp
+      HTTP/1.1 200 OK\r
+      Date: #{today}\r
+      Connection: close\r
+      Content-Type: application/x-tar
+    REPLY
+    entries = {}
+    Gem::Package::TarReader.new(StringIO.new(body)).each do |entry|
+      entries[entry.full_name] = entry.file? ? entry.read : nil
+    end
+    eq entries, { 'y/' => nil, 'y/digits' => "0123456789\n" }
+  end
+end
+
+try 'GET the manifest of a directory' do
+  Socket.tcp('localhost', port) do |sock|
+    sock.print "GET /x/?manifest HTTP/1.0\r\n\r\n"
+    sock.close_write
+    header, body = sock.read.split("\r\n\r\n", 2)
+    eq header.include?("Content-Type: text/plain"), true
+    file = File.stat File.join(@systmp, 'www/x/y/digits')
+    eq body, "#{etag('x/y/digits')[1..-2]}\t11\t#{file.mtime.to_i}\ty/digits\n"
+  end
+end
+
+try 'GET the manifest of the top-level directory' do
+  Socket.tcp('localhost', port) do |sock|
+    sock.print "GET /?manifest HTTP/1.0\r\n\r\n"
+    sock.close_write
+    _, body = sock.read.split("\r\n\r\n", 2)
+    paths = body.lines.map { |line| line.chomp.split("\t")[3] }
+    eq paths.include?('x/y/digits'), true
+    eq paths.include?('subdir'), false
+    eq paths, paths.sort
+  end
+end
+
+try 'GET the manifest of files added after startup' do
+  FileUtils.mkdir_p(File.join(@systmp, 'www/late'))
+  File.binwrite(File.join(@systmp, 'www/late/data'), Random.new(2).bytes(9_000_000))
+  Socket.tcp('localhost', port) do |sock|
+    sock.print "GET /late/?manifest HTTP/1.1\r\n\r\n"
+    header, body = sock.read.split("\r\n\r\n", 2)
+    eq header.include?("Connection: close\r\n"), true
+    file = File.stat File.join(@systmp, 'www/late/data')
+    eq body, "#{etag('late/data')[1..-2]}\t9000000\t#{file.mtime.to_i}\tdata\n"
+  end
+end
+
 try 'POST JSON content' do
   Socket.tcp('localhost', port) do |sock|
     sock.print <<~DATA
@@ -380,6 +682,49 @@ try 'POST JSON content' do
   end
 end
 
+try 'GET server statistics' do
+  Socket.tcp('localhost', port) do |sock|
+    sock.print "GET /_stats HTTP/1.0\r\n\r\n"
+    sock.close_write
+    header, body = sock.read.split("\r\n\r\n", 2)
+    stats = body.lines.to_h { |line| line.split(' ', 2).map(&:strip) }
+    eq header.start_with?('HTTP/1.1 200 OK'), true
+    eq stats['requests_2xx'].to_i.positive?, true
+    eq stats['requests_4xx'].to_i.positive?, true
+    eq stats['connections_active'], '1'
+    eq body.lines.grep(/^ttfb_ms_lt /).size, 16
+  end
+end
+
+try 'Log a request as JSON with the session ID' do
+  Socket.tcp('localhost', port) do |sock|
+    sock.print "GET /x/y/digits HTTP/1.0\r\nX-Rset-Session: 0badcafe\r\n\r\n"
+    sock.close_write
+    sock.read
+  end
+  line = reader.gets until line&.include?('"session":"0badcafe"')
+  record = JSON.parse(line)
+  eq record['status'], 200
+  eq record['bytes'], 11
+  eq record['target'], '/x/y/digits'
+  eq record['duration_us'] >= record['ttfb_us'], true
+end
+
+try 'Report cache hit rate' do
+  3.times do
+    Socket.tcp('localhost', port) do |sock|
+      sock.print "GET /x/y/digits HTTP/1.0\r\n\r\n"
+      sock.close_write
+      eq sock.read.end_with?("\r\n\r\n0123456789\n"), true
+    end
+  end
+  Process.kill(:USR1, -@pid)
+  line = reader.gets until line&.start_with?('cache: ')
+  hits, misses = line.scan(/(\d+) (?:hits|misses)/).flatten.map(&:to_i)
+  eq hits >= 3, true
+  eq misses.positive?, true
+end
+
 try 'Fetch a 10MB file in parallel with an external utility' do
   pids = []
   src_url = "http://localhost:#{port}/largefile"
@@ -394,3 +739,45 @@ try 'Fetch a 10MB file in parallel with an external utility' do
     eq File.stat("#{@systmp}/largefile.#{i}").size, 10_485_760
   end
 end
+
+try 'Serve a small file ahead of a large one within a bandwidth limit' do
+  socket = Socket.new(:INET, :STREAM, 0)
+  socket.bind(Addrinfo.tcp('127.0.0.1', 0))
+  limited_port = socket.local_address.ip_port
+  socket.close
+
+  limited_reader, limited_writer = IO.pipe
+  limited = spawn('../miniquark', '-r', '2M', '-d', File.join(@systmp, 'www'),
+                  limited_port.to_s, out: limited_writer, unsetenv_others: true)
+  limited_reader.gets
+  start = Time.now
+  Socket.tcp('localhost', limited_port) do |large|
+    large.print "GET /largefile HTTP/1.1\r\nRange: bytes=0-1048575\r\nConnection: close\r\n\r\n"
+    sleep 0.1
+    Socket.tcp('localhost', limited_port) do |sock|
+      sock.print "GET /smallfile HTTP/1.0\r\n\r\n"
+      sock.close_write
+      eq sock.read.end_with?("\r\n\r\nABCDEFGHIJKLMNOPQRSTUVWXYZ\n"), true
+    end
+    eq large.read.split("\r\n\r\n", 2)[1].bytesize, 1_048_576
+  end
+  eq Time.now - start >= 0.3, true
+  Process.kill(:TERM, limited)
+  Process.wait limited
+end
+
+try 'GET a small file over a Unix domain socket' do
+  socket_path = File.join(@systmp, 'miniquark.sock')
+  local_reader, local_writer = IO.pipe
+  local = spawn('../miniquark', '-d', File.join(@systmp, 'www'), '-u', socket_path,
+                out: local_writer, unsetenv_others: true)
+  eq local_reader.gets, "Listening on #{socket_path}\n"
+  UNIXSocket.open(socket_path) do |sock|
+    sock.print "GET /smallfile HTTP/1.0\r\n\r\n"
+    sock.close_write
+    eq sock.read.end_with?("\r\n\r\nABCDEFGHIJKLMNOPQRSTUVWXYZ\n"), true
+  end
+  Process.kill(:TERM, local)
+  Process.wait local
+  eq File.exist?(socket_path), false
+end
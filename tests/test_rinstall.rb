@@ -230,3 +230,53 @@ try 'Raise error when source with absolute path is not found locally' do
   eq status.exitstatus, 1
   eq File.exist?(dst), false
 end
+
+try 'Install a list of files read from stdin' do
+  Dir.mkdir "#{@systmp}/#{@tests}"
+  dst1 = "#{@systmp}/#{@tests}/a.txt"
+  dst2 = "#{@systmp}/#{@tests}/b.txt"
+  File.write("#{@wwwtmp}/test_#{@tests}_a.txt", "a\n")
+  File.write("#{@wwwtmp}/test_#{@tests}_b.txt", "b\n")
+  File.write(dst2, "b\n")
+  cmd = "INSTALL_URL=#{@install_url} #{Dir.pwd}/../rinstall -m 640 -f -"
+  list = "test_#{@tests}_a.txt #{dst1} 600\ntest_#{@tests}_b.txt #{dst2}\n"
+  out, err, status = Open3.capture3(cmd, chdir: @systmp, stdin_data: list)
+  eq err, ''
+  eq out, "rinstall: created #{dst1}\n"
+  eq File.read(dst1), "a\n"
+  eq File.stat(dst1).mode.to_s(8), '100600'
+  eq File.stat(dst2).mode.to_s(8), '100640'
+  eq status.exitstatus, 0
+end
+
+try 'Install a list of files read from stdin using -b' do
+  dst = "#{@systmp}/test_#{@tests}.txt"
+  File.write("#{@wwwtmp}/test_#{@tests}.txt", "c\n")
+  cmd = "INSTALL_URL=#{@install_url} #{Dir.pwd}/../rinstall -b -m 600"
+  out, err, status = Open3.capture3(cmd, chdir: @systmp, stdin_data: "test_#{@tests}.txt #{dst}\n")
+  eq err, ''
+  eq out, "rinstall: created #{dst}\n"
+  eq File.read(dst), "c\n"
+  eq File.stat(dst).mode.to_s(8), '100600'
+  eq status.exitstatus, 0
+end
+
+try 'Resume a file fetched as ranges' do
+  fn = "test_#{@tests}.bin"
+  dst = "#{@systmp}/#{fn}"
+  data = Random.new(@tests).bytes(100_000)
+  File.binwrite("#{@wwwtmp}/#{fn}", data)
+  digest = Digest::SHA256.hexdigest(data)
+  File.open("#{@systmp}/.manifest", 'a') { |f| f.puts "#{digest}\t100000\t0\t#{fn}" }
+  # parts left by an interrupted run
+  parts = "#{File.dirname(@systmp)}/rinstall.#{Process.uid}/#{digest}"
+  FileUtils.mkdir_p parts
+  File.binwrite("#{parts}/0-24999", data[0, 25_000])
+  File.binwrite("#{parts}/25000-49999", data[25_000, 10_000])
+  cmd = "INSTALL_URL=#{@install_url} RINSTALL_RANGE_SIZE=1000 #{Dir.pwd}/../rinstall #{fn} #{dst}"
+  out, _, status = Open3.capture3(cmd, chdir: @systmp)
+  eq out, "rinstall: created #{dst}\n"
+  eq status.exitstatus, 0
+  eq File.binread(dst), data
+  eq File.exist?(parts), false
+end
@@ -13,17 +13,10 @@ require 'securerandom'
 @mynet = "#{@systmp}/mynet"
 FileUtils.cp_r 'input', @mynet
 FileUtils.chmod 0o700, @mynet
-@renv = "#{Dir.pwd}/stubs/renv"
-File.write @renv, <<~STUB
-  #!/bin/sh
-  echo renv $*
-STUB
-FileUtils.chmod 0o755, @renv
 FileUtils.chmod 0o750, 'input'
 
 at_exit do
   FileUtils.remove_dir @systmp
-  File.unlink @renv
 end
 
 ENV['PATH'] = "#{Dir.pwd}/../:#{ENV.fetch('PATH', nil)}"
@@ -82,6 +75,20 @@ try 'Pipe input to a command' do
   eq status.success?, true
 end
 
+try 'Stream output of local execution before input to a command' do
+  cmd = %(./cmd_pipe_stdin input/whereami.sh 'echo "# generated"')
+  out, err, status = Open3.capture3(cmd)
+  eq err, ''
+  eq out, "# generated\n#{File.read('input/whereami.sh')}"
+  eq status.success?, true
+
+  cmd = %(./cmd_pipe_stdin input/whereami.sh 'exit 3')
+  out, err, status = Open3.capture3(cmd)
+  eq err, "cmd_pipe_stdin: local execution for label '' exited with code 3\n"
+  eq out, File.read('input/whereami.sh')
+  eq status.exitstatus, 3
+end
+
 try 'Capture output of a command' do
   cmd = "./cmd_pipe_stdout head -n1 #{__FILE__}"
   out, err, status = Open3.capture3(cmd)
@@ -113,6 +120,14 @@ try 'Capture a large chunk of text from a command' do
   eq status.success?, true
 end
 
+try 'Capture output larger than the initial allocation' do
+  cmd = './cmd_pipe_stdout head -c 600000 /dev/zero'
+  out, err, status = Open3.capture3(cmd)
+  eq err, "output_size: 600000\nstrlen: 0\n"
+  eq out.length, 600_000
+  eq status.success?, true
+end
+
 try 'Locate an executable in the current path' do
   cmd = './which sh'
   out, err, status = Open3.capture3({ 'PATH' => '/bin:/usr/bin' }, cmd)
@@ -175,22 +190,46 @@ try 'Execute commands over ssh using a pipe' do
   out, err, status = Open3.capture3({ 'PATH' => "#{Dir.pwd}/stubs:#{Dir.pwd}/.." }, cmd)
   eq err, ''
   eq out, <<~RESULT
-    renv /dev/null /tmp/rset_env_XXXXXX
     ssh -q -S /tmp/test_rset_socket 10.0.0.98 'cat > /tmp/rset_00000000/final.env; touch /tmp/rset_00000000/local.env'
-    ssh -T -S /tmp/test_rset_socket 10.0.0.98 ' sh -c "cd /tmp/rset_00000000; set -a; . ./final.env; . ./local.env; SD='/tmp/rset_00000000'; exec /bin/sh"'
+    ssh -T -S /tmp/test_rset_socket 10.0.0.98 ' sh -c "cd /tmp/rset_00000000; set -a; . ./final.env; . ./local.env; SD='/tmp/rset_00000000'; RSET_SESSION=00000000; exec /bin/sh"'
+  RESULT
+  eq status.success?, true
+end
+
+try 'Execute commands over ssh with a normalized environment' do
+  env = %(A="one \t two "\nB=""$$HOME""\n)
+  out, err, status = Open3.capture3({ 'PATH' => "#{Dir.pwd}/stubs:#{Dir.pwd}/.." },
+                                    './ssh_command', 'P', '10.0.0.98', env)
+  eq err, ''
+  eq out.lines[0..2].join, <<~RESULT
+    A="one two"
+    B="\\$HOME"
+    ssh -q -S /tmp/test_rset_socket 10.0.0.98 'cat > /tmp/rset_00000000/final.env; touch /tmp/rset_00000000/local.env'
   RESULT
   eq status.success?, true
 end
 
+try 'Execute commands over ssh on two hosts in separate sessions' do
+  cmd = './ssh_command M 10.0.0.98 10.0.0.99'
+  out, err, status = Open3.capture3({ 'PATH' => "#{Dir.pwd}/stubs:#{Dir.pwd}/.." }, cmd)
+  eq err, ''
+  sessions = out.scan(/RSET_SESSION=([0-9a-f]{8});/).flatten
+  eq sessions.length, 2
+  eq sessions.uniq.length, 2
+  # the staging directory is named after the first session
+  eq out.scan(%r{SD='/tmp/rset_([0-9a-f]{8})'}).flatten, [sessions[0], sessions[0]]
+  eq out.lines.grep(/RSET_SESSION/).map { |line| line.split[4] }, ['10.0.0.98', '10.0.0.99']
+  eq status.success?, true
+end
+
 try 'Execute commands over ssh using a tty' do
   cmd = './ssh_command T 10.0.0.99'
   out, err, status = Open3.capture3({ 'PATH' => "#{Dir.pwd}/stubs:#{Dir.pwd}/.." }, cmd)
   eq err, ''
   eq out, <<~RESULT
-    renv /dev/null /tmp/rset_env_XXXXXX
     ssh -q -S /tmp/test_rset_socket 10.0.0.99 'cat > /tmp/rset_00000000/final.env; touch /tmp/rset_00000000/local.env'
     ssh -T -S /tmp/test_rset_socket 10.0.0.99 'cat > /tmp/rset_00000000/_script'
-    ssh -t -S /tmp/test_rset_socket 10.0.0.99 ' sh -c "cd /tmp/rset_00000000; set -a; . ./final.env; . ./local.env; SD='/tmp/rset_00000000'; exec /bin/sh /tmp/rset_00000000/_script"'
+    ssh -t -S /tmp/test_rset_socket 10.0.0.99 ' sh -c "cd /tmp/rset_00000000; set -a; . ./final.env; . ./local.env; SD='/tmp/rset_00000000'; RSET_SESSION=00000000; exec /bin/sh /tmp/rset_00000000/_script"'
   RESULT
   eq status.success?, true
 end
@@ -234,7 +273,7 @@ try 'End an ssh session' do
   out, err, status = Open3.capture3({ 'PATH' => "#{Dir.pwd}/stubs" }, cmd)
   eq err, ''
   eq out, <<~RESULT
-    ssh -S /tmp/test_rset_socket 10.0.0.99 rm -rf /tmp/rset_00000000
+    ssh -S /tmp/test_rset_socket 10.0.0.99 rm -rf /tmp/rset_00000000 /tmp/rset_00000000.sock
     ssh -q -S /tmp/test_rset_socket -O exit 10.0.0.99
   RESULT
   eq status.success?, true
@@ -276,6 +315,32 @@ try 'Recursively parse routes and hosts' do
   JSON.parse(out)
 end
 
+try 'Restore routes and hosts from a snapshot' do
+  cmd = './parser S input/routes.pln'
+  out, err, status = Open3.capture3(cmd)
+  eq err, ''
+  eq out, File.read('expected/recursive.json')
+  eq status.success?, true
+end
+
+try 'Parse pln files using multiple processes' do
+  cmd = './parser P input/routes.pln'
+  out, err, status = Open3.capture3(cmd)
+  eq err, ''
+  eq out, File.read('expected/recursive.json')
+  eq status.success?, true
+end
+
+try 'Defer local execution that is streamed' do
+  cmd = './parser H input/local_stream.pln'
+  out, err, status = Open3.capture3(cmd)
+  eq err, ''
+  eq status.success?, true
+  label = JSON.parse(out)[0]['labels'][0]
+  eq label['name'], 'generated'
+  eq label['content_size'], 10
+end
+
 # Parse Progressive Label Notation (fail)
 
 try 'Report an unknown syntax' do
@@ -289,6 +354,33 @@ try 'Report an unknown syntax' do
   eq status.success?, false
 end
 
+try 'Reject streamed local execution on a route label' do
+  fn = "#{@systmp}/routes.pln"
+  FileUtils.mkdir_p("#{@systmp}/_sources")
+  File.write(fn, "local_output=stream\nlocalhost:\n{\n\techo a.pln\n}\n")
+  cmd = "#{Dir.pwd}/../rset -n localhost"
+  out, err, status = Open3.capture3(cmd, chdir: @systmp)
+  eq err, "routes.pln: local_output=stream is not permitted for the route label 'localhost'\n"
+  eq out, ''
+  eq status.success?, false
+end
+
+try 'Report the first error when parsing using multiple processes' do
+  dir = "#{@systmp}/parallel"
+  FileUtils.mkdir_p(dir)
+  File.write("#{dir}/routes.pln", "localhost:\n\ta.pln\n\tb.pln\n\tc.pln\n\td.pln\n\te.pln\n")
+  File.write("#{dir}/a.pln", "one:\n\techo 1\n")
+  File.write("#{dir}/b.pln", "two:\n{\n\techo 'warning from b' >&2\n\techo 'echo 2'\n}\n")
+  File.write("#{dir}/c.pln", "three:\n\techo 3\n")
+  File.write("#{dir}/d.pln", "php\n")
+  File.write("#{dir}/e.pln", "perl\n")
+  cmd = "./parser P #{dir}/routes.pln"
+  out, err, status = Open3.capture3(cmd)
+  eq err, "warning from b\nd.pln: unknown symbol at line 1: 'php'\n"
+  eq out, ''
+  eq status.exitstatus, 1
+end
+
 try 'Detect local execution that does not emit a newline' do
   pln = 'input/local_exec.pln'
   cmd = "./parser H #{pln}"
@@ -479,11 +571,31 @@ try 'Expand hostlist of IP addresses' do
 end
 
 try 'Multiple hostlist ranges' do
-  cmd = "./hostlist 'web{1..2}-{11..8}.dev'"
+  cmd = "./hostlist 'web{1..2}-{8..9}.dev'"
   out, err, status = Open3.capture3(cmd)
-  eq err, "hostlist: maximum of 1 groups\n"
-  eq out, ''
-  eq status.success?, false
+  eq err, ''
+  eq out, <<~RESULT
+    (4)
+    web1-8.dev
+    web1-9.dev
+    web2-8.dev
+    web2-9.dev
+  RESULT
+  eq status.success?, true
+end
+
+try 'Zero-padded hostlist range' do
+  cmd = "./hostlist 'dc{1..2}-web{009..010}'"
+  out, err, status = Open3.capture3(cmd)
+  eq err, ''
+  eq out, <<~RESULT
+    (4)
+    dc1-web009
+    dc1-web010
+    dc2-web009
+    dc2-web010
+  RESULT
+  eq status.success?, true
 end
 
 try 'Invalid hostlist range' do
@@ -493,9 +605,15 @@ try 'Invalid hostlist range' do
   eq out, ''
   eq status.success?, false
 
-  cmd = "./hostlist 'web{1..9999}.dev'"
+  cmd = "./hostlist 'web{1..999}-{1..999}.dev'"
+  out, err, status = Open3.capture3(cmd)
+  eq err, "hostlist: maximum range exceeds 65536\n"
+  eq out, ''
+  eq status.success?, false
+
+  cmd = "./hostlist 'a{1..2}b{1..2}c{1..2}d{1..2}e{1..2}'"
   out, err, status = Open3.capture3(cmd)
-  eq err, "hostlist: maximum range exceeds 100\n"
+  eq err, "hostlist: maximum of 4 groups\n"
   eq out, ''
   eq status.success?, false
 end
@@ -547,3 +665,27 @@ try 'Raise error if no route pattern match is found' do
   eq err, "rset: No match for '127.+' in routes.pln\n"
   eq status.success?, false
 end
+
+try 'Reuse a snapshot of parsed routes until a pln file is modified' do
+  dir = "#{@systmp}/snapshot"
+  FileUtils.mkdir_p("#{dir}/_sources")
+  FileUtils.chmod 0o700, dir
+  File.write("#{dir}/routes.pln", "web1:\n\tweb.pln\n")
+  File.write("#{dir}/web.pln", "first:\n\ttrue\n")
+  cmd = "#{Dir.pwd}/../rset -n web1"
+  out1, err, status = Open3.capture3(cmd, chdir: dir)
+  eq err, ''
+  eq status.success?, true
+  eq File.exist?("#{dir}/.routes.pln.snapshot"), true
+
+  out2, err, status = Open3.capture3(cmd, chdir: dir)
+  eq err, ''
+  eq out2, out1
+  eq status.success?, true
+
+  File.write("#{dir}/web.pln", "first:\n\ttrue\nsecond:\n\ttrue\n")
+  out, err, status = Open3.capture3(cmd, chdir: dir)
+  eq err, ''
+  eq out.include?('econd'), true
+  eq status.success?, true
+end
@@ -76,6 +76,28 @@ try 'Append a line' do
   eq status.success?, true
 end
 
+try 'Replace several lines in one pass' do
+  fn = "test_#{@tests}.txt"
+  dst = "#{@systmp}/#{fn}"
+  File.write(dst, "a=2\nb=3\n")
+  File.chmod(0o640, dst)
+  cmd = "#{Dir.pwd}/../rsub -A -r 'a=[0-9]' -l 'a=5' -r 'b=[0-9]' -l 'b=6' " \
+        "-r 'c=[0-9]' -l 'c=7' #{dst}"
+  out, err, status = Open3.capture3(cmd, chdir: @systmp)
+  eq err, ''
+  eq out.gsub(/[-+]{3}(.*)\n/, ''),
+     "@@ -1,2 +1,3 @@\n" \
+     "-a=2\n" \
+     "-b=3\n" \
+     "+a=5\n" \
+     "+b=6\n" \
+     "+c=7\n"
+  eq File.read(dst), "a=5\nb=6\nc=7\n"
+  eq File.stat(dst).mode.to_s(8), '100640'
+  eq Dir["#{@systmp}/.rsub*"], []
+  eq status.success?, true
+end
+
 try 'No change' do
   fn = "test_#{@tests}.txt"
   dst = "#{@systmp}/#{fn}"
@@ -150,6 +172,37 @@ try 'Update a block' do
   eq Dir["#{@systmp}/rsub_*"], []
 end
 
+try 'Write through a symlink and keep hard links' do
+  dir = "#{@systmp}/test_#{@tests}"
+  Dir.mkdir dir
+  File.write("#{dir}/real", "a=1\n")
+  File.chmod(0o640, "#{dir}/real")
+  File.symlink('real', "#{dir}/link")
+  File.link("#{dir}/real", "#{dir}/hard")
+  cmd = "#{Dir.pwd}/../rsub -r 'a=1' -l 'a=2' #{dir}/link"
+  _, err, status = Open3.capture3(cmd, chdir: @systmp)
+  eq err, ''
+  eq status.success?, true
+  eq File.symlink?("#{dir}/link"), true
+  eq File.read("#{dir}/hard"), "a=2\n"
+  eq File.stat("#{dir}/real").mode.to_s(8), '100640'
+  eq Dir.children(dir).sort, %w[hard link real]
+end
+
+try 'Keep the mode of a replaced file' do
+  dst = "#{@systmp}/test_#{@tests}.txt"
+  File.write(dst, "a=1\n")
+  File.chmod(0o751, dst)
+  ino = File.stat(dst).ino
+  cmd = "#{Dir.pwd}/../rsub -r 'a=1' -l 'a=2' #{dst}"
+  _, err, status = Open3.capture3(cmd, chdir: @systmp)
+  eq err, ''
+  eq status.success?, true
+  eq File.read(dst), "a=2\n"
+  eq File.stat(dst).mode.to_s(8), '100751'
+  eq File.stat(dst).ino == ino, false
+end
+
 try 'Ensure that a relative target cannot be used' do
   fn = "test_#{@tests}.txt"
   dst = "#{@systmp}/#{fn}"